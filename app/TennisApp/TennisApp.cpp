@@ -7,6 +7,10 @@
 #include <iostream>
 #include <sstream>
 #include <ctime>
+#include <cstddef>
+#include <chrono>
+#include <vector>
+#include <map>
 #include "../../src/data_handler/business_model.h"
 #include "csv.h"
 
@@ -30,10 +34,15 @@ void print_help();
 bool check_args(int argc, char *argv[], eTasks *task);
 int pack(char csv_file[], char db_file[]);
 int unpack(char db_file[], char csv_file[]);
+int diff(char old_file[], char new_file[], char delta_file[]);
+int bench();
+bool check_file_extension(const char *str, const char *ext);
 
 enum eTasks {
 	T_Pack,
 	T_Unpack,
+	T_Diff,
+	T_Bench,
 	T_Unknown
 };
 
@@ -59,6 +68,16 @@ int main(int argc, char *argv[])
 			goto display_error;
 		else
 			return 0;
+	case T_Diff:
+		if (diff(argv[2], argv[3], argv[4]) != 0)
+			goto display_error;
+		else
+			return 0;
+	case T_Bench:
+		if (bench() != 0)
+			goto display_error;
+		else
+			return 0;
 	default:
 		goto display_error;
 	}
@@ -71,10 +90,11 @@ display_error:
 	return 1;
 }
 
-int pack(char csv_file[], char db_file[]) {
+// Reads the data-base header and all members of a member list
+int read_csv(char csv_file[], sDataBaseHeader *db_header, std::vector<sMember> &members) {
 
-	// Check if both files exist otherwise return error (1)
-	FILE *csv_fp, *db_fp;
+	// Check if the file exists otherwise return error (1)
+	FILE *csv_fp;
 	if (csv_fp = fopen(csv_file, "r")) {
 		fclose(csv_fp);
 	}
@@ -83,11 +103,6 @@ int pack(char csv_file[], char db_file[]) {
 		return 1;
 	}
 
-	if ((db_fp = fopen(db_file, "wb")) == NULL) {
-		std::cout << "Invalid DB file. File can't be opended" << std::endl;
-		return 1;
-	}
-
 	// Reopen CSV file with CSV reader
 	io::CSVReader<6, io::trim_chars<' ', '\t'>, io::no_quote_escape<';'>> reader(csv_file);
 
@@ -98,14 +113,14 @@ int pack(char csv_file[], char db_file[]) {
 		return 1;
 	}
 
-	// Read&Write Database header
-	sDataBaseHeader db_header;
+	// Read Database header
 	char *author, *date;
 	char *format;
 	char *formatversion;
 	char *eol;
+	memset(db_header, 0, sizeof(sDataBaseHeader));
 	try {
-		if (!reader.read_row(db_header.version, date, author, format, formatversion, eol)) {
+		if (!reader.read_row(db_header->version, date, author, format, formatversion, eol)) {
 			std::cout << "Can't read dateabase header from CSV" << std::endl;
 			return 1;
 		}
@@ -117,7 +132,7 @@ int pack(char csv_file[], char db_file[]) {
 		return 1;
 	}
 
-	strncpy(db_header.author, author, 16);
+	strncpy(db_header->author, author, 16);
 	std::istringstream is(date);
 	int d, m, y;
 	char delimiter;
@@ -130,12 +145,9 @@ int pack(char csv_file[], char db_file[]) {
 
 		// normalize:
 		time_t when = mktime(&t);
-		db_header.datetime_modified = when;
+		db_header->datetime_modified = when;
 	}
 
-
-	fwrite(&db_header, sizeof(db_header), 1, db_fp);
-
 	reader.next_line();
 
 	// Read data
@@ -146,35 +158,174 @@ int pack(char csv_file[], char db_file[]) {
 		return 1;
 	}
 
-	// Read CSV and fill DB file
+	// Read CSV
 	sMember member;
 	char *name;
 	char *given_name;
-	db_header.entry_count = 0;
+	members.clear();
 	try {
 		while (reader.read_row(member.id, name, given_name, member.properties, member.discount, member.card_id)) {
 			strncpy(member.name, name, 16);
 			strncpy(member.given_name, given_name, 16);
-			fwrite(&member, sizeof(member), 1, db_fp);
-			db_header.entry_count++;
+			members.push_back(member);
 		}
 	}
 	catch (const io::error::base &ex ) {
-		std::cout << "Can't read entry " << db_header.entry_count << " (counting starting from 0). Reason:" << std::endl;
+		std::cout << "Can't read entry " << members.size() << " (counting starting from 0). Reason:" << std::endl;
 		ex.format_error_message();
 		std::cout << ex.error_message_buffer << std::endl;
 		return 1;
 	}
+	db_header->entry_count = members.size();
+
+	return 0;
+}
+
+// Reads a packed member data-base
+int read_db(char db_file[], sDataBaseHeader *db_header, std::vector<sMember> &members) {
+	FILE *db_fp;
+	if (!(db_fp = fopen(db_file, "rb"))) {
+		std::cout << "Invalid DB file. File can't be opended" << std::endl;
+		return 1;
+	}
+
+	if (fread(db_header, sizeof(sDataBaseHeader), 1, db_fp) != 1) {
+		std::cout << "DB file too small to read header" << std::endl;
+		fclose(db_fp);
+		return 1;
+	}
+
+	members.resize(db_header->entry_count);
+	if (db_header->entry_count > 0 && fread(members.data(), sizeof(sMember), db_header->entry_count, db_fp) != db_header->entry_count) {
+		std::cout << "DB file contains less members than its header says" << std::endl;
+		fclose(db_fp);
+		return 1;
+	}
+
+	fclose(db_fp);
+
+	// Free slots left by a delta on the device
+	std::vector<sMember> used;
+	for (const sMember &member : members) {
+		if (member.id != 0)
+			used.push_back(member);
+	}
+	members.swap(used);
+	db_header->entry_count = members.size();
+	return 0;
+}
+
+// Member list or packed data-base, by the file-extension
+int read_members(char file[], sDataBaseHeader *db_header, std::vector<sMember> &members) {
+	if (check_file_extension(file, ".CSV"))
+		return read_csv(file, db_header, members);
+	return read_db(file, db_header, members);
+}
+
+int pack(char csv_file[], char db_file[]) {
+	sDataBaseHeader db_header;
+	std::vector<sMember> members;
+
+	if (read_csv(csv_file, &db_header, members) != 0)
+		return 1;
+
+	FILE *db_fp;
+	if ((db_fp = fopen(db_file, "wb")) == NULL) {
+		std::cout << "Invalid DB file. File can't be opended" << std::endl;
+		return 1;
+	}
 
-	// Update entry count in header and write it again
-	fseek(db_fp, 0, SEEK_SET); 
 	fwrite(&db_header, sizeof(db_header), 1, db_fp);
+	if (!members.empty())
+		fwrite(members.data(), sizeof(sMember), members.size(), db_fp);
 
 	fclose(db_fp);
 
 	return 0;
 }
 
+// Delta from the old to the new member list. The device applies it to the old data-base only.
+int diff(char old_file[], char new_file[], char delta_file[]) {
+	sDataBaseHeader old_header, new_header;
+	std::vector<sMember> old_members, new_members;
+
+	if (read_members(old_file, &old_header, old_members) != 0 || read_members(new_file, &new_header, new_members) != 0)
+		return 1;
+
+	if (new_header.version < old_header.version || (new_header.version == old_header.version && new_header.datetime_modified <= old_header.datetime_modified)) {
+		std::cout << "New data-base is not newer than the old one (version and date). The device would ignore the delta." << std::endl;
+		return 1;
+	}
+
+	std::map<uint32_t, const sMember*> old_by_id, new_by_id;
+	for (const sMember &member : old_members)
+		old_by_id[member.id] = &member;
+	for (const sMember &member : new_members)
+		new_by_id[member.id] = &member;
+	if (old_by_id.size() != old_members.size() || new_by_id.size() != new_members.size()) {
+		std::cout << "Member number used twice" << std::endl;
+		return 1;
+	}
+
+	std::vector<sDeltaEntry> entries;
+	sDeltaEntry entry;
+	uint32_t added = 0, updated = 0, removed = 0;
+	for (const sMember &member : old_members) {
+		if (new_by_id.count(member.id) == 0) {
+			memset(&entry, 0, sizeof(entry));
+			entry.operation = DB_DELTA_REMOVE;
+			entry.member.id = member.id;
+			entries.push_back(entry);
+			removed++;
+		}
+	}
+	for (const sMember &member : new_members) {
+		auto old_member = old_by_id.find(member.id);
+		if (old_member == old_by_id.end()) {
+			entry.operation = DB_DELTA_ADD;
+			added++;
+		}
+		else if (memcmp(old_member->second, &member, sizeof(sMember)) != 0) {
+			entry.operation = DB_DELTA_UPDATE;
+			updated++;
+		}
+		else {
+			continue;
+		}
+		entry.member = member;
+		entries.push_back(entry);
+	}
+
+	sDeltaHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = DB_DELTA_MAGIC;
+	header.base_version = old_header.version;
+	header.base_datetime_modified = old_header.datetime_modified;
+	header.target = new_header;
+	header.target.entry_count = new_members.size();
+	header.entry_count = entries.size();
+
+	sChecksum cs;
+	checksum_init(&cs);
+	checksum_update(&cs, &header, offsetof(sDeltaHeader, checksum));
+	if (!entries.empty())
+		checksum_update(&cs, entries.data(), entries.size() * sizeof(sDeltaEntry));
+	header.checksum = checksum_final(&cs);
+
+	FILE *delta_fp;
+	if ((delta_fp = fopen(delta_file, "wb")) == NULL) {
+		std::cout << "Invalid DLT file. File can't be opended" << std::endl;
+		return 1;
+	}
+	fwrite(&header, sizeof(header), 1, delta_fp);
+	if (!entries.empty())
+		fwrite(entries.data(), sizeof(sDeltaEntry), entries.size(), delta_fp);
+	fclose(delta_fp);
+
+	std::cout << "Delta: " << added << " added, " << updated << " updated, " << removed << " removed" << std::endl;
+	return 0;
+}
+
 int unpack(char db_file[], char csv_file[]) {
 
 	int nrc = 0;
@@ -294,6 +445,66 @@ int unpack(char db_file[], char csv_file[]) {
 	return nrc;
 }
 
+double bench_ms(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int bench() {
+	const uint32_t ROUNDS = 100000;
+	const uint32_t SIZE = 64 * 1024 * 1024;
+	const uint32_t BLOCK = 4096;
+
+	uint32_t errors = checksum_selftest(ROUNDS, (uint32_t) time(NULL));
+	std::cout << "Checksum selftest: " << errors << " of " << ROUNDS << " rounds differ" << std::endl;
+
+	std::vector<uint16_t> data(SIZE / 2);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = (uint16_t) rand();
+
+	// Device sized: one transaction record after the other
+	auto start = std::chrono::steady_clock::now();
+	uint32_t ref = 0;
+	for (uint32_t pos = 0; pos < SIZE; pos += sizeof(sTransaction))
+		ref += checksum_reference(&data[pos / 2], sizeof(sTransaction));
+	double ref_ms = bench_ms(start);
+
+	start = std::chrono::steady_clock::now();
+	uint32_t cs = 0;
+	for (uint32_t pos = 0; pos < SIZE; pos += sizeof(sTransaction))
+		cs += calculate_checksum(&data[pos / 2], sizeof(sTransaction));
+	double cs_ms = bench_ms(start);
+	if (cs != ref)
+		errors++;
+	std::cout << "Records   reference: " << ref_ms << " ms, deferred: " << cs_ms << " ms" << std::endl;
+
+	// One pass and streamed in blocks over 64 MB
+	start = std::chrono::steady_clock::now();
+	ref = checksum_reference(data.data(), SIZE);
+	ref_ms = bench_ms(start);
+
+	start = std::chrono::steady_clock::now();
+	cs = calculate_checksum(data.data(), SIZE);
+	cs_ms = bench_ms(start);
+	if (cs != ref)
+		errors++;
+
+	start = std::chrono::steady_clock::now();
+	sChecksum stream;
+	checksum_init(&stream);
+	for (uint32_t pos = 0; pos < SIZE; pos += BLOCK)
+		checksum_update(&stream, (uint8_t*) data.data() + pos, BLOCK);
+	double stream_ms = bench_ms(start);
+	if (checksum_final(&stream) != ref)
+		errors++;
+	std::cout << "64 MB     reference: " << ref_ms << " ms, deferred: " << cs_ms << " ms, streamed: " << stream_ms << " ms" << std::endl;
+
+	if (errors > 0) {
+		std::cout << "Checksum engine differs from the reference" << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
 bool check_file_extension(const char *str, const char *ext) {
 	int len = strlen(str);
 	int ext_len = strlen(ext);
@@ -302,6 +513,19 @@ bool check_file_extension(const char *str, const char *ext) {
 }
 
 bool check_args(int argc, char *argv[], eTasks *task) {
+	if (argc == 2 && _stricmp(argv[1], "BENCH") == 0) {
+		*task = T_Bench;
+		return true;
+	}
+
+	if (argc == 5 && _stricmp(argv[1], "DIFF") == 0) {
+		*task = T_Diff;
+
+		return (check_file_extension(argv[2], ".CSV") || check_file_extension(argv[2], ".DB"))
+			&& (check_file_extension(argv[3], ".CSV") || check_file_extension(argv[3], ".DB"))
+			&& check_file_extension(argv[4], ".DLT");
+	}
+
 	if (argc != 4)
 		return false;
 
@@ -337,6 +561,9 @@ void print_help() {
 	std::cout << "TASK:   Task which should be performed:" << std::endl;
 	std::cout << "        PACK: Packs the given csv data-base (memberlist) into the given outputfile (.db)." << std::endl;
 	std::cout << "        UNPACK: Unpacks the given transaction list (.db) into a csv outputfile." << std::endl;
+	std::cout << "        DIFF: Writes the changes from an old to a new memberlist (.csv or .db) as a delta (.dlt):" << std::endl;
+	std::cout << "              TennisApp.exe DIFF OLD NEW OUTPUT. Put the delta on the SD-card next to the old data-base." << std::endl;
+	std::cout << "        BENCH: Cross-checks the checksum engine and measures its speed (no INPUT and OUTPUT)." << std::endl;
 	std::cout << std::endl;
 	std::cout << "INPUT:  The input file with the correct file-extension according to the TASK." << std::endl;
 	std::cout << std::endl;
@@ -7,7 +7,9 @@
 #include "../data_handler/data_handler.h"
 #include "service_mode.h"
 #include "time_service_mode.h"
+#include "../util/timer_wheel.h"
 #include <string.h>
+#include <atomic>
 
 #define SERIAL_NUMBER 9051993
 #define MODEL_NUMBER 11235812
@@ -15,28 +17,23 @@
 #define SW_VERSION_MAJ 0x01
 #define SW_VERSION_MIN 0x00
 
-#define CMD_RESET   0x10
-#define CMD_SETUP   0x11
-#define CMD_POLL    0x12
-#define CMD_VEND    0x13
-#define CMD_READER  0x14
-#define CMD_EXPANSION  0x17
+// Feature level and options offered to the VMC. The level in use is the lower one of reader and VMC.
+#define READER_LEVEL        3
+#define MULTIVEND_LEVEL     2           // from this level on: several vends per session while the card stays
+#define SESSION_TIMEOUT     20000       // ms without a vend until a multi-vend session is cancelled
+#define OPTIONAL_FEATURES   0x00000000  // level 3 optional features the reader supports (none)
 
-#define SCMD_SETUP_CONFIG   0x00
-#define SCMD_SETUP_PRICES   0x01
+// Deadlines for commands that are answered from loop context (ms after arrival).
+// The reader config promises an answer within 5 s.
+#define VEND_DEADLINE       3000    // later vend requests are denied without touching the SD-card
+#define VEND_EXPIRE         4000    // the ISR denies on its own if the loop did not decide in time
+#define CMD_DEADLINE        1000    // only reported, the answer was already given by the ISR
 
-#define SCMD_VEND_REQUEST   0x00
-#define SCMD_VEND_CANCEL    0x01
-#define SCMD_VEND_SUCCESS   0x02
-#define SCMD_VEND_FAILURE   0x03
-#define SCMD_VEND_COMPLETE  0x04
-#define SCMD_VEND_CASHSALE  0x05
+#define QUEUE_SIZE          8       // must be a power of 2
+#define EVENT_DATA_SIZE     32
 
-#define SCMD_READER_DISABLE 0x00
-#define SCMD_READER_ENABLE  0x01
-#define SCMD_READER_CANCEL  0x02
-
-#define SCMD_EXPANSION_ID 0x00
+// Pseudo command in the queue: a prepared answer has been delivered to the VMC by a POLL
+#define EV_DELIVERED        0x00
 
 #define ERR_MEDIA_ERROR             0x00
 #define ERR_MEDIA_INVALID           0x10
@@ -58,6 +55,7 @@ enum eCashlessState {
   CS_Vend
 };
 
+// Only changed in loop context (cldev_run)
 eCashlessState state;
 
 struct sVcmSetup {
@@ -67,12 +65,73 @@ uint8_t rowsOnDisplay;
 uint8_t displayInfo;
 cPrice maxPrice;
 cPrice minPrice;
+uint32_t features;      // level 3 optional features enabled by the VMC
 } vcmSetup;
 
+// Level negotiated with SETUP CONFIG. Set by the ISR, it shapes the immediate answers.
+std::atomic<uint8_t> reader_level;
+
+// Command queue from the MDB interrupt into the loop. Single producer (ISR), single consumer (loop).
+struct sCldevEvent {
+    uint8_t  cmd;
+    uint8_t  len;
+    uint8_t  data[EVENT_DATA_SIZE];
+    uint32_t arrival;
+};
+
+sCldevEvent queue[QUEUE_SIZE];
+std::atomic<uint8_t> queue_head;    // written by the ISR only
+std::atomic<uint8_t> queue_tail;    // written by the loop only
+
+// Pre-armed answer: the loop prepares the complete frame (incl. CHK) and the ISR only sends it with the next POLL
+enum eOutboxState {
+    OB_Empty,       // loop may fill it
+    OB_Ready,       // ISR may send it, loop may take it back
+    OB_Sending      // ISR owns it
+};
+
+std::atomic<uint8_t> outbox_state;
+uint8_t outbox_frame[MDB_MAX_BLOCK + 1];
+uint8_t outbox_len;     // data bytes without CHK
+
+// Answer that waits in the loop until the outbox is free
+uint8_t deferred_data[MDB_MAX_BLOCK];
+uint8_t deferred_len;
+
+// Message for the VMC display. Only armed again when it changed or is about to disappear.
+#define DISPLAY_SIZE        32
+char display_msg[DISPLAY_SIZE + 1];
+uint8_t display_time;
+bool display_changed;
+bool display_due;               // the VMC is about to clear the message
+void display_timeout();
+sTimer display_timer = TW_TIMER(&display_timeout);
+
+// Vend request that was acknowledged by the ISR and waits for the loop to decide
+enum eVendStatus {
+    VS_None,
+    VS_Pending,     // queued, loop has not decided yet
+    VS_Decided,     // loop prepared the answer
+    VS_Expired      // ISR or VMC gave up, the loop must not approve anymore
+};
+
+std::atomic<uint8_t> vend_status;
+std::atomic<uint32_t> vend_arrival;
+
+// Requests the loop has already prepared for the current state
+bool session_requested;
+bool cancel_requested;
+
+// Member the session was opened for. Later vends of a multi-vend session don't need the card anymore.
+uint32_t session_member;
+bool session_timed_out;
+void session_timeout();
+sTimer session_timer = TW_TIMER(&session_timeout);
+
 bool check_MediaReady();
-bool check_MediaNotReady();
 bool check_ServieMode();
 bool check_TimeMode();
+void clear_display();
 
 void log_state(eCashlessState cl_state) {
     switch(cl_state) {
@@ -102,16 +161,20 @@ uint8_t answer_JustReset(uint8_t answer[]) {
     return 1;
 }
 
-uint8_t answer_ReaderConfigInfo(uint8_t answer[]) {
+bool multivend(uint8_t level) {
+    return level >= MULTIVEND_LEVEL;
+}
+
+uint8_t answer_ReaderConfigInfo(uint8_t answer[], uint8_t level) {
     log(LL_DEBUG, LM_CLDEV, "answer_ReaderConfigInfo");
     answer[0] = 0x01;               // Reader Config Data Response
-    answer[1] = 0x01;               // Only level 1 cmds are supported
+    answer[1] = level;              // Feature level
     answer[2] = 0x19;               // Currency Code (EUR) High
     answer[3] = 0x78;               // Currency Code (EUR) Low
     answer[4] = price_scale();      // Scale Factor 1
     answer[5] = price_dec_places(); // 2 Decimal Places
     answer[6] = 0x05;               // Max. 5 s response time
-    answer[7] = 0x00;               // No restoring founds, No multivend, No display, No Cash-Sale
+    answer[7] = multivend(level) ? 0x02 : 0x00;     // No restoring founds, multivend, No display, No Cash-Sale
     return 8;
 }
 
@@ -173,14 +236,22 @@ uint8_t answer_Cancelled(uint8_t answer[]) {
     return 1;
 }
 
-uint8_t answer_PeripheralID(uint8_t answer[]) {
+uint8_t answer_PeripheralID(uint8_t answer[], uint8_t level) {
     log(LL_DEBUG, LM_CLDEV, "answer_PeripheralID");
     answer[0] = 0x09;   // Peripheral ID
     // 3 chars Manufacturer Code, 12 chars serial number, 12 chars model number
     sprintf((char*) &answer[1], "FGH%012d%012d", SERIAL_NUMBER, MODEL_NUMBER);
     answer[28] = SW_VERSION_MAJ;    // SW Version Major
     answer[29] = SW_VERSION_MIN;    // SW Version Minor
-    return 30;
+    if(level < 3)
+        return 30;
+
+    // Level 3: optional feature bits the VMC may enable
+    answer[30] = (OPTIONAL_FEATURES >> 24) & 0xFF;
+    answer[31] = (OPTIONAL_FEATURES >> 16) & 0xFF;
+    answer[32] = (OPTIONAL_FEATURES >> 8) & 0xFF;
+    answer[33] = OPTIONAL_FEATURES & 0xFF;
+    return 34;
 }
 
 uint8_t answer_MalfunctionError(uint8_t answer[], uint8_t errorCode, uint8_t subCode) {
@@ -196,86 +267,252 @@ uint8_t answer_OutOfSequence(uint8_t answer[]) {
     return 1;
 }
 
-void do_cmd_setup_config(const uint8_t data[]) {
+//----------------------------------------------//
+// Queue and outbox                             //
+//----------------------------------------------//
+bool queue_full() {
+    uint8_t used = queue_head.load(std::memory_order_relaxed) - queue_tail.load(std::memory_order_acquire);
+    return used >= QUEUE_SIZE;
+}
+
+// ISR context only
+bool queue_push(uint8_t cmd, uint8_t len, const uint8_t data[]) {
+    if(queue_full())
+        return false;
+
+    uint8_t head = queue_head.load(std::memory_order_relaxed);
+    sCldevEvent *ev = &queue[head & (QUEUE_SIZE - 1)];
+    ev->cmd = cmd;
+    ev->len = (len < EVENT_DATA_SIZE) ? len : EVENT_DATA_SIZE;
+    memcpy(ev->data, data, ev->len);
+    ev->arrival = millis();
+
+    queue_head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+// Loop context only
+bool queue_pop(sCldevEvent *ev) {
+    uint8_t tail = queue_tail.load(std::memory_order_relaxed);
+    if(tail == queue_head.load(std::memory_order_acquire))
+        return false;
+
+    *ev = queue[tail & (QUEUE_SIZE - 1)];
+    queue_tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+// Loop context only
+bool post_answer(uint8_t len, const uint8_t answer[]) {
+    if(outbox_state.load(std::memory_order_acquire) != OB_Empty)
+        return false;
+
+    len = (len < MDB_MAX_BLOCK) ? len : MDB_MAX_BLOCK;
+    memcpy(outbox_frame, answer, len);
+    outbox_frame[len] = mdb_checksum(len, answer);
+    outbox_len = len;
+    outbox_state.store(OB_Ready, std::memory_order_release);
+    return true;
+}
+
+// Loop context only. Takes back a prepared answer with the given response code if it is not sent yet.
+bool retract_answer(uint8_t code) {
+    if(outbox_frame[0] != code)
+        return false;
+    uint8_t expected = OB_Ready;
+    return outbox_state.compare_exchange_strong(expected, OB_Empty);
+}
+
+// Loop context only. Answers which must not get lost wait here until the outbox is free.
+void defer_answer(uint8_t len, const uint8_t answer[]) {
+    if(post_answer(len, answer))
+        return;
+
+    len = (len < sizeof(deferred_data)) ? len : sizeof(deferred_data);
+    memcpy(deferred_data, answer, len);
+    deferred_len = len;
+}
+
+// ISR context only
+bool send_outbox() {
+    // The loop has to learn about the delivery, so keep the answer if the queue is full
+    if(queue_full())
+        return false;
+
+    uint8_t expected = OB_Ready;
+    if(!outbox_state.compare_exchange_strong(expected, OB_Sending))
+        return false;
+
+    mdb_send_frame(outbox_len + 1, outbox_frame);
+    queue_push(EV_DELIVERED, 1, outbox_frame);
+    outbox_state.store(OB_Empty, std::memory_order_release);
+    return true;
+}
+
+//----------------------------------------------//
+// Immediate answers (ISR context)              //
+//----------------------------------------------//
+void answer_poll() {
+    log(LL_DEBUG, LM_CLDEV, "answer_poll");
+
+    if(send_outbox())
+        return;
+
+    // The loop did not decide on a vend request in time. Deny it before the VMC gives up.
+    if(vend_status.load() == VS_Pending && (millis() - vend_arrival.load()) > VEND_EXPIRE && !queue_full()) {
+        uint8_t expected = VS_Pending;
+        if(vend_status.compare_exchange_strong(expected, VS_Expired)) {
+            uint8_t answer[4];
+            uint8_t len = answer_VendDenied(answer);
+            mdb_send_data(len, answer);
+            queue_push(EV_DELIVERED, len, answer);
+            return;
+        }
+    }
+
+    mdb_send_ack();
+}
+
+void isr_cmd_ack(const uint8_t data[]) {
+    mdb_send_ack();
+}
+
+void isr_cmd_unsupported(const uint8_t data[]) {
+    assertCnt(true, LL_ERROR, LM_CLDEV, "Command not supported");
+    mdb_send_nack();
+}
+
+void isr_cmd_poll(const uint8_t data[]) {
+    answer_poll();
+}
+
+void isr_cmd_reset(const uint8_t data[]) {
+    // Drop whatever the loop prepared. It also releases a pending vend request.
+    uint8_t expected = OB_Ready;
+    outbox_state.compare_exchange_strong(expected, OB_Empty);
+    vend_status = VS_Expired;
+    mdb_send_ack();
+}
+
+void isr_cmd_setup_config(const uint8_t data[]) {
+    uint8_t level = data[1];
+    level = (level < READER_LEVEL) ? level : READER_LEVEL;
+    level = (level > 0) ? level : 1;
+    reader_level = level;
+
+    uint8_t answer[8];
+    uint8_t len = answer_ReaderConfigInfo(answer, level);
+    mdb_send_data(len, answer);
+}
+
+void isr_cmd_vend_request(const uint8_t data[]) {
+    vend_arrival = millis();
+    vend_status = VS_Pending;
+    mdb_send_ack();
+}
+
+void isr_cmd_vend_cancel(const uint8_t data[]) {
+    uint8_t expected = VS_Pending;
+    vend_status.compare_exchange_strong(expected, VS_Expired);
+
+    uint8_t answer[4];
+    uint8_t len = answer_VendDenied(answer);
+    mdb_send_data(len, answer);
+}
+
+void isr_cmd_vend_complete(const uint8_t data[]) {
+    uint8_t answer[4];
+    uint8_t len = answer_EndSession(answer);
+    mdb_send_data(len, answer);
+}
+
+void isr_cmd_reader_cancel(const uint8_t data[]) {
+    uint8_t answer[4];
+    uint8_t len = answer_Cancelled(answer);
+    mdb_send_data(len, answer);
+}
+
+void isr_cmd_expansion_id(const uint8_t data[]) {
+    uint8_t answer[36];
+    uint8_t len = answer_PeripheralID(answer, reader_level.load());
+    mdb_send_data(len, answer);
+}
+
+//----------------------------------------------//
+// Command processing (loop context)            //
+//----------------------------------------------//
+bool transaction_open;
+
+void do_cmd_reset(const sCldevEvent *ev) {
+    log(LL_DEBUG, LM_CLDEV, "do_cmd_reset");
+
+    // Nothing prepared before the reset is valid anymore
+    uint8_t expected = OB_Ready;
+    outbox_state.compare_exchange_strong(expected, OB_Empty);
+    deferred_len = 0;
+
+    if(transaction_open) {
+        dh_cancle_transaction();
+        transaction_open = false;
+    }
+
+    uint8_t answer[4];
+    uint8_t len = answer_JustReset(answer);
+    post_answer(len, answer);
+}
+
+void do_cmd_setup_config(const sCldevEvent *ev) {
     log(LL_DEBUG, LM_CLDEV, "do_cmd_setup_config");
 
     // Copy the vcm data into vcmSetup
+    const uint8_t *data = &ev->data[1];
     vcmSetup.level = data[0];
     vcmSetup.columnsOnDisplay = data[1];
     vcmSetup.rowsOnDisplay = data[2];
     vcmSetup.displayInfo = data[3];
+    vcmSetup.features = 0;
 
-    // Answer
-    uint8_t answer[32];
-    uint8_t len = 0;
-    len = answer_ReaderConfigInfo(answer);
-    mdb_send_data(len, answer);
+    log(LL_INFO, LM_CLDEV, "VMC feature level:", (uint32_t) vcmSetup.level);
+    log(LL_INFO, LM_CLDEV, "Negotiated level: ", (uint32_t) reader_level.load());
 }
 
-void do_cmd_setup_prices(const uint8_t data[]) {
+void do_cmd_setup_prices(const sCldevEvent *ev) {
     log(LL_DEBUG, LM_CLDEV, "do_cmd_setup_prices");
 
+    const uint8_t *data = &ev->data[1];
     vcmSetup.maxPrice = read_price_uint16(data);        // max. price (not used)
     vcmSetup.minPrice = read_price_uint16(&data[2]);    // min. price (not used)
-
-    // No Answer
-    mdb_send_ack();
-}
-
-void do_cmd_poll() {
-    log(LL_DEBUG, LM_CLDEV, "do_cmd_poll");
-
-    // TODO
-    uint8_t answer[64];
-    uint8_t len = 0; 
-    //= answer_DisplayRequest(answer, 100, "Hallo Idiot.");
-    //mdb_send_data(len, answer);
-    //mdb_send_ack();
-
-    if(state == CS_Enabled && (check_MediaReady() || check_ServieMode())) {
-        len = answer_BeginSession(answer);
-        mdb_send_data(len, answer);
-        log(LL_INFO, LM_CLDEV, "Request sent to Begin Session");
-    }
-    else if(state == CS_Session_Idle && check_MediaNotReady() && !check_ServieMode()) {
-        len = answer_SessionCancelRequest(answer);
-        mdb_send_data(len, answer);
-        log(LL_INFO, LM_CLDEV, "Request sent to Cancle Session");
-    } else {
-
-        if(check_ServieMode()) {
-            if(check_TimeMode())
-                time_serv_run();
-            else    
-                serv_run();
-        } else {
-            mdb_send_ack();
-        }       
-    }
 }
 
-void do_cmd_vend_request(const uint8_t data[]) {
+void do_cmd_vend_request(const sCldevEvent *ev) {
     log(LL_DEBUG, LM_CLDEV, "do_cmd_vend_request");
 
+    const uint8_t *data = &ev->data[1];
     uint16_t price = (((uint16_t) data[0]) << 8) + data[1];
     uint16_t item = (((uint16_t) data[2]) << 8) + data[3];
     log(LL_INFO, LM_CLDEV, "Customer Requested the following item:");
     log(LL_INFO, LM_CLDEV,  "    Item-ID:", (uint32_t) item);
     log(LL_INFO, LM_CLDEV,  "    Item-Price:", (uint32_t) price);
 
+    assertRtn(vend_status.load() == VS_Expired, LL_WARNING, LM_CLDEV, "Vend request was already cancelled or denied");
+
     uint8_t answer[32];
     uint8_t len = 0;
+    bool approved = false;
+
+    if(millis() - ev->arrival > VEND_DEADLINE) {
+        assertCnt(true, LL_WARNING, LM_CLDEV, "Vend request missed its deadline. Deny it.");
+        len = answer_VendDenied(answer);
 
-    if(check_ServieMode()) {
+    } else if(check_ServieMode()) {
         if(check_TimeMode())
             time_serv_button_pressed(item);
         else
             serv_button_pressed(item);
         len = answer_VendDenied(answer);
-        mdb_send_data(len, answer);
 
     } else {
-        uint32_t membId = rfid_member_present();
+        uint32_t membId = session_member;
         if(membId > 0 && dh_is_available(membId, item)) {
 
             // Calculate end-price and discount
@@ -285,200 +522,265 @@ void do_cmd_vend_request(const uint8_t data[]) {
 
             // Store transition
             if(dh_create_transaction(membId, item, price, discount)) {
+                approved = true;
                 len = answer_VendApproved(answer, price);
-                mdb_send_data(len, answer);
-                dh_approve_transaction();
-                log(LL_INFO, LM_CLDEV, "Vend was approved with actual price: ", (uint32_t) price);
-            } else 
+            } else
             {
                 len = answer_VendDenied(answer);
-                mdb_send_data(len, answer);
                 log(LL_INFO, LM_CLDEV, "Vend was denied");
-            }        
+            }
         } else {
             len = answer_VendDenied(answer);
-            //len += answer_DisplayRequest(&answer[len], 20, "Schacht gesperrt");
-            mdb_send_data(len, answer);
             log(LL_INFO, LM_CLDEV, "Vend was denied because of invalid item choice");
         }
-    }    
+    }
+
+    // The ISR or the VMC may have given up while the SD-card was busy
+    uint8_t expected = VS_Pending;
+    if(!vend_status.compare_exchange_strong(expected, VS_Decided)) {
+        log(LL_WARNING, LM_CLDEV, "Vend request expired while it was processed");
+        if(approved)
+            dh_cancle_transaction();
+        return;
+    }
+
+    if(approved) {
+        dh_approve_transaction();
+        transaction_open = true;
+        log(LL_INFO, LM_CLDEV, "Vend was approved with actual price: ", (uint32_t) price);
+    }
+    defer_answer(len, answer);
 }
 
-void do_cmd_vend_cancel() {
+void do_cmd_vend_cancel(const sCldevEvent *ev) {
     log(LL_DEBUG, LM_CLDEV, "do_cmd_vend_cancel");
 
     log(LL_INFO, LM_CLDEV, "Vend was cancled by customer");
-    dh_cancle_transaction();
 
-    uint8_t answer[32];
-    uint8_t len = 0;
-    len = answer_VendDenied(answer);
-    mdb_send_data(len, answer);
+    // An approval which is not delivered yet must not reach the VMC anymore
+    if(deferred_len > 0 && deferred_data[0] == 0x05)
+        deferred_len = 0;
+    retract_answer(0x05);
+
+    if(transaction_open) {
+        dh_cancle_transaction();
+        transaction_open = false;
+    }
 }
 
-void do_cmd_vend_success(const uint8_t data[]) {
+void do_cmd_vend_success(const sCldevEvent *ev) {
     log(LL_DEBUG, LM_CLDEV, "do_cmd_vend_success");
 
+    const uint8_t *data = &ev->data[1];
     uint16_t item = (((uint16_t) data[0]) << 8) + data[1];
-    mdb_send_ack();
-
-    log(LL_INFO, LM_CLDEV, "Vend was a success. Customer got item");
+    log(LL_INFO, LM_CLDEV, "Vend was a success. Customer got item", (uint32_t) item);
     dh_complete_transaction();
-    
+    transaction_open = false;
 }
 
-void do_cmd_vend_failure() {
+void do_cmd_vend_failure(const sCldevEvent *ev) {
     log(LL_DEBUG, LM_CLDEV, "do_cmd_vend_failure");
 
     log(LL_INFO, LM_CLDEV, "Vend failed. Customer did not get any item");
     dh_cancle_transaction();
-
-    mdb_send_ack();
+    transaction_open = false;
 }
 
-void do_cmd_vend_complete() {
+void do_cmd_vend_complete(const sCldevEvent *ev) {
     log(LL_DEBUG, LM_CLDEV, "do_cmd_vend_complete");
 
-    uint8_t answer[32];
-    uint8_t len = 0;
-    len = answer_EndSession(answer);
-    mdb_send_data(len, answer);
+    // A cancel request which is not delivered yet is obsolete now
+    retract_answer(0x04);
     log(LL_INFO, LM_CLDEV, "Vend is now completed");
 }
 
-void do_cmd_vend_cashsale() {
-    assertCnt(true, LL_ERROR, LM_CLDEV, "Command Vend Cash Sale not supported");
-    mdb_send_nack(); // Not supported
-}
-
-void do_cmd_reader_disable() {
+void do_cmd_reader_disable(const sCldevEvent *ev) {
     log(LL_DEBUG, LM_CLDEV, "do_cmd_reader_disable");
     log(LL_WARNING, LM_CLDEV, "Disable Cashless-Device");
-    mdb_send_ack(); // Do nothing but respond
 }
 
-void do_cmd_reader_enable() {
+void do_cmd_reader_enable(const sCldevEvent *ev) {
     log(LL_DEBUG, LM_CLDEV, "do_cmd_reader_enable");
     log(LL_INFO, LM_CLDEV, "Enable Cashless-Device");
-    mdb_send_ack(); // Do nothing but respond
 }
 
-void do_cmd_reader_cancel() {
+void do_cmd_reader_cancel(const sCldevEvent *ev) {
     log(LL_DEBUG, LM_CLDEV, "do_cmd_reader_cancel");
-
-    uint8_t answer[32];
-    uint8_t len = 0;
-    len = answer_Cancelled(answer);
-    mdb_send_data(len, answer);
 }
 
-void do_cmd_expansion_id(const uint8_t data[]) {
+void do_cmd_expansion_id(const sCldevEvent *ev) {
     log(LL_DEBUG, LM_CLDEV, "do_cmd_expansion_id");
 
+    const uint8_t *data = &ev->data[1];
+
     char manu_code[4];
     memcpy(manu_code, data, 3);
     manu_code[3] = 0;
 
     char serial_number[13];
     memcpy(serial_number, data+3, 12);
-    serial_number[13] = 0;
+    serial_number[12] = 0;
 
     char model_number[13];
     memcpy(model_number, data+15, 12);
-    model_number[13] = 0;
-
-    uint16_t sw_version = data[27];
-    sw_version = (sw_version << 8) + data[28];
+    model_number[12] = 0;
 
     log(LL_DEBUG, LM_CLDEV, "Manufacturer Code:", manu_code);
     log(LL_DEBUG, LM_CLDEV, "Serial Number:    ", serial_number);
     log(LL_DEBUG, LM_CLDEV, "Model Number:     ", model_number);
     log_hexdump(LL_DEBUG, LM_CLDEV, "Software Version: ", 2, &data[27]);
+}
 
-    uint8_t answer[32];
-    uint8_t len = 0;
-    len = answer_PeripheralID(answer);
-    mdb_send_data(len, answer);
+void do_cmd_expansion_features(const sCldevEvent *ev) {
+    log(LL_DEBUG, LM_CLDEV, "do_cmd_expansion_features");
+
+    assertRtn(reader_level.load() < 3, LL_WARNING, LM_CLDEV, "Optional features are only available on level 3");
+
+    const uint8_t *data = &ev->data[1];
+    uint32_t requested = (((uint32_t) data[0]) << 24) | (((uint32_t) data[1]) << 16) | (((uint32_t) data[2]) << 8) | data[3];
+    vcmSetup.features = requested & OPTIONAL_FEATURES;
+
+    assertCnt(requested != vcmSetup.features, LL_WARNING, LM_CLDEV, "VMC enabled features the reader does not offer");
+    log(LL_INFO, LM_CLDEV, "Optional features enabled:", vcmSetup.features);
 }
 
-void do_cmd(uint8_t cmd, const uint8_t data[]) {
-    log(LL_DEBUG, LM_CLDEV, "do_cmd");
+//----------------------------------------------//
+// Command table                                //
+//----------------------------------------------//
+// One row per (cmd, subcmd). The length lookup for mdb_read, the immediate answer in the ISR,
+// the loop handler and the state check are all generated from it.
+#define SCMD_NONE       0xFF    // command without subcommand
+#define SCMD_COUNT      8       // subcommands 0x00 - 0x07 can be dispatched
+#define CMD_UNKNOWN     0xFF
+
+#define ST(s)           (1 << (s))
+#define ST_ANY          (ST(CS_Inactive) | ST(CS_Disabled) | ST(CS_Enabled) | ST(CS_Session_Idle) | ST(CS_Vend))
+#define ST_ACTIVE       (ST(CS_Disabled) | ST(CS_Enabled) | ST(CS_Session_Idle) | ST(CS_Vend))
+#define ST_SESSION      (ST(CS_Session_Idle) | ST(CS_Vend))
+
+typedef void (*tCmdAnswer)(const uint8_t data[]);       // ISR context, sends exactly one answer
+typedef void (*tCmdHandler)(const sCldevEvent *ev);     // loop context, 0 if the command is not queued
+
+struct sCmdEntry {
+    uint8_t     cmd;
+    uint8_t     scmd;
+    uint8_t     len;        // payload bytes after the subcommand
+    uint8_t     states;     // states in which the loop accepts the command
+    tCmdAnswer  answer;
+    tCmdHandler handler;
+};
 
-    switch(cmd) {
-        case CMD_RESET:
-            // TODO: Reset
-            break;
+constexpr sCmdEntry cmd_table[] = {
+//    cmd            scmd                     len   states                          answer                 handler
+    { CMD_RESET,     SCMD_NONE,                 0,  ST_ANY,                         isr_cmd_reset,         do_cmd_reset },
+    { CMD_SETUP,     SCMD_SETUP_CONFIG,         4,  ST_ANY,                         isr_cmd_setup_config,  do_cmd_setup_config },
+    { CMD_SETUP,     SCMD_SETUP_PRICES,         4,  ST_ANY,                         isr_cmd_ack,           do_cmd_setup_prices },
+    { CMD_POLL,      SCMD_NONE,                 0,  ST_ANY,                         isr_cmd_poll,          0 },
+    { CMD_VEND,      SCMD_VEND_REQUEST,         4,  ST(CS_Session_Idle),            isr_cmd_vend_request,  do_cmd_vend_request },
+    { CMD_VEND,      SCMD_VEND_CANCEL,          0,  ST_SESSION,                     isr_cmd_vend_cancel,   do_cmd_vend_cancel },
+    { CMD_VEND,      SCMD_VEND_SUCCESS,         2,  ST(CS_Vend),                    isr_cmd_ack,           do_cmd_vend_success },
+    { CMD_VEND,      SCMD_VEND_FAILURE,         0,  ST(CS_Vend),                    isr_cmd_ack,           do_cmd_vend_failure },
+    { CMD_VEND,      SCMD_VEND_COMPLETE,        0,  ST_SESSION | ST(CS_Enabled),    isr_cmd_vend_complete, do_cmd_vend_complete },
+    { CMD_VEND,      SCMD_VEND_CASHSALE,        4,  0,                              isr_cmd_unsupported,   0 },
+    { CMD_READER,    SCMD_READER_DISABLE,       0,  ST_ACTIVE,                      isr_cmd_ack,           do_cmd_reader_disable },
+    { CMD_READER,    SCMD_READER_ENABLE,        0,  ST_ACTIVE,                      isr_cmd_ack,           do_cmd_reader_enable },
+    { CMD_READER,    SCMD_READER_CANCEL,        0,  ST_ACTIVE,                      isr_cmd_reader_cancel, do_cmd_reader_cancel },
+    { CMD_EXPANSION, SCMD_EXPANSION_ID,        29,  ST_ANY,                         isr_cmd_expansion_id,  do_cmd_expansion_id },
+    { CMD_EXPANSION, SCMD_EXPANSION_FEATURES,   4,  ST_ANY,                         isr_cmd_ack,           do_cmd_expansion_features },
+};
 
-        case CMD_SETUP:
-            switch(data[0]) {
-                case SCMD_SETUP_CONFIG:
-                    do_cmd_setup_config(&data[1]);
-                    break;
-                case SCMD_SETUP_PRICES:
-                    do_cmd_setup_prices(&data[1]);
-                    break;  
-                default:
-                    assertRtn(true, LL_ERROR, LM_CLDEV, "Unknown SETUP-Subcmd");
-            } 
-            break;
+#define CMD_TABLE_SIZE  (sizeof(cmd_table) / sizeof(cmd_table[0]))
 
-        case CMD_POLL:
-            do_cmd_poll();
-            break;
+// Compile-time lookups. Written as single expressions to stay within C++11 constexpr.
+constexpr uint8_t find_cmd(uint8_t cmd, uint8_t scmd, uint8_t i) {
+    return (i >= CMD_TABLE_SIZE) ? CMD_UNKNOWN
+        : (cmd_table[i].cmd == cmd && (cmd_table[i].scmd == scmd || cmd_table[i].scmd == SCMD_NONE)) ? i
+        : find_cmd(cmd, scmd, i + 1);
+}
 
-        case CMD_VEND:
-            switch(data[0]) {
-                case SCMD_VEND_REQUEST:
-                    do_cmd_vend_request(&data[1]);
-                    break;
-                case SCMD_VEND_CANCEL:
-                    do_cmd_vend_cancel();
-                    break;   
-                case SCMD_VEND_SUCCESS:
-                    do_cmd_vend_success(&data[1]);
-                    break;
-                case SCMD_VEND_FAILURE:
-                    do_cmd_vend_failure();
-                    break;
-                case SCMD_VEND_COMPLETE:
-                    do_cmd_vend_complete();
-                    break;
-                case SCMD_VEND_CASHSALE:
-                    do_cmd_vend_cashsale();
-                    break;
-                default:
-                    assertRtn(true, LL_ERROR, LM_CLDEV, "Unknown VEND-Subcmd");
-            }
-            break;   
-
-        case CMD_READER:
-            switch(data[0]) {
-                case SCMD_READER_DISABLE:
-                    do_cmd_reader_disable();
-                    break;
-                case SCMD_READER_ENABLE:
-                    do_cmd_reader_enable();
-                    break;   
-                case SCMD_READER_CANCEL:
-                    do_cmd_reader_cancel();
-                    break;
-                default:
-                    assertRtn(true, LL_ERROR, LM_CLDEV, "Unknown READER-Subcmd");
-            }
-            break;    
-
-        case CMD_EXPANSION:
-            switch(data[0]) {
-                case SCMD_EXPANSION_ID:
-                    do_cmd_expansion_id(&data[2]);
-                    break;
-                default:
-                    assertRtn(true, LL_ERROR, LM_CLDEV, "Unknown EXPANSION-Subcmd");
-            }   
-            break;
-        default:
-            assertRtn(true, LL_ERROR, LM_CLDEV, "Unknown Cmd");
+constexpr uint8_t find_cmd_len(uint8_t cmd, uint8_t i) {
+    return (i >= CMD_TABLE_SIZE) ? CLDEV_INVALID_LEN
+        : (cmd_table[i].cmd != cmd) ? find_cmd_len(cmd, i + 1)
+        : (cmd_table[i].scmd == SCMD_NONE) ? 0 : 1;
+}
+
+constexpr bool check_cmd_table(uint8_t i) {
+    return (i >= CMD_TABLE_SIZE) ? true
+        : ((cmd_table[i].cmd & 0xF8) == CMD_RESET)
+          && (cmd_table[i].scmd < SCMD_COUNT || cmd_table[i].scmd == SCMD_NONE)
+          && (1 + cmd_table[i].len <= EVENT_DATA_SIZE)
+          && (cmd_table[i].answer != 0)
+          && (find_cmd(cmd_table[i].cmd, cmd_table[i].scmd, 0) == i)
+          && check_cmd_table(i + 1);
+}
+
+static_assert(check_cmd_table(0), "Invalid or duplicate entry in the MDB command table");
+
+#define CMD_LEN(c)  find_cmd_len(c, 0)
+#define CMD_ROW(c)  { find_cmd(c, 0, 0), find_cmd(c, 1, 0), find_cmd(c, 2, 0), find_cmd(c, 3, 0), \
+                      find_cmd(c, 4, 0), find_cmd(c, 5, 0), find_cmd(c, 6, 0), find_cmd(c, 7, 0) }
+
+constexpr uint8_t cmd_len[8] = {
+    CMD_LEN(0x10), CMD_LEN(0x11), CMD_LEN(0x12), CMD_LEN(0x13),
+    CMD_LEN(0x14), CMD_LEN(0x15), CMD_LEN(0x16), CMD_LEN(0x17)
+};
+
+constexpr uint8_t cmd_index[8][SCMD_COUNT] = {
+    CMD_ROW(0x10), CMD_ROW(0x11), CMD_ROW(0x12), CMD_ROW(0x13),
+    CMD_ROW(0x14), CMD_ROW(0x15), CMD_ROW(0x16), CMD_ROW(0x17)
+};
+
+// Safe to call from the ISR: constant time, no logging
+const sCmdEntry* find_entry(uint8_t cmd, uint8_t scmd) {
+    if((cmd & 0xF8) != CMD_RESET)
+        return 0;
+
+    uint8_t c = cmd & 0x07;
+    if(cmd_len[c] == CLDEV_INVALID_LEN)
+        return 0;
+    if(cmd_len[c] == 0)
+        scmd = 0;   // there is no subcommand byte
+    if(scmd >= SCMD_COUNT)
+        return 0;
+
+    uint8_t i = cmd_index[c][scmd];
+    return (i == CMD_UNKNOWN) ? 0 : &cmd_table[i];
+}
+
+// The VMC sent a command the current state does not allow
+void reject_cmd(const sCldevEvent *ev) {
+    log_hexdump(LL_WARNING, LM_CLDEV, "Command out of sequence:", ev->len, ev->data);
+
+    uint8_t answer[4];
+    uint8_t len;
+    uint8_t expected = VS_Pending;
+
+    // A vend request still waits for its answer
+    if(ev->cmd == CMD_VEND && ev->data[0] == SCMD_VEND_REQUEST && vend_status.compare_exchange_strong(expected, VS_Decided))
+        len = answer_VendDenied(answer);
+    else
+        len = answer_OutOfSequence(answer);
+    defer_answer(len, answer);
+}
+
+bool do_cmd(const sCldevEvent *ev) {
+    log(LL_DEBUG, LM_CLDEV, "do_cmd");
+
+    if(ev->cmd == EV_DELIVERED) {
+        log_hexdump(LL_DEBUG, LM_CLDEV, "Answer delivered to VMC:", ev->len, ev->data);
+        return true;
     }
+
+    const sCmdEntry *entry = find_entry(ev->cmd, ev->data[0]);
+    assertDo(entry == 0 || entry->handler == 0, LL_ERROR, LM_CLDEV, "Unknown Cmd", return false;);
+
+    if((entry->states & ST(state)) == 0) {
+        reject_cmd(ev);
+        return false;
+    }
+
+    (*entry->handler)(ev);
+    return true;
 }
 
 //----------------------------------------------//
@@ -500,24 +802,35 @@ bool check_ReaderDisable(uint8_t cmd, const uint8_t data[]) {
     return (cmd == CMD_READER) && (data[0] == SCMD_READER_DISABLE);
 }
 
+bool check_Delivered(uint8_t cmd, const uint8_t data[], uint8_t code) {
+    return (cmd == EV_DELIVERED) && (data[0] == code);
+}
+
+// No session before the member data-base is loaded: the card couldn't be checked
 bool check_MediaReady() {
+    if(!dh_ready())
+        return false;
+
     uint32_t membId = rfid_member_present();
     return (membId > 0);
 }
 
-bool check_MediaNotReady() {
+// The session can't go on: card gone, another member's card or no vend for too long (multi-vend).
+// The card session of the reader tells when the card has left the field.
+bool check_SessionLost() {
+    if(check_ServieMode())
+        return false;
+
     uint32_t membId = rfid_member_present();
-    return (membId == 0);
+    if(membId != session_member)
+        return true;
+    return multivend(reader_level.load()) && session_timed_out;
 }
 
 bool check_SessionComplete(uint8_t cmd, const uint8_t data[]) {
     return (cmd == CMD_VEND) && (data[0] == SCMD_VEND_COMPLETE);
 }
 
-bool check_VendRequest(uint8_t cmd, const uint8_t data[]) {
-    return (cmd == CMD_VEND) && (data[0] == SCMD_VEND_REQUEST);
-}
-
 bool check_VendEnd(uint8_t cmd, const uint8_t data[]) {
     if(cmd == CMD_VEND) {
         return (data[0] == SCMD_VEND_CANCEL) || (data[0] == SCMD_VEND_SUCCESS) || (data[0] == SCMD_VEND_FAILURE);
@@ -560,7 +873,7 @@ void transition_enabled(uint8_t cmd, const uint8_t data[]) {
         state = CS_Inactive;
     else if(check_ReaderDisable(cmd, data))
         state = CS_Disabled;
-    else if(cmd == CMD_POLL && (check_MediaReady() || check_ServieMode()))
+    else if(check_Delivered(cmd, data, 0x03))  // Begin Session reached the VMC
         state = CS_Session_Idle;    
 }
 
@@ -569,9 +882,9 @@ void transition_session_idle(uint8_t cmd, const uint8_t data[]) {
 
     if(check_Reset(cmd, data))
         state = CS_Inactive;
-    else if((check_MediaNotReady() && !check_ServieMode()) || check_SessionComplete(cmd, data))   
+    else if(check_SessionComplete(cmd, data))   
         state = CS_Enabled;
-    else if(check_VendRequest(cmd, data)) 
+    else if(check_Delivered(cmd, data, 0x05))  // Vend Approved reached the VMC
         state = CS_Vend;     
 }
 
@@ -579,190 +892,269 @@ void transition_vend(uint8_t cmd, const uint8_t data[]) {
     log(LL_DEBUG, LM_CLDEV, "transition_vend");
 
     if(check_Reset(cmd, data))
-        state = CS_Inactive; // TODO: Check for MediaNotReady
+        state = CS_Inactive;
     else if(check_VendEnd(cmd, data))
         state = CS_Session_Idle;    
-    else if((check_MediaNotReady() && !check_ServieMode()) || check_SessionComplete(cmd, data))   
+    else if(check_SessionComplete(cmd, data))   
         state = CS_Enabled;
 }
 
-//----------------------------------------------//
-// Global interfaces                            //
-//----------------------------------------------//
-
-void cldev_init() {
-    log(LL_DEBUG, LM_CLDEV, "cldev_init");
-
-    state = CS_Inactive;
-    memset(&vcmSetup, 0, sizeof(vcmSetup));
-    peri_set_led(1, false);
-    peri_set_led(2, false);
-
-    serv_init();
-    time_serv_init();
-}
-
-void cldev_run(uint8_t cmd, const uint8_t data[]) {
-    log(LL_DEBUG, LM_CLDEV, "cldev_run");
+void process_event(const sCldevEvent *ev) {
+    log(LL_DEBUG, LM_CLDEV, "process_event");
 
     eCashlessState old_state = state;
 
-    // Execute Cmd
-    do_cmd(cmd, data);
+    uint32_t age = millis() - ev->arrival;
+    if(age > CMD_DEADLINE)
+        log(LL_WARNING, LM_CLDEV, "Command was processed after its deadline. Age [ms]:", age);
+
+    // Execute Cmd. Rejected commands don't move the state machine.
+    if(!do_cmd(ev))
+        return;
 
     // Move along transistions
     switch(state) {
         case CS_Inactive:
-            transition_inactive(cmd, data);
+            transition_inactive(ev->cmd, ev->data);
             break;
 
         case CS_Disabled:
-            transition_disabled(cmd, data);
+            transition_disabled(ev->cmd, ev->data);
             break;
 
         case CS_Enabled:
-            transition_enabled(cmd, data);
+            transition_enabled(ev->cmd, ev->data);
             break;
 
         case CS_Session_Idle:  
-            transition_session_idle(cmd, data);
+            transition_session_idle(ev->cmd, ev->data);
             break;
 
         case CS_Vend:
-            transition_vend(cmd, data);
+            transition_vend(ev->cmd, ev->data);
             break;
 
         default:
             assertDo(true, LL_FATAL, LM_CLDEV, "Unknown state", resetOnError());            
     }
 
-    // Set status LED if not in state INACTIVE or DISABLED 
-    if(state == CS_Disabled || state == CS_Inactive) {
-        peri_set_led(1, false);
-        peri_set_led(2, false);
-    } else {
-        if(state == CS_Enabled) {
-            peri_set_led(1, true);
-            peri_set_led(2, false);
-        } else if(state == CS_Session_Idle) {
-            peri_set_led(1, false);
-            peri_set_led(2, true);
-        } else {
-            peri_set_led(1, true);
-            peri_set_led(2, true);
+    if(state != old_state) {
+        // Session requests prepared for the old state are obsolete
+        if(session_requested)
+            retract_answer(0x03);
+        if(cancel_requested)
+            retract_answer(0x04);
+        session_requested = false;
+        cancel_requested = false;
+
+        bool was_session = (old_state == CS_Session_Idle || old_state == CS_Vend);
+        bool is_session = (state == CS_Session_Idle || state == CS_Vend);
+        if(is_session && !was_session) {
+            // Member data and transaction file stay cached until the session ends
+            log(LL_INFO, LM_CLDEV, "Session opened for member", session_member);
+            dh_begin_session();
+            session_timed_out = false;
+            tw_arm(&session_timer, SESSION_TIMEOUT);
+        } else if(was_session && !is_session) {
+            dh_end_session();
+            clear_display();
+            tw_cancel(&session_timer);
+            session_member = 0;
+        } else if(old_state == CS_Vend) {
+            // Every finished vend gives the member the full time for the next one
+            tw_arm(&session_timer, SESSION_TIMEOUT);
         }
-    }
 
-    if(state != CS_Disabled && state != CS_Inactive)
-    {
-        peri_set_led(1, true);
-    }
-    else
-    {
-        peri_set_led(1, false);
-    }
-    
-    if(state != old_state) {
         log(LL_INFO, LM_CLDEV, "Cashless-Device-State has changed from");
         log_state(old_state);
         log(LL_INFO, LM_CLDEV, "to");
         log_state(state);
     }
+}
 
+// Arms the display message if it changed or the VMC is about to clear it
+void arm_display() {
+    if(display_msg[0] == 0 || outbox_state.load() != OB_Empty)
+        return;
+    if(!display_changed && !display_due)
+        return;
+
+    uint8_t answer[MDB_MAX_BLOCK];
+    uint8_t len = answer_DisplayRequest(answer, display_time, display_msg);
+    if(post_answer(len, answer)) {
+        display_changed = false;
+        display_due = false;
+        tw_arm(&display_timer, (uint32_t) display_time * 50);     // half of the display time
+    }
 }
 
-uint8_t cldev_cmd_len(uint8_t cmd) {
-    log(LL_DEBUG, LM_CLDEV, "cldev_cmd_len");
+void display_timeout() {
+    display_due = true;
+}
+
+void clear_display() {
+    display_msg[0] = 0;
+    display_time = 0;
+    display_changed = false;
+    display_due = false;
+    tw_cancel(&display_timer);
+}
 
-    switch(cmd) {
-        case CMD_RESET:
-            return 0;
+// A timeout during a vend does not count, the finished vend starts the timer again
+void session_timeout() {
+    if(state != CS_Session_Idle)
+        return;
+    session_timed_out = true;
+    log(LL_INFO, LM_CLDEV, "No vend within the session timeout");
+}
 
-        case CMD_SETUP:
-            return 1;
+// Prepare the answer for the next POLL from card presence and service mode
+void prepare_answers() {
+    log(LL_DEBUG, LM_CLDEV, "prepare_answers");
 
-        case CMD_POLL:
-            return 0;
+    if(deferred_len > 0) {
+        if(post_answer(deferred_len, deferred_data))
+            deferred_len = 0;
+        return;
+    }
+
+    uint8_t answer[64];
+    uint8_t len = 0;
+    bool media = check_MediaReady() || check_ServieMode();
+
+    if(state == CS_Enabled) {
+        if(media && !session_requested) {
+            len = answer_BeginSession(answer);
+            if(post_answer(len, answer)) {
+                session_requested = true;
+                session_member = rfid_member_present();
+                log(LL_INFO, LM_CLDEV, "Request prepared to Begin Session");
+            }
+        } else if(!media && session_requested && retract_answer(0x03)) {
+            session_requested = false;
+            log(LL_INFO, LM_CLDEV, "Card removed before the session began");
+        }
+    } else if(state == CS_Session_Idle) {
+        if(check_SessionLost() && !cancel_requested) {
+            len = answer_SessionCancelRequest(answer);
+            if(post_answer(len, answer)) {
+                cancel_requested = true;
+                log(LL_INFO, LM_CLDEV, "Request prepared to Cancle Session");
+            }
+        } else if(check_ServieMode()) {
+            if(check_TimeMode())
+                time_serv_run();
+            else    
+                serv_run();
+            arm_display();
+        }
+    }
+}
 
-        case CMD_VEND:
-            return 1;
+void update_leds() {
+    // LED 1: reader is enabled, LED 2: session is open
+    bool active = (state != CS_Disabled && state != CS_Inactive);
+    bool session = (state == CS_Session_Idle || state == CS_Vend);
+    peri_set_led(1, active);
+    peri_set_led(2, session);
+}
 
-        case CMD_READER:
-            return 1;   
+//----------------------------------------------//
+// Global interfaces                            //
+//----------------------------------------------//
 
-        case CMD_EXPANSION:
-            return 1;    
+void cldev_init() {
+    log(LL_DEBUG, LM_CLDEV, "cldev_init");
 
-        default:
-            assertCnt(true, LL_ERROR, LM_CLDEV, "Unknown Cmd");
-            return 0;
-    };
+    state = CS_Inactive;
+    memset(&vcmSetup, 0, sizeof(vcmSetup));
+    peri_set_led(1, false);
+    peri_set_led(2, false);
+
+    queue_head = 0;
+    queue_tail = 0;
+    outbox_state = OB_Empty;
+    outbox_len = 0;
+    deferred_len = 0;
+    vend_status = VS_None;
+    session_requested = false;
+    cancel_requested = false;
+    transaction_open = false;
+    reader_level = 1;
+    session_member = 0;
+    session_timed_out = false;
+    tw_cancel(&session_timer);
+    clear_display();
+
+    serv_init();
+    time_serv_init();
 }
 
-uint8_t cldev_scmd_len(uint8_t cmd, uint8_t scmd) {
-    log(LL_DEBUG, LM_CLDEV, "cldev_scmd_len");
-
-    switch(cmd) {
-        case CMD_RESET:
-            return 0;
-
-        case CMD_SETUP:
-            switch(scmd) {
-                case SCMD_SETUP_CONFIG:
-                    return 4;
-                case SCMD_SETUP_PRICES:
-                    return 4;
-                default:
-                    assertDo(true, LL_ERROR, LM_CLDEV, "Unknown SETUP-Subcmd", return 0;);
-            } 
-            break;
+void cldev_receive(uint8_t cmd, const uint8_t data[]) {
+    log(LL_DEBUG, LM_CLDEV, "cldev_receive");
 
-        case CMD_POLL:
-            return 0;
-
-        case CMD_VEND:
-            switch(scmd) {
-                case SCMD_VEND_REQUEST:
-                    return 4;
-                case SCMD_VEND_CANCEL:
-                    return 0;
-                case SCMD_VEND_SUCCESS:
-                    return 2;
-                case SCMD_VEND_FAILURE:
-                    return 0;
-                case SCMD_VEND_COMPLETE:
-                    return 0;
-                case SCMD_VEND_CASHSALE:
-                    return 4;
-                default:
-                    assertDo(true, LL_ERROR, LM_CLDEV, "Unknown VEND-Subcmd", return 0;);
-            }
-            break;   
-
-        case CMD_READER:
-            switch(scmd) {
-                case SCMD_READER_DISABLE:
-                    return 0;
-                case SCMD_READER_ENABLE:
-                    return 0;  
-                case SCMD_READER_CANCEL:
-                    return 0;
-                default:
-                    assertDo(true, LL_ERROR, LM_CLDEV, "Unknown READER-Subcmd", return 0;);
-            }
-            break;       
-
-        case CMD_EXPANSION:
-            switch(scmd) {
-                case SCMD_EXPANSION_ID:
-                    return 29;
-                default:
-                    assertDo(true, LL_ERROR, LM_CLDEV, "Unknown EXPANSION-Subcmd", return 0;);
-            }   
-            break;
+    const sCmdEntry *entry = find_entry(cmd, data[0]);
+    assertRtn(entry == 0, LL_ERROR, LM_CLDEV, "Unknown Cmd");
+
+    // If the loop can't take the command, the VMC has to repeat it
+    if(entry->handler != 0) {
+        uint8_t len = (entry->scmd == SCMD_NONE) ? 0 : 1 + entry->len;
+        assertDo(!queue_push(cmd, len, data), LL_ERROR, LM_CLDEV, "Command queue full. Command not acknowledged.", mdb_send_nack(); return;);
+    }
+
+    (*entry->answer)(data);
+}
+
+void cldev_run() {
+    log(LL_DEBUG, LM_CLDEV, "cldev_run");
+
+    sCldevEvent ev;
+    while(queue_pop(&ev))
+        process_event(&ev);
+
+    prepare_answers();
+    update_leds();
+}
 
+bool cldev_pending() {
+    return (queue_head.load() != queue_tail.load()) || (deferred_len > 0);
+}
+
+uint8_t cldev_card_demand() {
+    switch(state) {
+        case CS_Enabled:
+            return CLDEV_CARD_TAP;
+        case CS_Session_Idle:
+        case CS_Vend:
+            return CLDEV_CARD_SESSION;
         default:
-            assertCnt(true, LL_ERROR, LM_CLDEV, "Unknown Cmd");
-            return 0;
+            return CLDEV_CARD_NONE;
     }
-}
\ No newline at end of file
+}
+
+bool cldev_post_answer(uint8_t len, const uint8_t answer[]) {
+    log(LL_DEBUG, LM_CLDEV, "cldev_post_answer");
+    return post_answer(len, answer);
+}
+
+void cldev_show_message(uint8_t time_tenths, const char msg[]) {
+    if(time_tenths == display_time && strncmp(display_msg, msg, DISPLAY_SIZE) == 0)
+        return;
+
+    strncpy(display_msg, msg, DISPLAY_SIZE);
+    display_msg[DISPLAY_SIZE] = 0;
+    display_time = time_tenths;
+    display_changed = true;
+}
+
+uint8_t cldev_cmd_len(uint8_t cmd) {
+    uint8_t len = ((cmd & 0xF8) == CMD_RESET) ? cmd_len[cmd & 0x07] : CLDEV_INVALID_LEN;
+    assertCnt(len == CLDEV_INVALID_LEN, LL_ERROR, LM_CLDEV, "Unknown Cmd");
+    return len;
+}
+
+uint8_t cldev_scmd_len(uint8_t cmd, uint8_t scmd) {
+    const sCmdEntry *entry = find_entry(cmd, scmd);
+    assertDo(entry == 0, LL_ERROR, LM_CLDEV, "Unknown Subcmd", return CLDEV_INVALID_LEN;);
+    return entry->len;
+}
@@ -2,11 +2,55 @@
 
 #include "../util/error.h"
 
+#define CMD_RESET   0x10
+#define CMD_SETUP   0x11
+#define CMD_POLL    0x12
+#define CMD_VEND    0x13
+#define CMD_READER  0x14
+#define CMD_EXPANSION  0x17
+
+#define SCMD_SETUP_CONFIG   0x00
+#define SCMD_SETUP_PRICES   0x01
+
+#define SCMD_VEND_REQUEST   0x00
+#define SCMD_VEND_CANCEL    0x01
+#define SCMD_VEND_SUCCESS   0x02
+#define SCMD_VEND_FAILURE   0x03
+#define SCMD_VEND_COMPLETE  0x04
+#define SCMD_VEND_CASHSALE  0x05
+
+#define SCMD_READER_DISABLE 0x00
+#define SCMD_READER_ENABLE  0x01
+#define SCMD_READER_CANCEL  0x02
+
+#define SCMD_EXPANSION_ID       0x00
+#define SCMD_EXPANSION_FEATURES 0x04    // level 3: optional feature enabled
+
 void cldev_init();
 
-void cldev_run(uint8_t cmd, const uint8_t data[]);
+// MDB interrupt: answers immediately and queues the command for the loop
+void cldev_receive(uint8_t cmd, const uint8_t data[]);
+
+// Loop: processes queued commands, moves the state machine and prepares the next POLL answer
+void cldev_run();
+bool cldev_pending();
+
+// Loop: what the cashless state needs from the card reader. Sets the RFID poll interval.
+#define CLDEV_CARD_NONE     0   // inactive or disabled: no session can begin
+#define CLDEV_CARD_TAP      1   // enabled: waiting for a tap
+#define CLDEV_CARD_SESSION  2   // session or vend: the card must still be there
+
+uint8_t cldev_card_demand();
+
+// Loop: answer sent with the next POLL. False if another answer is still waiting.
+bool cldev_post_answer(uint8_t len, const uint8_t answer[]);
+
+// Loop: message for the VMC display while in service mode. Only sent again if it changed.
+void cldev_show_message(uint8_t time_tenths, const char msg[]);
+
+// Length lookups for mdb_read, generated from the command table.
+// CLDEV_INVALID_LEN for commands the reader does not know: the block must be dropped.
+#define CLDEV_INVALID_LEN   0xFF
 
 uint8_t cldev_cmd_len(uint8_t cmd);
 uint8_t cldev_scmd_len(uint8_t cmd, uint8_t scmd);
-
-uint8_t answer_DisplayRequest(uint8_t answer[], uint8_t time_tenths, const char msg[]);
\ No newline at end of file
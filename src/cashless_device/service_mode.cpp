@@ -2,8 +2,8 @@
 #include "cashless_device.h"
 #include "../util/error.h"
 #include "../rfid/rfid.h"
-#include "../mdb/mdb.h"
 #include "../data_handler/data_handler.h"
+#include "../periphery/periphery.h"
 
 #define BUTTON_FASTUP 1
 #define BUTTON_UP 2
@@ -14,16 +14,26 @@
 
 #define FAST_STEP 5
 
+// Service mode with this DIP: PROG starts and stops batch programming from the selected member on
+#define BATCH_MODE_DIP 0x04
+
 uint32_t member_idx;
 bool prog_in_progress;
 bool delete_in_progress;
 
+bool batch_running;
+uint32_t batch_start;
+uint32_t batch_programmed;
+uint32_t batch_failed;
+uint32_t batch_rate;        // cards per minute
+
 void serv_init() {
     log(LL_DEBUG, LM_SERV, "serv_init");
 
     member_idx = 0;
     prog_in_progress = false;
     delete_in_progress = false;
+    batch_running = false;
 }
 
 void up(uint8_t step) {
@@ -65,6 +75,83 @@ void delete_card() {
     rfid_restore_card_async(&delete_done);
 }
 
+bool batch_mode_selected() {
+    return peri_check_dip(0x01) && peri_check_dip(BATCH_MODE_DIP);
+}
+
+// Head of the batch queue: the selected member or the next one after it with a card id
+sMember* batch_head() {
+    for(sMember *member; (member = dh_get_member_from_idx(member_idx)) != 0; member_idx++) {
+        if(member->card_id != 0)
+            return member;
+    }
+    return 0;
+}
+
+void batch_stop() {
+    log(LL_DEBUG, LM_SERV, "batch_stop");
+
+    rfid_program_batch_stop();
+    batch_running = false;
+
+    log(LL_INFO, LM_SERV, "Batch programming stopped. Cards programmed:", batch_programmed);
+    log(LL_INFO, LM_SERV, "   Failed:         ", batch_failed);
+    log(LL_INFO, LM_SERV, "   Cards per minute:", batch_rate);
+}
+
+// Called by the reader for each card presented. A card outside of the batch mode must never be programmed.
+bool batch_next(uint32_t* membId, uint32_t* cardId) {
+    sMember *member = batch_head();
+    if(member == 0 || !batch_mode_selected()) {
+        batch_stop();
+        return false;
+    }
+
+    *membId = member->id;
+    *cardId = member->card_id;
+    return true;
+}
+
+// A failed card keeps its member at the head of the queue: the next card presented is for the same member
+void batch_card_done(uint32_t membId, uint32_t cardId, bool success) {
+    dh_log_card_programming(membId, cardId, success);
+
+    if(success) {
+        batch_programmed++;
+        member_idx++;
+    } else
+        batch_failed++;
+
+    uint32_t elapsed = millis() - batch_start;
+    batch_rate = (elapsed > 0) ? (batch_programmed * 60000) / elapsed : 0;
+    log(LL_INFO, LM_SERV, "Batch cards programmed:", batch_programmed);
+    log(LL_INFO, LM_SERV, "Batch cards per minute:", batch_rate);
+
+    if(batch_head() == 0) {
+        log(LL_INFO, LM_SERV, "All members of the batch are programmed.");
+        batch_stop();
+    }
+}
+
+void batch_toggle() {
+    log(LL_DEBUG, LM_SERV, "batch_toggle");
+
+    if(batch_running) {
+        batch_stop();
+        return;
+    }
+
+    assertRtn(batch_head() == 0, LL_WARNING, LM_SERV, "No member with a card from the selected one on");
+
+    batch_running = true;
+    batch_start = millis();
+    batch_programmed = 0;
+    batch_failed = 0;
+    batch_rate = 0;
+    log(LL_INFO, LM_SERV, "Batch programming started at member index:", member_idx);
+    rfid_program_batch_start(&batch_next, &batch_card_done);
+}
+
 void serv_button_pressed(uint8_t button) {
     log(LL_DEBUG, LM_SERV, "serv_button_pressed");
 
@@ -87,7 +174,10 @@ void serv_button_pressed(uint8_t button) {
             break;      
     
         case BUTTON_PROG:
-            prog_card();
+            if(batch_running || peri_check_dip(BATCH_MODE_DIP))
+                batch_toggle();
+            else
+                prog_card();
             break;
 
         case BUTTON_DELETE:
@@ -102,25 +192,31 @@ void serv_button_pressed(uint8_t button) {
 void serv_run() {
     log(LL_DEBUG, LM_SERV, "serv_run");
 
-    uint8_t answer[64];
-    uint8_t len = 0;
-
-    if(prog_in_progress) {
-        len = answer_DisplayRequest(answer, 10, "PROGRAM:  BITTE KARTE AUFLEGEN ");
-        mdb_send_data(len, answer);
+    // The reader may have ended the batch on its own
+    if(batch_running && !rfid_program_batch_active())
+        batch_running = false;
+
+    if(batch_running) {
+        char text[64];
+        sMember *member = batch_head();
+        // Next member and progress take turns on the display
+        if(member != 0 && (millis() / 2000) % 2 == 0)
+            sprintf(text, "SERIE %08lu: %.8s, %.8s", member->id, member->name, member->given_name);
+        else
+            sprintf(text, "SERIE %3lu OK %2lu FEHLER %2lu/MIN  ", batch_programmed, batch_failed, batch_rate);
+        cldev_show_message(10, text);
+    } else if(prog_in_progress) {
+        cldev_show_message(10, "PROGRAM:  BITTE KARTE AUFLEGEN ");
     } else if(delete_in_progress) {
-        len = answer_DisplayRequest(answer, 10, "LOESCHEN: BITTE KARTE AUFLEGEN ");
-        mdb_send_data(len, answer);
+        cldev_show_message(10, "LOESCHEN: BITTE KARTE AUFLEGEN ");
     } else {
         sMember *member = dh_get_member_from_idx(member_idx);
         if(member == 0) {
-            len = answer_DisplayRequest(answer, 10, "SERVICE: MITGLIED WAEHLEN      ");
-            mdb_send_data(len, answer);
+            cldev_show_message(10, "SERVICE: MITGLIED WAEHLEN      ");
         } else {
             char text[64];
             sprintf(text, "%08lu: %8s, %8s   ", member->id, member->name, member->given_name);
-            len = answer_DisplayRequest(answer, 10, text);
-            mdb_send_data(len, answer);
+            cldev_show_message(10, text);
         }
     }
 }
\ No newline at end of file
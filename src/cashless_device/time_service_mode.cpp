@@ -2,7 +2,6 @@
 #include "cashless_device.h"
 #include "../util/error.h"
 #include "../clock/clock.h"
-#include "../mdb/mdb.h"
 #include "../data_handler/data_handler.h"
 
 #define BUTTON_INC 1
@@ -155,8 +154,6 @@ void time_serv_button_pressed(uint8_t button) {
 void time_serv_run() {
     log(LL_DEBUG, LM_SERV, "time_serv_run");
 
-    uint8_t answer[64];
-    uint8_t len = 0;
     char text[64];
     char state_text[8];
 
@@ -191,6 +188,5 @@ void time_serv_run() {
 
     // Format time string and write it
     sprintf(text, "%02hhu.%02hhu.%04u %02hhu:%02hhu:%02hhu,%03hd %s   ", new_datetime.day(), new_datetime.month(), new_datetime.year(), new_datetime.hour(), new_datetime.minute(), new_datetime.second(), (int) new_datetime.millis(), state_text);
-    len = answer_DisplayRequest(answer, 10, text);
-    mdb_send_data(len, answer);
+    cldev_show_message(10, text);
 }
\ No newline at end of file
@@ -2,6 +2,11 @@
 #include "RTClib.h"
 #include "../util/error.h"
 
+// clock_run() polls the RTC from this long before the next second is expected [us]
+#define CLOCK_EDGE_LEAD 3000
+// ... and gives up if it did not come this long after it
+#define CLOCK_EDGE_LATE 100000
+
 bool initialised = false;
 bool referenced;
 DateTime last_reference;
@@ -66,6 +71,19 @@ DateTime clock_now() {
     }
 }
 
+bool clock_run() {
+    if(!initialised)
+        return false;
+
+    uint32_t since = micros() - last_local;
+    if(since < 1000000 - CLOCK_EDGE_LEAD || since > 1000000 + CLOCK_EDGE_LATE)
+        return false;
+
+    uint32_t local = last_local;
+    clock_reference();
+    return last_local == local;
+}
+
 void clock_adjust(DateTime &new_datetime) {
     log(LL_DEBUG, LM_CLOCK, "clock_adjust");
 
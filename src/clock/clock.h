@@ -6,4 +6,7 @@ void clock_init();
 bool clock_was_init();
 
 DateTime clock_now();
+
+// Loop: catches the next second of the RTC before clock_now() has to wait for it. True while polling the RTC.
+bool clock_run();
 void clock_adjust(DateTime &new_datetime);
\ No newline at end of file
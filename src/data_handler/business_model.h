@@ -35,19 +35,29 @@
 #define DH_TA_CORRUPTED 0x80
 //********************************************
 
+/*********************************************
+ * Member delta operations
+ ********************************************/
+#define DB_DELTA_MAGIC  0x544C4444          // "DDLT"
+
+#define DB_DELTA_ADD    0x01                // new member, replaces one with the same id
+#define DB_DELTA_UPDATE 0x02                // changed member, added if the id is missing
+#define DB_DELTA_REMOVE 0x03                // only the id counts, nothing happens if it is missing. Leaves a free slot.
+//********************************************
+
 
 #pragma pack(push, 1)
 struct sDataBaseHeader {
     uint32_t    version;                    // Version of the Data-Base
     uint32_t    datetime_modified;          // Date and Time of the last Data-Base Change
     char        author[16];                 // Name of the last author
-    uint32_t    entry_count;                // Number of entries which directly follow this header
+    uint32_t    entry_count;                // Number of entries which directly follow this header, free slots included
 }; // 28 Bytes
 #pragma pack (pop)
 
 #pragma pack(push, 1)
 struct sMember {
-    uint32_t    id;                         // unique id of that member
+    uint32_t    id;                         // unique id of that member, 0: free slot (all fields 0)
     char        name[16];                   // surname
     char        given_name[16];             // given name
     uint16_t    properties;                 // properties, see Member Properties above
@@ -56,6 +66,24 @@ struct sMember {
 }; // 44 Bytes
 #pragma pack (pop)
 
+#pragma pack(push, 1)
+struct sDeltaHeader {
+    uint32_t        magic;                  // DB_DELTA_MAGIC
+    uint32_t        base_version;           // Version of the Data-Base the delta applies to
+    uint32_t        base_datetime_modified; // and its Date and Time of the last change
+    sDataBaseHeader target;                 // Data-Base header after the delta, entry_count: members afterwards
+    uint32_t        entry_count;            // Number of entries which directly follow this header
+    uint32_t        checksum;               // over this header up to the checksum and all entries
+}; // 48 Bytes
+#pragma pack (pop)
+
+#pragma pack(push, 1)
+struct sDeltaEntry {
+    uint32_t    operation;                  // see Member delta operations above
+    sMember     member;
+}; // 48 Bytes
+#pragma pack (pop)
+
 #pragma pack(push, 1)
 struct sTransactionHeader {
     uint32_t    version;                    // Version of the SW which generated the transaction list
@@ -3,63 +3,656 @@
 #include "../file_handler/file_handler.h"
 #include "../util/time_format.h"
 #include "../clock/clock.h"
+#include "../util/timer_wheel.h"
 
 #define MAX_MEMBER_COUNT 512
 
-sMember  members[MAX_MEMBER_COUNT];
+// Two member tables: lookups use the active one, a new data-base is loaded into the other one.
+// They are swapped in one go between two sessions, so no vend sees a half loaded table.
+sMember  member_tables[2][MAX_MEMBER_COUNT];
+sMember *members = member_tables[0];
 uint32_t member_count;
+sDataBaseHeader members_header;             // of the active table
+uint8_t members_card;                       // SD-card of the data-base file the active table belongs to
+uint32_t members_generation;                // counts the swaps
+
+// Bloom filter over the (member id, card id) pairs of each table, built before the table is swapped in.
+// A pair not in the filter is rejected without a scan. 16 bits and 4 hashes per member: 0.24 % false positives.
+#define DH_FILTER_BITS 8192
+#define DH_FILTER_HASHES 4
+uint32_t member_filters[2][DH_FILTER_BITS / 32];
+
+// Pairs rejected since the last swap. A card held to the reader is not searched and reported again.
+#define DH_REJECTED_PAIRS 8
+struct sRejectedPair {
+    uint32_t member_id;
+    uint32_t card_id;
+};
+sRejectedPair rejected_pairs[DH_REJECTED_PAIRS];
+uint8_t rejected_pair_count;
+uint8_t rejected_pair_next;
 
 sTransaction transaction;
 sTransactionHeader transaction_header;
 
+// The header in RAM is the one on the SD-card and its checksum is kept up to date with every change.
+// The copy on the SD-card is only read and verified at startup, after a new file was set and after a fault.
+uint32_t transaction_header_checksum;
+bool transaction_header_valid;
+
+// Compares the header in RAM with a full checksum and the copy on the SD-card after every write (for tests)
+#define DH_HEADER_SELFCHECK false
+
+bool dh_read_transaction_header();
+
+// A transaction that is neither completed nor cancelled after this time gives way to the next one
+#define DH_TRANSACTION_TIMEOUT 20000
+bool transaction_stale;
+void dh_transaction_stale();
+sTimer transaction_timer = TW_TIMER(&dh_transaction_stale);
+
+#define DH_TRANSACTION_FILE "TRANSACT.DB"
+const char *transaction_file = DH_TRANSACTION_FILE;
+
+// While a vend session is open, the last transaction in RAM is the one on the SD-card.
+// Several vends in one session then don't read it again.
+bool session_open;
+bool session_cached;
+
+#define DH_PROGRAMMING_FILE "CARDPROG.TXT"
+
 uint8_t log_idx;
 #define MAX_LOG_IDX 32
 
-void dh_load_members() {
-    log(LL_DEBUG, LM_DH, "dh_load_members");
+#define DH_MEMBER_FILE "DATABASE.DB"
+#define DH_DELTA_FILE "DATABASE.DLT"
+#define DH_LOAD_CHUNK 64                    // members per step
+#define DH_DELTA_CHUNK 16                   // delta entries per step
+
+// Loading a data-base file in steps into the inactive table. At startup by dh_init_step(), then by dh_reload_step()
+// whenever a newer file shows up on one of the SD-cards.
+// A delta file is applied to a copy of the active table instead. Once it is in use, the changed members
+// are written to the data-base file it came from.
+enum eLoadState {
+    DL_Idle,                                // the active table is used, dh_reload_step() looks for a newer file
+    DL_Header,
+    DL_Members,
+    DL_Validate,
+    DL_DeltaEntries,
+    DL_DeltaValidate,
+    DL_Ready,                               // loaded and valid, waits for the end of the session
+    DL_DeltaWrite,                          // the changed members go to the data-base file
+    DL_Transactions                         // startup only: verify the transaction header
+};
+eLoadState load_state = DL_Header;
+bool load_startup;                          // lookups find no member until the startup is done
+bool load_retried;
+uint8_t load_card;
+sDataBaseHeader load_header;
+sMember *load_table;
+uint32_t load_count;                        // members in the file
+uint32_t load_pos;                          // members read so far
+
+// Delta being applied: members changed in the table, written to the data-base file afterwards
+bool load_delta;
+sDeltaHeader delta_header;
+sChecksum delta_checksum;
+uint32_t delta_dirty[MAX_MEMBER_COUNT / 32];
+uint32_t delta_added, delta_updated, delta_removed;
+
+// A file that failed the validation is not loaded again
+sDataBaseHeader rejected_header;
+bool rejected;
+sDeltaHeader rejected_delta;
+bool delta_rejected;
+
+// A card whose data-base can't be read anymore may have been swapped or removed: it is initialised again.
+// After a failed initialisation the next one waits twice as long. A card without data-base is left alone.
+#define DH_CARD_RETRY_MIN 10000             // ms
+#define DH_CARD_RETRY_MAX 640000
+bool card_had_db[2];
+uint32_t card_retry_at[2];                  // millis()
+uint32_t card_retry_delay[2];
+
+// False without an error if the card has no data-base
+bool dh_read_db_header(uint8_t card, sDataBaseHeader *header) {
+    log(LL_DEBUG, LM_DH, "dh_read_db_header");
+
+    if(!fh_fopen_existing(card, DH_MEMBER_FILE)) {
+        log(LL_DEBUG, LM_DH, "No data-base on SD-card", (uint32_t) card);
+        return false;
+    }
+    int32_t read = fh_fread(0, sizeof(sDataBaseHeader), (uint8_t*) header);
+    fh_fclose();
+    assertDo(read < (int32_t) sizeof(sDataBaseHeader), LL_ERROR, LM_DH, "Can't read data-base header", return false;);
 
-    member_count = 0;
+    header->author[sizeof(header->author)-1] = 0;
+    return true;
+}
+
+// Starts loading the file of the card with the given header into the inactive table
+void dh_load_start(uint8_t card) {
+    load_delta = false;
+    load_card = card;
+    load_table = (members == member_tables[0]) ? member_tables[1] : member_tables[0];
+    load_count = load_header.entry_count;
+    assertDo(load_count > MAX_MEMBER_COUNT, LL_WARNING, LM_DH, "Can't handle that many members. Restrict to max. member count", load_count = MAX_MEMBER_COUNT;);
+    load_pos = 0;
+    load_state = DL_Members;
+}
+
+// The next chunk of members. The file is closed in between, others may use the SD-card.
+bool dh_load_chunk() {
+    log(LL_DEBUG, LM_DH, "dh_load_chunk");
+
+    uint32_t count = load_count - load_pos;
+    if(count > DH_LOAD_CHUNK)
+        count = DH_LOAD_CHUNK;
+
+    assertDo(!fh_fopen_existing(load_card, DH_MEMBER_FILE), LL_ERROR, LM_DH, "Can't open data-base", return false;);
+    int32_t read = fh_fread(sizeof(sDataBaseHeader) + load_pos*sizeof(sMember), count*sizeof(sMember), (uint8_t*) &load_table[load_pos]);
+    fh_fclose();
+    assertDo(read < (int32_t) (count*sizeof(sMember)), LL_ERROR, LM_DH, "Can't read all members", return false;);
+
+    load_pos += count;
+    return true;
+}
+
+// The file must not have changed while it was loaded and every member needs an id
+bool dh_load_validate() {
+    log(LL_DEBUG, LM_DH, "dh_load_validate");
+
+    assertDo(load_count == 0, LL_WARNING, LM_DH, "No members found in data-base", return false;);
 
-    assertRtn(!fh_fopen(1, "DATABASE.DB"), LL_ERROR, LM_DH, "Can't open data-base");
-    
     sDataBaseHeader header;
-    assertRtn(fh_fread(0, sizeof(header), (uint8_t*) &header) < sizeof(header), LL_ERROR, LM_DH, "Can't read data-base header");
+    assertDo(!dh_read_db_header(load_card, &header), LL_ERROR, LM_DH, "Can't read data-base header again", return false;);
+    assertDo(memcmp(&header, &load_header, sizeof(header)) != 0, LL_WARNING, LM_DH, "Data-base changed while it was loaded", return false;);
+
+    // A member without id must be a free slot, all zero
+    static const sMember free_slot = {};
+    uint32_t live = 0;
+    for(uint32_t i = 0; i < load_count; i++) {
+        if(load_table[i].id != 0)
+            live++;
+        else
+            assertDo(memcmp(&load_table[i], &free_slot, sizeof(sMember)) != 0, LL_ERROR, LM_DH, "Data-base contains a member without id", return false;);
+    }
+    assertDo(live == 0, LL_WARNING, LM_DH, "No members found in data-base", return false;);
+    return true;
+}
+
+uint32_t* dh_filter_of(const sMember *table) {
+    return member_filters[(table == member_tables[0]) ? 0 : 1];
+}
+
+// Murmur3 finalizer: every bit of the ids changes every bit of the hash
+uint32_t dh_filter_mix(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    h ^= h >> 16;
+    return h;
+}
+
+// Sets the DH_FILTER_HASHES bits of the pair or tests whether all of them are set (double hashing)
+bool dh_filter_bits(uint32_t *filter, uint32_t memberID, uint32_t cardID, bool set) {
+    uint32_t h1 = dh_filter_mix(memberID ^ dh_filter_mix(cardID + 0x9E3779B9));
+    uint32_t h2 = dh_filter_mix(h1 ^ memberID) | 1;
+
+    for(uint8_t i = 0; i < DH_FILTER_HASHES; i++) {
+        uint32_t bit = (h1 + i*h2) & (DH_FILTER_BITS - 1);
+        if(set)
+            filter[bit / 32] |= 1UL << (bit % 32);
+        else if((filter[bit / 32] & (1UL << (bit % 32))) == 0)
+            return false;
+    }
+    return true;
+}
+
+void dh_filter_build(const sMember *table, uint32_t count) {
+    uint32_t *filter = dh_filter_of(table);
+    memset(filter, 0, DH_FILTER_BITS / 8);
+    for(uint32_t i = 0; i < count; i++) {
+        if(table[i].id != 0)
+            dh_filter_bits(filter, table[i].id, table[i].card_id, true);
+    }
+}
+
+bool dh_is_rejected_pair(uint32_t memberID, uint32_t cardID) {
+    for(uint8_t i = 0; i < rejected_pair_count; i++) {
+        if(rejected_pairs[i].member_id == memberID && rejected_pairs[i].card_id == cardID)
+            return true;
+    }
+    return false;
+}
+
+// The oldest pair makes room
+void dh_add_rejected_pair(uint32_t memberID, uint32_t cardID) {
+    rejected_pairs[rejected_pair_next].member_id = memberID;
+    rejected_pairs[rejected_pair_next].card_id = cardID;
+    rejected_pair_next = (rejected_pair_next + 1) % DH_REJECTED_PAIRS;
+    if(rejected_pair_count < DH_REJECTED_PAIRS)
+        rejected_pair_count++;
+}
+
+void dh_load_swap() {
+    // A pair rejected before may be a member now
+    rejected_pair_count = 0;
+    rejected_pair_next = 0;
+
+    members = load_table;
+    member_count = load_count;
+    members_generation++;
+    members_header = load_header;
+    if(!load_delta) {
+        members_card = load_card;
+        card_had_db[load_card-1] = true;
+    }
 
     log(LL_INFO, LM_DH, "Loaded Data-Base with the following information:");
-    log(LL_INFO, LM_DH, "   Version:     ", header.version);
-    log(LL_INFO, LM_DH, "   Modified:    ", DateTime(header.datetime_modified));
-    header.author[sizeof(header.author)-1] = 0;
-    log(LL_INFO, LM_DH, "   Author:      ", header.author);
-    log(LL_INFO, LM_DH, "   Entry Count: ", header.entry_count);
-
-    member_count = header.entry_count;
-    assertDo(member_count > MAX_MEMBER_COUNT, LL_WARNING, LM_DH, "Can't handle that many members. Restrict to max. member count", member_count = MAX_MEMBER_COUNT;);
-    
-    assertDo(fh_fread(sizeof(header), member_count*sizeof(sMember), (uint8_t*) &members) < member_count*sizeof(sMember), LL_ERROR, LM_DH, "Can't read all members", member_count = 0;);
+    log(LL_INFO, LM_DH, "   SD-card:     ", (uint32_t) load_card);
+    log(LL_INFO, LM_DH, "   Version:     ", members_header.version);
+    log(LL_INFO, LM_DH, "   Modified:    ", DateTime(members_header.datetime_modified));
+    log(LL_INFO, LM_DH, "   Author:      ", members_header.author);
+    log(LL_INFO, LM_DH, "   Entry Count: ", member_count);
+}
+
+// False without an error if the card has no delta
+bool dh_read_delta_header(uint8_t card, sDeltaHeader *header) {
+    log(LL_DEBUG, LM_DH, "dh_read_delta_header");
 
-    log(LL_INFO, LM_DH, "Members loaded successfully.");
+    if(!fh_fopen_existing(card, DH_DELTA_FILE))
+        return false;
+    int32_t read = fh_fread(0, sizeof(sDeltaHeader), (uint8_t*) header);
     fh_fclose();
+    assertDo(read < (int32_t) sizeof(sDeltaHeader), LL_ERROR, LM_DH, "Can't read delta header", return false;);
+    assertDo(header->magic != DB_DELTA_MAGIC, LL_WARNING, LM_DH, "Delta file has no valid header", return false;);
+
+    header->target.author[sizeof(header->target.author)-1] = 0;
+    return true;
 }
 
-void dh_init() {
-    log(LL_DEBUG, LM_DH, "dh_init");
+// Starts applying the delta of the card with the given header to a copy of the active table
+void dh_delta_start(uint8_t card) {
+    load_delta = true;
+    load_card = card;
+    load_header = delta_header.target;
+    load_table = (members == member_tables[0]) ? member_tables[1] : member_tables[0];
+    memcpy(load_table, members, member_count * sizeof(sMember));
+    load_count = member_count;
+    load_pos = 0;
+
+    memset(delta_dirty, 0, sizeof(delta_dirty));
+    delta_added = 0;
+    delta_updated = 0;
+    delta_removed = 0;
+
+    checksum_init(&delta_checksum);
+    checksum_update(&delta_checksum, &delta_header, offsetof(sDeltaHeader, checksum));
+    load_state = DL_DeltaEntries;
+}
+
+uint32_t dh_load_find(uint32_t memberID) {
+    uint32_t i = 0;
+    while(i < load_count && load_table[i].id != memberID)
+        i++;
+    return i;
+}
+
+void dh_delta_mark(uint32_t idx) {
+    delta_dirty[idx / 32] |= 1UL << (idx % 32);
+}
+
+// No member is moved: a removed one leaves a free slot, which the next added one takes. Each slot of the file
+// holds either its old or its new member, and applying the entries again to such a file gives the same members.
+// So a delta interrupted while it was written is applied again at the next start.
+bool dh_delta_apply(const sDeltaEntry *entry) {
+    assertDo(entry->member.id == 0, LL_ERROR, LM_DH, "Delta entry without member id", return false;);
+
+    uint32_t idx = dh_load_find(entry->member.id);
+    switch(entry->operation) {
+        case DB_DELTA_ADD:
+        case DB_DELTA_UPDATE:
+            if(idx == load_count) {
+                idx = dh_load_find(0);
+                if(idx == load_count) {
+                    assertDo(load_count >= MAX_MEMBER_COUNT, LL_ERROR, LM_DH, "Delta exceeds the max. member count", return false;);
+                    load_count++;
+                }
+                delta_added++;
+            } else
+                delta_updated++;
+            load_table[idx] = entry->member;
+            dh_delta_mark(idx);
+            return true;
+        case DB_DELTA_REMOVE:
+            if(idx == load_count)
+                return true;
+            memset(&load_table[idx], 0, sizeof(sMember));
+            dh_delta_mark(idx);
+            delta_removed++;
+            return true;
+        default:
+            assertCnt(true, LL_ERROR, LM_DH, "Unknown delta operation");
+            return false;
+    }
+}
+
+// The next chunk of delta entries, applied to the table and added to the checksum
+bool dh_delta_chunk() {
+    log(LL_DEBUG, LM_DH, "dh_delta_chunk");
+
+    sDeltaEntry entries[DH_DELTA_CHUNK];
+    uint32_t count = delta_header.entry_count - load_pos;
+    if(count > DH_DELTA_CHUNK)
+        count = DH_DELTA_CHUNK;
+
+    assertDo(!fh_fopen_existing(load_card, DH_DELTA_FILE), LL_ERROR, LM_DH, "Can't open delta", return false;);
+    int32_t read = fh_fread(sizeof(sDeltaHeader) + load_pos*sizeof(sDeltaEntry), count*sizeof(sDeltaEntry), (uint8_t*) entries);
+    fh_fclose();
+    assertDo(read < (int32_t) (count*sizeof(sDeltaEntry)), LL_ERROR, LM_DH, "Can't read all delta entries", return false;);
+
+    checksum_update(&delta_checksum, entries, count*sizeof(sDeltaEntry));
+    for(uint32_t i = 0; i < count; i++) {
+        if(!dh_delta_apply(&entries[i]))
+            return false;
+    }
 
-    dh_load_members();
-    if(member_count == 0) {
+    load_pos += count;
+    return true;
+}
+
+// The entries must match the checksum, the file must not have changed and the member count must be the expected one
+bool dh_delta_validate() {
+    log(LL_DEBUG, LM_DH, "dh_delta_validate");
+
+    assertDo(checksum_final(&delta_checksum) != delta_header.checksum, LL_ERROR, LM_DH, "Checksum of delta wrong", return false;);
+
+    sDeltaHeader header;
+    assertDo(!dh_read_delta_header(load_card, &header), LL_ERROR, LM_DH, "Can't read delta header again", return false;);
+    assertDo(memcmp(&header, &delta_header, sizeof(header)) != 0, LL_WARNING, LM_DH, "Delta changed while it was applied", return false;);
+
+    uint32_t live = 0;
+    for(uint32_t i = 0; i < load_count; i++) {
+        if(load_table[i].id != 0)
+            live++;
+    }
+    assertDo(live != delta_header.target.entry_count, LL_ERROR, LM_DH, "Member count after the delta is not the expected one", return false;);
+    assertDo(live == 0, LL_WARNING, LM_DH, "No members left after the delta", return false;);
+
+    // The file counts the free slots too
+    load_header.entry_count = load_count;
+    return true;
+}
+
+// The next chunk of changed slots to the data-base file, its header last. Until then the file has
+// the old header and the delta still applies to it, see dh_delta_apply().
+bool dh_delta_write() {
+    log(LL_DEBUG, LM_DH, "dh_delta_write");
+
+    assertDo(!fh_fopen(members_card, DH_MEMBER_FILE), LL_ERROR, LM_DH, "Can't open data-base", return false;);
+
+    uint32_t written = 0;
+    for(; load_pos < member_count && written < DH_LOAD_CHUNK; load_pos++) {
+        if((delta_dirty[load_pos / 32] & (1UL << (load_pos % 32))) == 0)
+            continue;
+        int32_t len = fh_fwrite(sizeof(sDataBaseHeader) + load_pos*sizeof(sMember), sizeof(sMember), (uint8_t*) &members[load_pos]);
+        assertDo(len != (int32_t) sizeof(sMember), LL_ERROR, LM_DH, "Can't write member", fh_fclose(); return false;);
+        written++;
+    }
+
+    if(load_pos >= member_count) {
+        int32_t len = fh_fwrite(0, sizeof(sDataBaseHeader), (uint8_t*) &members_header);
+        assertDo(len != (int32_t) sizeof(sDataBaseHeader), LL_ERROR, LM_DH, "Can't write data-base header", fh_fclose(); return false;);
+    }
+    fh_fclose();
+    return true;
+}
+
+// Loading failed: at startup once more, later the file is ignored until another one shows up
+void dh_load_failed() {
+    if(load_delta) {
+        assertCnt(true, LL_ERROR, LM_DH, "Delta rejected. The members loaded before stay in use.");
+        rejected_delta = delta_header;
+        delta_rejected = true;
+        load_state = DL_Idle;
+    } else if(load_startup && !load_retried) {
         assertCnt(true, LL_WARNING, LM_DH, "No members found in data-base. Try again...");
-        dh_load_members();
-        assertRtn(member_count == 0, LL_ERROR, LM_DH, "No members found in second try.");
+        load_retried = true;
+        load_state = DL_Header;
+    } else if(load_startup) {
+        assertCnt(true, LL_ERROR, LM_DH, "No members found in second try.");
+        load_state = DL_Transactions;
+    } else {
+        assertCnt(true, LL_ERROR, LM_DH, "New data-base rejected. The members loaded before stay in use.");
+        rejected_header = load_header;
+        rejected = true;
+        load_state = DL_Idle;
     }
+}
+
+// One step of loading. True while there are more steps to do.
+bool dh_load_step() {
+    switch(load_state) {
+        case DL_Header:
+            assertDo(!dh_read_db_header(load_card, &load_header), LL_ERROR, LM_DH, "Can't read data-base header", dh_load_failed(); return true;);
+            dh_load_start(load_card);
+            return true;
+        case DL_Members:
+            if(!dh_load_chunk())
+                dh_load_failed();
+            else if(load_pos >= load_count)
+                load_state = DL_Validate;
+            return true;
+        case DL_Validate:
+            if(!dh_load_validate())
+                dh_load_failed();
+            else {
+                dh_filter_build(load_table, load_count);
+                load_state = DL_Ready;
+            }
+            return true;
+        case DL_DeltaEntries:
+            if(!dh_delta_chunk())
+                dh_load_failed();
+            else if(load_pos >= delta_header.entry_count)
+                load_state = DL_DeltaValidate;
+            return true;
+        case DL_DeltaValidate:
+            if(!dh_delta_validate())
+                dh_load_failed();
+            else {
+                dh_filter_build(load_table, load_count);
+                load_state = DL_Ready;
+            }
+            return true;
+        case DL_Ready:
+            if(session_open)
+                return false;
+            dh_load_swap();
+            if(load_delta) {
+                char text[64];
+                sprintf(text, "Delta applied: %lu added, %lu updated, %lu removed", (unsigned long) delta_added,
+                        (unsigned long) delta_updated, (unsigned long) delta_removed);
+                log(LL_INFO, LM_DH, text);
+                load_pos = 0;
+                load_state = DL_DeltaWrite;
+                return true;
+            }
+            load_state = load_startup ? DL_Transactions : DL_Idle;
+            return load_startup;
+        case DL_DeltaWrite:
+            // The members in RAM are in use already. A failed write leaves the delta for the next startup.
+            assertDo(!dh_delta_write(), LL_ERROR, LM_DH, "Can't write the delta to the data-base file", load_state = DL_Idle; return false;);
+            if(load_pos < member_count)
+                return true;
+            log(LL_INFO, LM_DH, "Delta written to the data-base on SD-card", (uint32_t) members_card);
+            load_state = DL_Idle;
+            return false;
+        case DL_Transactions:
+            // Verify the header on the SD-card once, from here on it is maintained in RAM
+            assertCnt(!dh_read_transaction_header(), LL_ERROR, LM_DH, "No valid transaction header at startup");
+            load_startup = false;
+            load_state = DL_Idle;
+            return false;
+        case DL_Idle:
+            return false;
+    }
+    return false;
+}
+
+// a is a newer data-base than b
+bool dh_db_newer(const sDataBaseHeader *a, const sDataBaseHeader *b) {
+    if(a->version != b->version)
+        return a->version > b->version;
+    return a->datetime_modified > b->datetime_modified;
+}
+
+void dh_card_reinit(uint8_t card) {
+    log(LL_DEBUG, LM_DH, "Initialise SD-card again:", (uint32_t) card);
+
+    fh_init_card(card);
+    if(fh_fs_ready(card)) {
+        card_retry_delay[card-1] = DH_CARD_RETRY_MIN;
+        return;
+    }
+    card_retry_at[card-1] = millis() + card_retry_delay[card-1];
+    if(card_retry_delay[card-1] < DH_CARD_RETRY_MAX)
+        card_retry_delay[card-1] *= 2;
+}
+
+// Looks on both SD-cards for a data-base newer than the active one. Returns the card or 0.
+uint8_t dh_find_newer_db() {
+    uint8_t found = 0;
+
+    for(uint8_t card = 1; card <= 2; card++) {
+        if(!fh_fs_ready(card)) {
+            if(!card_had_db[card-1] || (int32_t) (millis() - card_retry_at[card-1]) < 0)
+                continue;
+            dh_card_reinit(card);
+            if(!fh_fs_ready(card))
+                continue;
+        }
+
+        sDataBaseHeader header;
+        bool read = dh_read_db_header(card, &header);
+        if(!read && card_had_db[card-1]) {
+            dh_card_reinit(card);
+            read = fh_fs_ready(card) && dh_read_db_header(card, &header);
+        }
+        if(!read) {
+            // A card that answers has no data-base: nothing to do until it gets one
+            if(fh_fs_ready(card))
+                card_had_db[card-1] = false;
+            continue;
+        }
+        card_had_db[card-1] = true;
+
+        if(rejected && memcmp(&header, &rejected_header, sizeof(header)) == 0)
+            continue;
+        if(dh_db_newer(&header, (found != 0) ? &load_header : &members_header)) {
+            load_header = header;
+            found = card;
+        }
+    }
+    return found;
+}
+
+// Looks on both SD-cards for a delta to the active data-base. Returns the card or 0.
+uint8_t dh_find_delta() {
+    for(uint8_t card = 1; card <= 2; card++) {
+        if(!fh_fs_ready(card))
+            continue;
+
+        sDeltaHeader header;
+        if(!dh_read_delta_header(card, &header))
+            continue;
+        if(delta_rejected && memcmp(&header, &rejected_delta, sizeof(header)) == 0)
+            continue;
+        if(header.base_version != members_header.version || header.base_datetime_modified != members_header.datetime_modified)
+            continue;
+        if(!dh_db_newer(&header.target, &members_header))
+            continue;
+
+        delta_header = header;
+        return card;
+    }
+    return 0;
+}
+
+void dh_init() {
+    log(LL_DEBUG, LM_DH, "dh_init");
+
+    member_count = 0;
+    memset(&members_header, 0, sizeof(members_header));
 
     transaction.status = DH_TA_CORRUPTED;
+    transaction_stale = false;
+    tw_cancel(&transaction_timer);
+    session_open = false;
+    session_cached = false;
+    transaction_header_valid = false;
 
     log_idx = 0;
+
+    load_startup = true;
+    load_retried = false;
+    load_card = 1;
+    load_state = DL_Header;
+    rejected = false;
+    delta_rejected = false;
+    rejected_pair_count = 0;
+    rejected_pair_next = 0;
+    for(uint8_t i = 0; i < 2; i++) {
+        card_had_db[i] = false;
+        card_retry_delay[i] = DH_CARD_RETRY_MIN;
+    }
+}
+
+bool dh_init_step() {
+    if(!load_startup)
+        return false;
+    dh_load_step();
+    return load_startup;
+}
+
+uint32_t dh_members_generation() {
+    return members_generation;
+}
+
+bool dh_ready() {
+    return !load_startup;
+}
+
+bool dh_reload_step() {
+    if(load_startup)
+        return false;
+
+    if(load_state == DL_Idle) {
+        uint8_t card = dh_find_newer_db();
+        if(card != 0) {
+            log(LL_INFO, LM_DH, "Newer data-base found on SD-card", (uint32_t) card);
+            dh_load_start(card);
+            return true;
+        }
+
+        card = dh_find_delta();
+        if(card != 0) {
+            log(LL_INFO, LM_DH, "Delta for the data-base found on SD-card", (uint32_t) card);
+            dh_delta_start(card);
+            return true;
+        }
+        return false;
+    }
+    return dh_load_step();
 }
 
 sMember* dh_get_member(uint32_t memberID) {
     log(LL_DEBUG, LM_DH, "dh_get_member");
 
-    for(uint32_t i = 0; i < member_count; i++) {
+    // Id 0 are the free slots
+    for(uint32_t i = 0; i < member_count && memberID != 0; i++) {
         if(memberID == members[i].id)
             return &(members[i]);
     }
@@ -68,26 +661,38 @@ sMember* dh_get_member(uint32_t memberID) {
     return 0;
 }
 
+// Unknown and revoked cards mostly end at the filter. Only its false positives and the valid cards need the scan.
 bool dh_is_authorised(uint32_t memberID, uint32_t cardID) {
-    sMember *member = dh_get_member(memberID);
+    if(dh_is_rejected_pair(memberID, cardID)) {
+        log(LL_DEBUG, LM_DH, "Card and member id rejected before");
+        return false;
+    }
+
+    sMember *member = 0;
+    if(dh_filter_bits(dh_filter_of(members), memberID, cardID, false)) {
+        for(uint32_t i = 0; i < member_count && member == 0 && memberID != 0; i++) {
+            if(memberID == members[i].id)
+                member = &(members[i]);
+        }
+    }
 
     if(member != 0 && member->card_id == cardID) {
         log(LL_DEBUG, LM_DH, "Correct card and member id");
         return true;
     } else {
         assertCnt(true, LL_WARNING, LM_DH, "Incorrect card or member id");
+        dh_add_rejected_pair(memberID, cardID);
         return false;
     }
 }
 
-
-
-
-
 bool dh_read_transaction_header() {
     log(LL_DEBUG, LM_DH, "dh_read_transaction_header");
 
-    assertDo(!fh_fopen(1, "TRANSACT.DB"), LL_ERROR, LM_DH, "Can't open transaction list", return false;);
+    if(transaction_header_valid)
+        return true;
+
+    assertDo(!fh_fopen(1, transaction_file), LL_ERROR, LM_DH, "Can't open transaction list", return false;);
 
     log(LL_DEBUG, LM_DH, "Transaction file length", (uint32_t) fh_flen());
 
@@ -98,42 +703,94 @@ bool dh_read_transaction_header() {
         header_cs.header.version = 0x01;
         header_cs.header.entry_count = 0;
         header_cs.checksum = calculate_checksum((uint16_t*) &header_cs.header, sizeof(header_cs.header));
-        fh_fwrite(0, sizeof(header_cs), (uint8_t*) &header_cs);
+        assertDo(fh_fwrite(0, sizeof(header_cs), (uint8_t*) &header_cs) != (int32_t) sizeof(header_cs), LL_ERROR, LM_DH, "Can't write transaction header", fh_fclose(); return false;);
 
     } else {
         fh_flog(0);
-        assertDo(fh_fread(0, sizeof(header_cs), (uint8_t*) &header_cs) < sizeof(header_cs), LL_ERROR, LM_DH, "Can't read transaction header", return false;);
+        assertDo(fh_fread(0, sizeof(header_cs), (uint8_t*) &header_cs) < sizeof(header_cs), LL_ERROR, LM_DH, "Can't read transaction header", fh_fclose(); return false;);
         uint32_t checksum = calculate_checksum((uint16_t*) &header_cs.header, sizeof(header_cs.header));
         log(LL_DEBUG, LM_DH, "Checksum from file:  ", header_cs.checksum);
         log(LL_DEBUG, LM_DH, "Checksum calculated: ", checksum);
-        assertDo(checksum != header_cs.checksum, LL_FATAL, LM_DH, "Checksum of transaction header wrong", return false;);
+        assertDo(checksum != header_cs.checksum, LL_FATAL, LM_DH, "Checksum of transaction header wrong", fh_fclose(); return false;);
     }   
 
     transaction_header = header_cs.header;
+    transaction_header_checksum = header_cs.checksum;
+    transaction_header_valid = true;
+    fh_fclose();
+    return true;
+}
+
+// After a fault the header is read and verified again before the next transaction
+void dh_transaction_fault() {
+    transaction_header_valid = false;
+    session_cached = false;
+}
+
+bool dh_check_transaction_header() {
+    log(LL_DEBUG, LM_DH, "dh_check_transaction_header");
+
+    if(!transaction_header_valid)
+        return true;
+
+    uint32_t checksum = calculate_checksum((uint16_t*) &transaction_header, sizeof(transaction_header));
+    assertDo(checksum != transaction_header_checksum, LL_ERROR, LM_DH, "Header checksum in RAM differs from the full checksum", return false;);
+
+    assertDo(!fh_fopen(1, transaction_file), LL_ERROR, LM_DH, "Can't open transaction list", return false;);
+    sTransactionHeaderCS header_cs;
+    int32_t read = fh_fread(0, sizeof(header_cs), (uint8_t*) &header_cs);
     fh_fclose();
+
+    assertDo(read < (int32_t) sizeof(header_cs), LL_ERROR, LM_DH, "Can't read transaction header", return false;);
+    assertDo(memcmp(&header_cs.header, &transaction_header, sizeof(transaction_header)) != 0 || header_cs.checksum != transaction_header_checksum,
+             LL_ERROR, LM_DH, "Transaction header on the SD-card differs from RAM", return false;);
     return true;
 }
 
+// Changes the header in RAM, the checksum follows the changed words
+void dh_update_transaction_header(uint32_t entry_count, uint32_t datetime_modified) {
+    sTransactionHeader header = transaction_header;
+    transaction_header.entry_count = entry_count;
+    transaction_header.datetime_modified = datetime_modified;
+
+    transaction_header_checksum = checksum_patch(transaction_header_checksum, sizeof(transaction_header),
+                                                 offsetof(sTransactionHeader, datetime_modified),
+                                                 &header.datetime_modified, &transaction_header.datetime_modified,
+                                                 sizeof(transaction_header.datetime_modified));
+    transaction_header_checksum = checksum_patch(transaction_header_checksum, sizeof(transaction_header),
+                                                 offsetof(sTransactionHeader, entry_count),
+                                                 &header.entry_count, &transaction_header.entry_count,
+                                                 sizeof(transaction_header.entry_count));
+}
+
 bool dh_write_transaction_header() {
     log(LL_DEBUG, LM_DH, "dh_write_transaction_header");
 
-    assertDo(!fh_fopen(1, "TRANSACT.DB"), LL_ERROR, LM_DH, "Can't open transaction list", return false;);
+    assertDo(!fh_fopen(1, transaction_file), LL_ERROR, LM_DH, "Can't open transaction list", dh_transaction_fault(); return false;);
 
     sTransactionHeaderCS header_cs;
     header_cs.header = transaction_header;
-    header_cs.checksum = calculate_checksum((uint16_t*) &header_cs.header, sizeof(header_cs.header));
+    header_cs.checksum = transaction_header_checksum;
 
-    fh_fwrite(0, sizeof(header_cs), (uint8_t*) &header_cs);
+    int32_t written = fh_fwrite(0, sizeof(header_cs), (uint8_t*) &header_cs);
     fh_flog(0);
 
     fh_fclose();
+    assertDo(written != (int32_t) sizeof(header_cs), LL_ERROR, LM_DH, "Can't write transaction header", dh_transaction_fault(); return false;);
+
+    #if DH_HEADER_SELFCHECK
+        assertDo(!dh_check_transaction_header(), LL_ERROR, LM_DH, "Transaction header selfcheck failed", dh_transaction_fault(); return false;);
+    #endif
     return true;
 }
 
 bool dh_read_last_transaction() {
     log(LL_DEBUG, LM_DH, "dh_read_last_transaction");
 
-    assertDo(!fh_fopen(1, "TRANSACT.DB"), LL_ERROR, LM_DH, "Can't open transaction list", return false;);
+    if(session_cached)
+        return true;
+
+    assertDo(!fh_fopen(1, transaction_file), LL_ERROR, LM_DH, "Can't open transaction list", return false;);
 
     log(LL_DEBUG, LM_DH, "Transaction file length", (uint32_t) fh_flen());
 
@@ -144,7 +801,7 @@ bool dh_read_last_transaction() {
     uint32_t checksum = calculate_checksum((uint16_t*) &transaction_cs.transaction, sizeof(transaction_cs.transaction));
     log(LL_DEBUG, LM_DH, "Checksum from file:  ", transaction_cs.checksum);
     log(LL_DEBUG, LM_DH, "Checksum calculated: ", checksum);
-    assertDo(checksum != transaction_cs.checksum, LL_FATAL, LM_DH, "Checksum of transaction header wrong", return false;);
+    assertDo(checksum != transaction_cs.checksum, LL_FATAL, LM_DH, "Checksum of transaction header wrong", fh_fclose(); dh_transaction_fault(); return false;);
     
     transaction = transaction_cs.transaction;
 
@@ -156,17 +813,17 @@ bool dh_append_transaction() {
     log(LL_DEBUG, LM_DH, "dh_append_transaction");
 
     log(LL_INFO, LM_DH, "Try to append a new transaction...");
-    assertDo(!fh_fopen(1, "TRANSACT.DB"), LL_ERROR, LM_DH, "Can't open transaction list", return false;);
+    assertDo(!fh_fopen(1, transaction_file), LL_ERROR, LM_DH, "Can't open transaction list", return false;);
 
     sTransactionCS transaction_cs;
     transaction_cs.transaction = transaction;
     transaction_cs.checksum = calculate_checksum((uint16_t*) &transaction_cs.transaction, sizeof(transaction_cs.transaction));
-    fh_fappend(sizeof(transaction_cs), (uint8_t*) & transaction_cs);
+    int32_t written = fh_fappend(sizeof(transaction_cs), (uint8_t*) & transaction_cs);
     fh_flog(0);
     fh_fclose();
+    assertDo(written != (int32_t) sizeof(transaction_cs), LL_ERROR, LM_DH, "Can't append transaction", dh_transaction_fault(); return false;);
 
-    transaction_header.entry_count++;
-    transaction_header.datetime_modified = clock_now().unixtime();
+    dh_update_transaction_header(transaction_header.entry_count + 1, clock_now().unixtime());
 
     log(LL_INFO, LM_DH, "New transaction appended to SD-card.");
     return dh_write_transaction_header();
@@ -176,17 +833,18 @@ bool dh_write_last_transaction() {
     log(LL_DEBUG, LM_DH, "dh_write_last_transaction");
 
     log(LL_INFO, LM_DH, "Try to write / update last transaction...");
-    assertDo(!fh_fopen(1, "TRANSACT.DB"), LL_ERROR, LM_DH, "Can't open transaction list", return false;);
+    assertDo(!fh_fopen(1, transaction_file), LL_ERROR, LM_DH, "Can't open transaction list", return false;);
 
     sTransactionCS transaction_cs;
     transaction_cs.transaction = transaction;
     transaction_cs.checksum = calculate_checksum((uint16_t*) &transaction_cs.transaction, sizeof(transaction_cs.transaction));
-    fh_fwrite(sizeof(sTransactionHeaderCS) + (transaction_header.entry_count-1)*sizeof(sTransactionCS), sizeof(sTransactionCS), (uint8_t*) &transaction_cs);
+    int32_t written = fh_fwrite(sizeof(sTransactionHeaderCS) + (transaction_header.entry_count-1)*sizeof(sTransactionCS), sizeof(sTransactionCS), (uint8_t*) &transaction_cs);
     fh_flog(0);
     
     transaction = transaction_cs.transaction;
     
     fh_fclose();
+    assertDo(written != (int32_t) sizeof(transaction_cs), LL_ERROR, LM_DH, "Can't write last transaction", dh_transaction_fault(); return false;);
 
     log(LL_INFO, LM_DH, "Last transaction was written / updated.");
     return true;
@@ -229,7 +887,8 @@ bool dh_create_transaction(uint32_t memberID, uint8_t itemID, uint32_t cost, uin
     if(transaction.status <= DH_TA_APPROVED) {
         assertCnt(true, LL_ERROR, LM_DH, "There was already a transaction in progress. Can't start a new one.");
         
-        if(clock_now().unixtime() - transaction.datetime_modified > 20 ) {
+        // Without an armed timer the transaction was read back from the file and is older than this run
+        if(transaction_stale || !tw_armed(&transaction_timer)) {
             log(LL_WARNING, LM_DH, "Timeout of unapproved transaction. Mark as such and continue with the new transaction.");
             dh_timeout_transaction();
         } else
@@ -254,7 +913,15 @@ bool dh_create_transaction(uint32_t memberID, uint8_t itemID, uint32_t cost, uin
     transaction.datetime_modified = clock_now().unixtime();
     log(LL_INFO, LM_DH, "New transaction was created but is yet not stored");
 
-    return dh_append_transaction();
+    bool stored = dh_append_transaction();
+    if(stored) {
+        transaction_stale = false;
+        tw_arm(&transaction_timer, DH_TRANSACTION_TIMEOUT);
+    }
+
+    // Header and last transaction are known from here on until the session ends
+    session_cached = stored && session_open;
+    return stored;
 }
 
 bool dh_approve_transaction() {
@@ -284,6 +951,7 @@ bool dh_complete_transaction() {
     transaction.status |= DH_TA_COMPLETED;
     //transaction.datetime_modified = clock_now().unixtime();
 
+    tw_cancel(&transaction_timer);
     assertDo(!dh_write_last_transaction(), LL_ERROR, LM_DH, "Can't write last transaction", return false;);
 
     return true;    
@@ -300,6 +968,7 @@ bool dh_cancle_transaction() {
     transaction.status |= DH_TA_CANCLED;
     transaction.datetime_modified = clock_now().unixtime();
 
+    tw_cancel(&transaction_timer);
     assertDo(!dh_write_last_transaction(), LL_ERROR, LM_DH, "Can't write last transaction", return false;);
 
     return true;    
@@ -316,18 +985,73 @@ bool dh_timeout_transaction() {
     transaction.status |= DH_TA_TIMEOUT;
     transaction.datetime_modified = clock_now().unixtime();
 
+    tw_cancel(&transaction_timer);
     assertDo(!dh_write_last_transaction(), LL_ERROR, LM_DH, "Can't write last transaction", return false;);
 
     return true;    
 }
 
+void dh_transaction_stale() {
+    transaction_stale = true;
+}
+
+void dh_begin_session() {
+    log(LL_DEBUG, LM_DH, "dh_begin_session");
+    session_open = true;
+    session_cached = false;
+}
+
+void dh_end_session() {
+    log(LL_DEBUG, LM_DH, "dh_end_session");
+    session_open = false;
+    session_cached = false;
+
+    // A new data-base waiting for the end of the session is taken right away
+    if(load_state == DL_Ready && !load_startup)
+        dh_load_step();
+}
+
+void dh_set_transaction_file(const char name[]) {
+    log(LL_DEBUG, LM_DH, "dh_set_transaction_file");
+
+    transaction_file = (name != 0) ? name : DH_TRANSACTION_FILE;
+    log(LL_INFO, LM_DH, "Transactions are stored in: ", transaction_file);
+
+    // A transaction in progress and the header belong to the previous file
+    transaction.status = DH_TA_CORRUPTED;
+    tw_cancel(&transaction_timer);
+    session_cached = false;
+    transaction_header_valid = false;
+}
+
+// idx counts the members only, not the free slots a delta left
 sMember* dh_get_member_from_idx(uint32_t idx) {
     log(LL_DEBUG, LM_DH, "dh_get_member_from_idx");
 
-    if(idx >= member_count)
-        return 0;
+    for(uint32_t i = 0; i < member_count; i++) {
+        if(members[i].id == 0)
+            continue;
+        if(idx == 0)
+            return &members[i];
+        idx--;
+    }
+    return 0;
+}
+
+bool dh_log_card_programming(uint32_t memberID, uint32_t cardID, bool success) {
+    log(LL_DEBUG, LM_DH, "dh_log_card_programming");
 
-    return &members[idx];    
+    char line[64];
+    DateTime time = clock_now();
+    int len = sprintf(line, "%04u-%02u-%02u %02u:%02u:%02u;%08lu;%08lu;%s\r\n", time.year(), time.month(), time.day(),
+                      time.hour(), time.minute(), time.second(), memberID, cardID, success ? "OK" : "FAILED");
+
+    assertDo(!fh_fopen(1, DH_PROGRAMMING_FILE), LL_ERROR, LM_DH, "Can't open card programming log", return false;);
+    int32_t written = fh_fappend(len, (uint8_t*) line);
+    fh_fclose();
+
+    assertDo(written != len, LL_ERROR, LM_DH, "Can't append to card programming log", return false;);
+    return true;
 }
 
 char log_dir[16];
@@ -348,25 +1072,29 @@ bool dh_prepare_log() {
     return true;
 }
 
-bool dh_store_log(char *log_buffer, uint32_t size) {
+bool dh_store_log(uint32_t pos, const char *log_data, uint32_t size) {
     log(LL_DEBUG, LM_DH, "dh_store_log");
 
     char log_name[16];
     char log_path[64];
-    DateTime time;
 
     sprintf(log_name, "LOG%03d.txt", log_idx);
     sprintf(log_path, "%s/%s/%s", log_parent, log_dir, log_name);
-    log(LL_INFO, LM_DH, "Generate new log File: ", log_path);
+    if(pos == 0)
+        log(LL_INFO, LM_DH, "Generate new log File: ", log_path);
 
     assertDo(!fh_fopen(1, log_path), LL_ERROR, LM_DH, "Can't open new or existing log", return false;);
 
     // Always start with an empty file
-    fh_clear();
+    if(pos == 0)
+        fh_clear();
 
-    fh_fwrite(0, size, (uint8_t*) log_buffer);
+    int32_t written = fh_fwrite(pos, size, (uint8_t*) log_data);
     fh_fclose();
 
-    // Calculate next log idx:
+    return written == (int32_t) size;
+}
+
+void dh_next_log() {
     log_idx = (log_idx + 1) % MAX_LOG_IDX;
-}
\ No newline at end of file
+}
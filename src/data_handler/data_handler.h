@@ -4,7 +4,18 @@
 #include "../util/time_format.h"
 #include "business_model.h"
 
+// Starts loading the member data-base. dh_init_step() loads the next part and returns true until it's done.
 void dh_init();
+bool dh_init_step();
+bool dh_ready();
+
+// Loop: looks for a newer DATABASE.DB on both SD-cards and loads it in steps. True while loading.
+// Without one, a DATABASE.DLT based on the members in use is applied to them and then written to their DATABASE.DB.
+// The new members replace the old ones at once and only between two sessions.
+bool dh_reload_step();
+
+// Changes with every swap of the member table. Whoever keeps a checked card compares it.
+uint32_t dh_members_generation();
 
 /**
  * Access to member data 
@@ -23,9 +34,22 @@ bool dh_complete_transaction();
 bool dh_cancle_transaction();
 bool dh_timeout_transaction();
 
+// Between begin and end the transaction file is not re-read for every vend
+void dh_begin_session();
+void dh_end_session();
+void dh_set_transaction_file(const char name[]);
+
+// Header in RAM against its full checksum and the copy on the SD-card. The write path does it with DH_HEADER_SELFCHECK.
+bool dh_check_transaction_header();
+
+// Appends one line per programmed card to the programming log on the SD-card
+bool dh_log_card_programming(uint32_t memberID, uint32_t cardID, bool success);
+
 /**
  * Access to log
  **/
-bool dh_store_log(char *log_buffer, uint32_t size);
+// Writes a part of the current log file, pos 0 starts it empty. dh_next_log() moves on to the next file.
+bool dh_store_log(uint32_t pos, const char *log_data, uint32_t size);
+void dh_next_log();
 
 bool dh_prepare_log();
@@ -17,37 +17,45 @@ SdFile file;
 void fh_init() {
     log(LL_DEBUG, LM_FH, "fh_init");
 
-    fs1_ready = false;
-    fs2_ready = false;
+    fh_init_card(1);
+    fh_init_card(2);
+}
+
+void fh_init_card(uint8_t card) {
+    log(LL_DEBUG, LM_FH, "fh_init_card");
 
-    assertCnt(!card1.init(SPI_HALF_SPEED, SDCARD1_CS), LL_ERROR, LM_FH, "Initialisation of SD-card 1 failed") 
-    else {
-        assertCnt(!volume1.init(card1), LL_ERROR, LM_FH, "Could not find FAT16/FAT32 partition on SD-card 1")
+    if(card == 1) {
+        fs1_ready = false;
+        assertCnt(!card1.init(SPI_HALF_SPEED, SDCARD1_CS), LL_ERROR, LM_FH, "Initialisation of SD-card 1 failed") 
         else {
-            root1.openRoot(volume1);
-            fs1_ready = true;
-            if(checkLogLevel(LM_FH, LL_DEBUG)) {
-                log(LL_DEBUG, LM_FH, "Root-Directory of SD-card 1:");
-                root1.ls(LS_R | LS_DATE | LS_SIZE);
+            assertCnt(!volume1.init(card1), LL_ERROR, LM_FH, "Could not find FAT16/FAT32 partition on SD-card 1")
+            else {
+                root1.openRoot(volume1);
+                fs1_ready = true;
+                if(checkLogLevel(LM_FH, LL_DEBUG)) {
+                    log(LL_DEBUG, LM_FH, "Root-Directory of SD-card 1:");
+                    root1.ls(LS_R | LS_DATE | LS_SIZE);
+                }
             }
         }
-    }
-
-    assertCnt(!card2.init(SPI_HALF_SPEED, SDCARD2_CS), LL_ERROR, LM_FH, "Initialisation of SD-card 2 failed") 
-    else {
-        assertCnt(!volume2.init(card2), LL_ERROR, LM_FH, "Could not find FAT16/FAT32 partition on SD-card 2") 
+    } else {
+        fs2_ready = false;
+        assertCnt(!card2.init(SPI_HALF_SPEED, SDCARD2_CS), LL_ERROR, LM_FH, "Initialisation of SD-card 2 failed") 
         else {
-            root2.openRoot(volume2);
-            fs2_ready = true;
-            if(checkLogLevel(LM_FH, LL_DEBUG)) {
-                log(LL_DEBUG, LM_FH, "Root-Directory of SD-card 2:");
-                root2.ls(LS_R | LS_DATE | LS_SIZE);
+            assertCnt(!volume2.init(card2), LL_ERROR, LM_FH, "Could not find FAT16/FAT32 partition on SD-card 2") 
+            else {
+                root2.openRoot(volume2);
+                fs2_ready = true;
+                if(checkLogLevel(LM_FH, LL_DEBUG)) {
+                    log(LL_DEBUG, LM_FH, "Root-Directory of SD-card 2:");
+                    root2.ls(LS_R | LS_DATE | LS_SIZE);
+                }
             }
         }
     }
 }
 
-bool traversePath(const char path[], bool dirExpected) {
+bool traversePath(const char path[], bool dirExpected, bool create) {
     log(LL_DEBUG, LM_FH, "traversePath");
 
     char next[16];
@@ -73,16 +81,22 @@ bool traversePath(const char path[], bool dirExpected) {
         assertDo(!file.close(), LL_ERROR, LM_FH, "Can't close dir file", return false;);
 
         file = next_file;
-        return traversePath(&path[i+1], dirExpected);
+        return traversePath(&path[i+1], dirExpected, create);
     } else {
         log(LL_DEBUG, LM_FH, "Open ", path);
 
         if(dirExpected) {
             log(LL_DEBUG, LM_FH, "As Directoy");
             assertDo(!next_file.open(&file, path, O_RDONLY), LL_ERROR, LM_FH, "Can't open directory", return false;);
-        } else {
+        } else if(create) {
             log(LL_DEBUG, LM_FH, "As File");
             assertDo(!next_file.open(&file, path, O_RDWR | O_CREAT), LL_ERROR, LM_FH, "Can't open file", return false;);
+        } else {
+            log(LL_DEBUG, LM_FH, "As existing File");
+            if(!next_file.open(&file, path, O_RDONLY)) {
+                log(LL_DEBUG, LM_FH, "File doesn't exist");
+                return false;
+            }
         }
         assertDo(!file.close(), LL_ERROR, LM_FH, "Can't close dir file", return false;);
 
@@ -91,24 +105,33 @@ bool traversePath(const char path[], bool dirExpected) {
     }
 }
 
-bool fh_fopen(uint8_t card, const char path[]) {
-    log(LL_DEBUG, LM_FH, "fh_fopen");
+bool fh_fopen_mode(uint8_t card, const char path[], bool create) {
     file.close();
 
     if(card == 1) {
         assertDo(!fs1_ready, LL_WARNING, LM_FH, "Can't open file on SD-card 1. FS not ready", return false;);
         file = root1;
-        return traversePath(path, false);
+        return traversePath(path, false, create);
     } else if(card == 2) {
         assertDo(!fs2_ready, LL_WARNING, LM_FH, "Can't open file on SD-card 2. FS not ready", return false;);
         file = root2;
-        return traversePath(path, false);
+        return traversePath(path, false, create);
     } else {
         assertCnt(true, LL_ERROR, LM_FH, "Invalid SD-card number");
         return false;
     }
 }
 
+bool fh_fopen(uint8_t card, const char path[]) {
+    log(LL_DEBUG, LM_FH, "fh_fopen");
+    return fh_fopen_mode(card, path, true);
+}
+
+bool fh_fopen_existing(uint8_t card, const char path[]) {
+    log(LL_DEBUG, LM_FH, "fh_fopen_existing");
+    return fh_fopen_mode(card, path, false);
+}
+
 void fh_fclose() {
     log(LL_DEBUG, LM_FH, "fh_fclose");
     file.close();
@@ -183,11 +206,11 @@ bool fh_mkdir(uint8_t card, const char path[], const char name[]) {
     if(card == 1) {
         assertDo(!fs1_ready, LL_WARNING, LM_FH, "Can't open file on SD-card 1. FS not ready", return false;);
         file = root1;
-        assertDo(!traversePath(path, true), LL_WARNING, LM_FH, "Can't find path on SD-card 1", return false;);
+        assertDo(!traversePath(path, true, false), LL_WARNING, LM_FH, "Can't find path on SD-card 1", return false;);
     } else if(card == 2) {
         assertDo(!fs2_ready, LL_WARNING, LM_FH, "Can't open file on SD-card 2. FS not ready", return false;);
         file = root2;
-        assertDo(!traversePath(path, true), LL_WARNING, LM_FH, "Can't find path on SD-card 2", return false;);
+        assertDo(!traversePath(path, true, false), LL_WARNING, LM_FH, "Can't find path on SD-card 2", return false;);
     } else {
         assertCnt(true, LL_ERROR, LM_FH, "Invalid SD-card number");
         return false;
@@ -4,8 +4,10 @@
 #include "../util/price.h"
 
 void fh_init();
+void fh_init_card(uint8_t card);    // one card of fh_init(), for a startup in steps
 
 bool fh_fopen(uint8_t card, const char path[]);
+bool fh_fopen_existing(uint8_t card, const char path[]);    // read only, false without logging an error if it doesn't exist
 void fh_fclose();
 
 bool fh_fs_ready(uint8_t card);
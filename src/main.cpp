@@ -6,10 +6,67 @@
 #include "data_handler/data_handler.h"
 #include "rfid/rfid.h"
 #include "periphery/periphery.h"
+#include "simulator/vmc_simulator.h"
+#include "simulator/card_emulator.h"
+#include "util/checksum.h"
+#include "util/scheduler.h"
+#include "util/timer_wheel.h"
 #include "TimerOne.h"
 
 #define AUTO_LOG true
 
+// Waits before anything starts, e.g. to attach a serial monitor [ms]. The VMC gets no answer meanwhile.
+#define STARTUP_DELAY 0
+
+// Run the VMC simulator once at startup (no VMC needed, answers never reach the bus)
+#define RUN_VMC_SIMULATION false
+#define VMC_SIMULATION_SESSIONS 1000
+#define VMC_SIMULATION_SEED 1
+
+// Run the RFID scenarios once at startup against the emulated reader and card (requires PN532_CARD_EMULATOR in PN532.h)
+#define RUN_CARD_EMULATION false
+#define CARD_EMULATION_SEED 1
+
+// Cross-check and speed of the checksum engine once at startup
+#define RUN_CHECKSUM_BENCH false
+
+// RFID poll interval [ms] by what the cashless device needs from the card
+#define RFID_INTERVAL_SESSION   100     // session, vend or card job: removal and the card to program are seen quickly
+#define RFID_INTERVAL_TAP       200     // enabled and used recently: waiting for a tap
+#define RFID_INTERVAL_IDLE      1000    // enabled, but no card for RFID_IDLE_AFTER
+#define RFID_INTERVAL_OFF       2000    // inactive or disabled: nobody can pay
+#define RFID_IDLE_AFTER         60000
+
+// Task periods [ms]. Commands from the VMC wake the cashless device right away.
+#define CLDEV_INTERVAL          5
+#define TIMER_INTERVAL          1
+#define CLOCK_INTERVAL          1
+#define LOG_STORE_INTERVAL      100
+#define DB_RELOAD_INTERVAL      10000   // looks for a new member data-base on the SD-cards
+#define SCHED_STATS_INTERVAL    600000
+
+uint8_t cldev_task = SCHED_NO_TASK;
+uint8_t rfid_task = SCHED_NO_TASK;
+uint8_t boot_task = SCHED_NO_TASK;
+
+// Startup: MDB, clock and cashless device come up in setup(), so that the VMC gets answers right away.
+// The other stages follow in the background, the reader is reset alongside them.
+enum eBootStage {
+  BOOT_MDB,
+  BOOT_SD1,
+  BOOT_SD2,
+  BOOT_MEMBERS,
+  BOOT_READER,
+  BOOT_TESTS,
+  BOOT_STAGES
+};
+
+const char *boot_names[BOOT_STAGES] = { "MDB", "SD-card 1", "SD-card 2", "Members", "Reader", "Tests" };
+uint32_t boot_start[BOOT_STAGES];     // millis()
+uint32_t boot_end[BOOT_STAGES];
+uint8_t boot_stage;                   // the stage in the background
+bool reader_booting;
+
 uint8_t cmd;
 uint8_t data[64];
 uint8_t len;
@@ -17,19 +74,130 @@ uint8_t len;
 void test() {
   do {
     len = mdb_read(&cmd, data);
-    if(len > 0)
-      cldev_run(cmd, data);
+    if(len > 0) {
+      cldev_receive(cmd, data);
+      sched_wake(cldev_task);
+    }
   } while(len > 0);
 }
 
 
+uint32_t transid = 0;
+uint32_t rfid_last_activity;
+
+uint32_t rfid_interval() {
+  uint8_t demand = cldev_card_demand();
+
+  if(demand == CLDEV_CARD_SESSION || rfid_job_pending() || rfid_member_present() != 0)
+    rfid_last_activity = millis();
+
+  if(demand == CLDEV_CARD_SESSION || rfid_job_pending())
+    return RFID_INTERVAL_SESSION;
+  if(demand == CLDEV_CARD_NONE)
+    return RFID_INTERVAL_OFF;
+  if(millis() - rfid_last_activity < RFID_IDLE_AFTER)
+    return RFID_INTERVAL_TAP;
+  return RFID_INTERVAL_IDLE;
+}
+
+bool task_cldev() {
+  cldev_run();
+  return false;
+}
+
+// The card is checked as often as the cashless state needs it
+bool task_rfid() {
+  // Commands from the VMC have priority. The card is only read when nothing is waiting.
+  if(cldev_pending()) {
+    sched_wake(cldev_task);
+    return true;
+  }
+
+  rfid_allow_card_session(cldev_card_demand() != CLDEV_CARD_NONE);
+  rfid_run();
+  //rfid_program_card(20000000, 20000000);
+  sched_set_period(rfid_task, rfid_interval());
+  return false;
+}
+
+bool task_stats() {
+  sched_log_stats();
+  return false;
+}
+
+void boot_log_timeline() {
+  char text[64];
+  log(LL_INFO, LM_MAIN, "Startup timeline [ms]:");
+  log(LL_INFO, LM_MAIN, "Stage       start    end   took");
+  for(uint8_t i = 0; i < BOOT_STAGES; i++) {
+    sprintf(text, "%-10s %6lu %6lu %6lu", boot_names[i], (unsigned long) boot_start[i], (unsigned long) boot_end[i],
+            (unsigned long) (boot_end[i] - boot_start[i]));
+    log(LL_INFO, LM_MAIN, text);
+  }
+}
+
+// One step of the background startup. Until it's done, the data handler and the reader report not ready.
+bool task_boot() {
+  if(reader_booting && !rfid_init_step()) {
+    reader_booting = false;
+    boot_end[BOOT_READER] = millis();
+  }
+
+  switch(boot_stage) {
+    case BOOT_SD1:
+      fh_init_card(1);
+      break;
+    case BOOT_SD2:
+      fh_init_card(2);
+      break;
+    case BOOT_MEMBERS:
+      if(dh_init_step())
+        return true;
+      break;
+    case BOOT_READER:
+      // Everything else is done, the reset pulse is still running
+      if(reader_booting)
+        return true;
+      break;
+    case BOOT_TESTS:
+      // The simulations drive the cashless device themselves, commands from the bus would get in between
+      if(RUN_VMC_SIMULATION || RUN_CARD_EMULATION || RUN_CHECKSUM_BENCH) {
+        Timer1.detachInterrupt();
+        if(RUN_VMC_SIMULATION)
+          vsim_run(VMC_SIMULATION_SESSIONS, VMC_SIMULATION_SEED);
+        if(RUN_CARD_EMULATION)
+          cemu_run(CARD_EMULATION_SEED);
+        if(RUN_CHECKSUM_BENCH)
+          checksum_bench();
+        Timer1.attachInterrupt(test);
+      }
+      break;
+    default:
+      break;
+  }
+
+  if(boot_stage != BOOT_READER)
+    boot_end[boot_stage] = millis();
+  boot_stage++;
+  if(boot_stage < BOOT_STAGES) {
+    if(boot_stage != BOOT_READER)
+      boot_start[boot_stage] = millis();
+    return true;
+  }
+
+  boot_log_timeline();
+  log(LL_INFO, LM_MAIN, "Startup finished.");
+  return false;
+}
+
 void setup() {
   // put your setup code here, to run once:
   err_init();
 
   setLogLevel(LL_INFO);
   
-  delay(5000);
+  if(STARTUP_DELAY > 0)
+    delay(STARTUP_DELAY);
 
   log(LL_INFO, LM_MAIN, "**************************************");
   log(LL_INFO, LM_MAIN, "* Cashless Payment on Teensy         *");
@@ -39,26 +207,45 @@ void setup() {
   log(LL_INFO, LM_MAIN, "");
 
   log(LL_INFO, LM_MAIN, "Startup Sequence...");
-  clock_init();
+  boot_start[BOOT_MDB] = millis();
   peri_init();
-  fh_init();
-  dh_init();
   mdb_init();
-  cldev_init();
+  clock_init();
+
+  // Not ready until the background stages are done
+  dh_init();
+  boot_start[BOOT_READER] = millis();
   rfid_init(AUTO_LOG);
-  log(LL_INFO, LM_MAIN, "Startup finished. Start Loop...");
+  reader_booting = true;
+
+  cldev_init();
+
+  // Highest priority first
+  cldev_task = sched_add("ClDev", 0, &task_cldev, CLDEV_INTERVAL);
+  sched_add("Timers", 1, &tw_run, TIMER_INTERVAL);
+  rfid_task = sched_add("RFID", 2, &task_rfid, RFID_INTERVAL_TAP);
+  sched_add("Clock", 3, &clock_run, CLOCK_INTERVAL);
+  sched_add("LogStore", 4, &err_log_store_step, LOG_STORE_INTERVAL);
+  sched_add("DBReload", 5, &dh_reload_step, DB_RELOAD_INTERVAL);
+  sched_add("Stats", 6, &task_stats, SCHED_STATS_INTERVAL);
+  boot_task = sched_add("Boot", 7, &task_boot, 0);
 
   Timer1.initialize(3000);
   Timer1.attachInterrupt(test);
-}
+  boot_end[BOOT_MDB] = millis();
 
-uint32_t transid = 0;
+  boot_stage = BOOT_SD1;
+  boot_start[BOOT_SD1] = millis();
+  sched_wake(boot_task);
+  log(LL_INFO, LM_MAIN, "MDB is up, the rest starts in the background. Start Loop...");
+}
 
 void loop() {
   log(LL_DEBUG, LM_MAIN, "Loop Cycle");
 
-  rfid_run();
-  //rfid_program_card(20000000, 20000000);
+  // A tap seen by the PN532 is handled right away
+  if(rfid_card_event())
+    sched_wake(rfid_task);
 
-  delay(500);
+  sched_run();
 }
\ No newline at end of file
@@ -1,7 +1,6 @@
 #include "mdb.h"
 #include "../cashless_device/cashless_device.h"
 #include "../error_handler/error_handler.h"
-#include "../util/soft_timer.h"
 
 #include <HardwareSerial.h>
 #define SERIAL_9N1 0x84
@@ -21,30 +20,37 @@
 
 #define MDB_RESET_PIN 3
 
-cSoftTimer reset_timer;
-cSoftTimer nack_timer;
+#define MDB_RESET_TIME      100     // ms the RESET line must be high
+#define MDB_ACK_TIMEOUT     5       // ms until the frame is sent again
+
+// Runs in the MDB interrupt: plain millis() deadlines instead of the timer wheel of the loop
+bool reset_high;
+uint32_t reset_high_since;
+
+void (*mdb_tx_hook)(uint8_t type, uint8_t len, const uint8_t data[]) = 0;
 
 uint32_t check_mdb_state() {
     int available = Serial1.available();
     if(available > 0) {
         log(LL_DEBUG, LM_MDB, "MDB-State: Bytes available");
-        reset_timer.Stop();
+        reset_high = false;
         return available;
     } else {
         //log(LL_DEBUG, LM_MDB, "MDB-State: No Bytes available");
         if(digitalRead(MDB_RESET_PIN) == HIGH) {
             log(LL_DEBUG, LM_MDB, "MDB-State: RESET high");
-            if(!reset_timer.IsStarted()) {
-                reset_timer.Start(100);
+            if(!reset_high) {
+                reset_high = true;
+                reset_high_since = millis();
                 //log(LL_DEBUG, LM_MDB, "MDB-State: Reset Timer Started");
             }
-            else if(reset_timer.IsOver()) {
+            else if(millis() - reset_high_since > MDB_RESET_TIME) {
                 //log(LL_DEBUG, LM_MDB, "MDB-State: Reset Timer Over. Reinit MDB");
                 mdb_init();
             } 
         } else {
             //log(LL_DEBUG, LM_MDB, "MDB-State: RESET low");
-            reset_timer.Stop();
+            reset_high = false;
         }
         return 0;
     }
@@ -100,31 +106,38 @@ void mdb_init() {
 
     Serial1.begin(9600, SERIAL_9N1_TXINV); 
 
-    reset_timer.Stop();
-    nack_timer.Stop();
+    reset_high = false;
 
     //state = MS_Idle;
     //prev_state = MS_RESET;
 }
 
-bool mdb_send_data(uint8_t len, const uint8_t data[]) {
-    log_hexdump(LL_DEBUG, LM_MDB, "mdb_send_data ():", len, data);
+uint8_t mdb_checksum(uint8_t len, const uint8_t data[]) {
+    uint8_t chk = 0;
+    for(uint8_t i = 0; i < len; i++)
+        chk += data[i];
+    return chk;
+}
+
+bool mdb_send_frame(uint8_t len, const uint8_t frame[]) {
+    assertDo(len < 2, LL_ERROR, LM_MDB, "Frame without data", return false;);
 
-    uint8_t chk = 0; 
+    if(mdb_tx_hook != 0) {
+        (*mdb_tx_hook)(MDB_TX_DATA, len - 1, frame);
+        return true;    // the simulated VMC always acknowledges
+    }
 
     // Transfer data
-    for(uint8_t i = 0; i < len; i++) {
-        write(data[i], false);
-        chk += data[i];
-    } 
+    for(uint8_t i = 0; i < len - 1; i++)
+        write(frame[i], false);
 
     // Transfer CHK
-    write(chk, true);
+    write(frame[len - 1], true);
 
     // Wait for ACK, NACK, RET
-    nack_timer.Start(5);
+    uint32_t sent = millis();
 
-    while(!nack_timer.IsOver()) {
+    while(millis() - sent <= MDB_ACK_TIMEOUT) {
         if(check_mdb_state() > 0) {
             uint8_t response;
             bool mode = read(&response, 255, 0);
@@ -133,22 +146,41 @@ bool mdb_send_data(uint8_t len, const uint8_t data[]) {
             if(response == 0x00)        // ACK --> we are done here
                 return true;
             else if(response == 0xAA || response == 0xFF)   // RET or NACK --> send again
-                return mdb_send_data(len, data);
+                return mdb_send_frame(len, frame);
             else
                 assertDo(true, LL_ERROR, LM_MDB, "Expected ACK, NACK, RET but got unknown data", return false;);        
         }
     }
     // NACK timer over so try again
-    return mdb_send_data(len, data);
+    return mdb_send_frame(len, frame);
+}
+
+bool mdb_send_data(uint8_t len, const uint8_t data[]) {
+    log_hexdump(LL_DEBUG, LM_MDB, "mdb_send_data ():", len, data);
+
+    uint8_t frame[MDB_MAX_BLOCK + 1];
+    assertDo(len > MDB_MAX_BLOCK, LL_ERROR, LM_MDB, "Block too long for MDB", return false;);
+
+    memcpy(frame, data, len);
+    frame[len] = mdb_checksum(len, data);
+    return mdb_send_frame(len + 1, frame);
 }
 
 void mdb_send_ack() {
     log(LL_DEBUG, LM_MDB, "mdb_send_ack");
+    if(mdb_tx_hook != 0) {
+        (*mdb_tx_hook)(MDB_TX_ACK, 0, 0);
+        return;
+    }
     write(0x00, true);
 }
 
 void mdb_send_nack() {
     log(LL_DEBUG, LM_MDB, "mdb_send_nack");
+    if(mdb_tx_hook != 0) {
+        (*mdb_tx_hook)(MDB_TX_NACK, 0, 0);
+        return;
+    }
     write(0xFF, true);
 }
 
@@ -170,6 +202,7 @@ uint8_t mdb_read(uint8_t *cmd, uint8_t data[]) {
                 log_hexdump(LL_DEBUG, LM_MDB, "Received cmd", 1, cmd);
 
                 uint8_t rem_len = cldev_cmd_len(*cmd);      // How many to be read based on CMD
+                assertDo(rem_len == CLDEV_INVALID_LEN, LL_WARNING, LM_MDB, "Unknown cmd from VCM. Block dropped.", return 0;);
                 for(uint8_t i = 0; i < rem_len; i++) {      // Read rem_len bytes   
                     mode = read(&data[len], *cmd, 255);
                     chk += data[len];
@@ -179,6 +212,7 @@ uint8_t mdb_read(uint8_t *cmd, uint8_t data[]) {
                 }
 
                 rem_len = cldev_scmd_len(*cmd, data[0]);    // How many to be read based on SCMD
+                assertDo(rem_len == CLDEV_INVALID_LEN, LL_WARNING, LM_MDB, "Unknown subcmd from VCM. Block dropped.", return 0;);
                 for(uint8_t i = 0; i < rem_len; i++) {      // Read rem_len bytes
                     mode = read(&data[len], *cmd, data[0]);
                     chk += data[len];
@@ -203,6 +237,11 @@ uint8_t mdb_read(uint8_t *cmd, uint8_t data[]) {
     return len;
 }
 
+void mdb_set_tx_hook(void (*tx_hook)(uint8_t type, uint8_t len, const uint8_t data[])) {
+    log(LL_DEBUG, LM_MDB, "mdb_set_tx_hook");
+    mdb_tx_hook = tx_hook;
+}
+
 
 
 
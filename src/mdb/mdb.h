@@ -4,10 +4,23 @@
 
 void mdb_init();
 
+#define MDB_MAX_BLOCK 36    // data bytes in one block, without CHK
+
 bool mdb_send_data(uint8_t len, const uint8_t data[]);
 
+// Sends a block that was prepared ahead of time: len data bytes followed by their CHK
+bool mdb_send_frame(uint8_t len, const uint8_t frame[]);
+uint8_t mdb_checksum(uint8_t len, const uint8_t data[]);
+
 void mdb_send_ack();
 
 void mdb_send_nack();
 
-uint8_t mdb_read(uint8_t *cmd, uint8_t data[]);
\ No newline at end of file
+uint8_t mdb_read(uint8_t *cmd, uint8_t data[]);
+
+// Loopback for the VMC simulator: if a hook is set, all answers go to the hook instead of the bus
+#define MDB_TX_DATA 0
+#define MDB_TX_ACK  1
+#define MDB_TX_NACK 2
+
+void mdb_set_tx_hook(void (*tx_hook)(uint8_t type, uint8_t len, const uint8_t data[]));
\ No newline at end of file
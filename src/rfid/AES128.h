@@ -3,17 +3,32 @@
 
 #include "DesFireKey.h"
 
-class AES : public DESFireKey
+// T-table implementation: the round keys are expanded once in SetKeyData() and each round needs 4 table lookups per column.
+// Costs 2 kB flash for the tables and 352 byte RAM per key.
+// false -> the compact implementation from Texas Instruments which expands the key again for each block.
+#define AES_USE_TTABLES  true
+
+class AES final : public DESFireKeyPolicy<AES>
 {
 public:
     AES();
     ~AES();
     bool SetKeyData(const byte* u8_Key, int s32_KeySize, byte u8_Version);
     bool CryptDataBlock(byte* u8_Out, const byte* u8_In, DESFireCipher e_Cipher);
+
+    // FIPS-197 test vector for both implementations and the time per block
+    static bool Selftest();
     
 private:
+    void ExpandKey();
+    void EncryptBlock(byte* u8_Out, const byte* u8_In);
+    void DecryptBlock(byte* u8_Out, const byte* u8_In);
+
     static void aes_enc_dec(unsigned char state[16], unsigned char key[16], unsigned char dir);
     static unsigned char galois_mul2(unsigned char value);
+
+    uint32_t mu32_EncKey[44]; // round keys of the cipher
+    uint32_t mu32_DecKey[44]; // round keys of the equivalent inverse cipher (FIPS-197 chapter 5.3.5)
 };
 
 #endif // TI_OPT_AES_H_
\ No newline at end of file
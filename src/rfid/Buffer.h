@@ -18,7 +18,7 @@
 
 // These macros create a new buffer on the stack avoiding the use of the 'new' operator.
 // ATTENTION: 
-// These macros will not work if you define the TxBuffer/RxBuffer as member of a class (see mi_CmacBuffer). 
+// These macros will not work if you define the TxBuffer/RxBuffer as member of a class. 
 // They compile only inside the code of a function.
 //
 // TX_BUFFER(i_SessKey, 16)  
@@ -28,6 +28,9 @@
 //
 // The byte buffer is created outside the class to avoid the need of a template class which would have several disadvantages.
 // The operator "##" tells the preprocessor to concatenate two strings.
+//
+// The buffers are views: the constructors do not clear the memory. Only the bytes that have been appended (TxBuffer) 
+// or received (RxBuffer) are valid. TxBuffer::SetCount() fills the bytes it adds with zeroes (padding before encryption).
 #define TX_BUFFER(buffer_name, size) \
     byte buffer_name##_Buffer[size]; \
     TxBuffer buffer_name(buffer_name##_Buffer, size);
@@ -46,7 +49,6 @@ public:
         mu8_Buf   = u8_Buffer;
         ms32_Size = s32_Size;
         ms32_Pos  = 0;        
-        memset(mu8_Buf, 0, s32_Size); 
     }
 
     // This allows to shrink the available maximum buffer size, but it does not allow to make the buffer larger.
@@ -153,7 +155,6 @@ public:
         mu8_Buf   = u8_Buffer;
         ms32_Size = s32_Size;
         ms32_Pos  = 0;        
-        memset(mu8_Buf, 0, s32_Size); 
     }
 
     // Resets the byte counter
@@ -179,13 +180,17 @@ public:
         return ms32_Pos;
     }
 
-    // ATTENTION: Use this only after encrypting the buffer.
+    // ATTENTION: Use this only after encrypting the buffer or to pad it with zeroes.
     bool SetCount(int s32_Count)
     {
+        int s32_OldPos = ms32_Pos;
         ms32_Pos = 0;
         if (!CheckPos(s32_Count))
             return false;
       
+        if (s32_Count > s32_OldPos)
+            memset(mu8_Buf + s32_OldPos, 0, s32_Count - s32_OldPos);
+
         ms32_Pos = s32_Count;
         return true;
     }   
@@ -11,6 +11,8 @@
  *   DES_set_key     - Create DES key schedule
  *   DES_ecb_encrypt - Basic DES encryption routine
  *   encrypt1    - core subroutine. Called by all routines
+ *   encrypt2    - core subroutine without the initial and final permutation
+ *   encrypt3    - Triple DES with a single initial and final permutation
  *
  * Copyright:
  *   This file includes and is based off of DES cryptographic software written 
@@ -578,6 +580,81 @@ void DES::encrypt1(DES_LONG *data,DES_key_schedule *ks, int enc)
   l=r=t=u=0;
 }
 
+/*
+ * encrypt2
+ * Description: The same as encrypt1 but without IP and FP.
+ *              In Triple DES the FP of one pass and the IP of the next cancel
+ *              each other out, so encrypt3 and decrypt3 do them only once.
+ */
+void DES::encrypt2(DES_LONG *data,DES_key_schedule *ks, int enc)
+{
+  register DES_LONG l,r,t,u;
+  register int i;
+  register DES_LONG *s;
+  
+  r=ROTATE(data[0],29)&0xffffffffL;
+  l=ROTATE(data[1],29)&0xffffffffL;
+  
+  s=ks->ks->deslong;
+  if (enc) {
+    for (i=0; i<32; i+=4) {
+      D_ENCRYPT(l,r,i+0); /*  1 */
+      D_ENCRYPT(r,l,i+2); /*  2 */
+    }
+  } else {
+    for (i=30; i>0; i-=4) {
+      D_ENCRYPT(l,r,i-0); /* 16 */
+      D_ENCRYPT(r,l,i-2); /* 15 */
+    }
+  }
+  
+  data[0]=ROTATE(l,3)&0xffffffffL;
+  data[1]=ROTATE(r,3)&0xffffffffL;
+  l=r=t=u=0;
+}
+
+/*
+ * encrypt3 / decrypt3
+ * Description: Triple DES (EDE) of one block. ks3 = ks1 for 2K3DES.
+ */
+void DES::encrypt3(DES_LONG *data, DES_key_schedule *ks1, DES_key_schedule *ks2, DES_key_schedule *ks3)
+{
+  register DES_LONG l,r;
+  
+  l=data[0];
+  r=data[1];
+  IP(l,r);
+  data[0]=l;
+  data[1]=r;
+  encrypt2(data,ks1,DES_ENCRYPT);
+  encrypt2(data,ks2,DES_DECRYPT);
+  encrypt2(data,ks3,DES_ENCRYPT);
+  l=data[0];
+  r=data[1];
+  FP(r,l);
+  data[0]=l;
+  data[1]=r;
+}
+
+void DES::decrypt3(DES_LONG *data, DES_key_schedule *ks1, DES_key_schedule *ks2, DES_key_schedule *ks3)
+{
+  register DES_LONG l,r;
+  
+  l=data[0];
+  r=data[1];
+  IP(l,r);
+  data[0]=l;
+  data[1]=r;
+  encrypt2(data,ks3,DES_DECRYPT);
+  encrypt2(data,ks2,DES_ENCRYPT);
+  encrypt2(data,ks1,DES_DECRYPT);
+  l=data[0];
+  r=data[1];
+  FP(r,l);
+  data[0]=l;
+  data[1]=r;
+}
+
 
 // ----------------------------------------------------------------------------------------------
 // C++ code added by Elmü
@@ -645,8 +722,88 @@ bool DES::SetKeyData(const byte* u8_Key, int s32_KeySize, byte u8_Version)
     return true;
 }
 
+// One block as two words (see c2l)
+void DES::CryptWords(DES_LONG* data, DESFireCipher e_Cipher)
+{
+    if (ms32_KeySize == 8) // simple DES
+    {
+        encrypt1(data, &mk_ks1, (e_Cipher == KEY_ENCIPHER) ? DES_ENCRYPT : DES_DECRYPT);
+        return;
+    }
+
+    // 2K3DES uses K1 as third key
+    DES_key_schedule* pk_ks3 = (ms32_KeySize == 24) ? &mk_ks3 : &mk_ks1;
+    if (e_Cipher == KEY_ENCIPHER) encrypt3(data, &mk_ks1, &mk_ks2, pk_ks3);
+    else                          decrypt3(data, &mk_ks1, &mk_ks2, pk_ks3);
+}
+
 // 1 block = 8 bytes
 bool DES::CryptDataBlock(byte u8_Out[8], const byte u8_In[8], DESFireCipher e_Cipher)
+{
+    if (ms32_KeySize == 0)
+        return false; // key not set
+
+    DES_LONG l, data[2];
+    c2l(u8_In, l); data[0]=l;
+    c2l(u8_In, l); data[1]=l;
+    CryptWords(data, e_Cipher);
+    l=data[0]; l2c(l, u8_Out);
+    l=data[1]; l2c(l, u8_Out);
+    return true;
+}
+
+// Fused CBC: the IV stays in registers and there are no intermediate buffers.
+// In-place operation (u8_Out == u8_In) is allowed because each block is read before it is written.
+bool DES::CryptDataCBC(DESFireCBC e_CBC, DESFireCipher e_Cipher, byte* u8_Out, const byte* u8_In, int s32_ByteCount)
+{
+    assertDo(s32_ByteCount < 8 || s32_ByteCount % 8, LL_ERROR, LM_DESKEY, "Invalid CBC block size", return false;);
+    assertDo(u8_Out == NULL && e_CBC != CBC_SEND, LL_ERROR, LM_DESKEY, "CBC output missing", return false;);
+    if (ms32_KeySize == 0)
+        return false; // key not set
+
+    DES_LONG iv0, iv1, in0, in1, l, data[2];
+    const byte* u8_IV = mu8_IV;
+    c2l(u8_IV, iv0);
+    c2l(u8_IV, iv1);
+
+    for (int B=0; B<s32_ByteCount; B+=8)
+    {
+        c2l(u8_In, in0);
+        c2l(u8_In, in1);
+        if (e_CBC == CBC_SEND) // XOR before the cipher, the result is the next IV
+        {
+            data[0] = in0 ^ iv0;
+            data[1] = in1 ^ iv1;
+            CryptWords(data, e_Cipher);
+            iv0 = data[0];
+            iv1 = data[1];
+        }
+        else // CBC_RECEIVE: XOR after the cipher, the input is the next IV
+        {
+            data[0] = in0;
+            data[1] = in1;
+            CryptWords(data, e_Cipher);
+            data[0] ^= iv0;
+            data[1] ^= iv1;
+            iv0 = in0;
+            iv1 = in1;
+        }
+
+        if (u8_Out)
+        {
+            l=data[0]; l2c(l, u8_Out);
+            l=data[1]; l2c(l, u8_Out);
+        }
+    }
+
+    byte* u8_NewIV = mu8_IV;
+    l2c(iv0, u8_NewIV);
+    l2c(iv1, u8_NewIV);
+    return true;
+}
+
+// The former implementation: one complete DES pass per key. Reference for Selftest().
+bool DES::CryptDataBlockEcb(byte u8_Out[8], const byte u8_In[8], DESFireCipher e_Cipher)
 {
     switch (ms32_KeySize)
     {
@@ -712,4 +869,102 @@ void DES::StoreKeyVersion(byte* u8_KeyOut, const byte* u8_KeyIn, int s32_KeySize
         // Set Parity bit = 0
         u8_KeyOut[i] = u8_KeyIn[i] & 0xFE;
     }
-}
\ No newline at end of file
+}
+// Known answers (single DES: FIPS 81, 2K3DES CBC and 3K3DES CMAC: reference values from OpenSSL),
+// the fused block against the former one with random keys and data, then cycles per byte of both CBC paths.
+bool DES::Selftest()
+{
+    const byte u8_Key1[8]   = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF };
+    const byte u8_Plain1[8] = { 0x4E, 0x6F, 0x77, 0x20, 0x69, 0x73, 0x20, 0x74 }; // "Now is t"
+    const byte u8_Ciph1[8]  = { 0x3F, 0xA4, 0x0E, 0x8A, 0x98, 0x4D, 0x48, 0x15 };
+
+    const byte u8_Key2[16]   = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF, 0xFE, 0xDC, 0xBA, 0x98, 0x76, 0x54, 0x32, 0x10 };
+    const byte u8_Plain2[32] = { 0x6B, 0xC1, 0xBE, 0xE2, 0x2E, 0x40, 0x9F, 0x96, 0xE9, 0x3D, 0x7E, 0x11, 0x73, 0x93, 0x17, 0x2A, 
+                                 0xAE, 0x2D, 0x8A, 0x57, 0x1E, 0x03, 0xAC, 0x9C, 0x9E, 0xB7, 0x6F, 0xAC, 0x45, 0xAF, 0x8E, 0x51 };
+    const byte u8_Ciph2[32]  = { 0xEA, 0x43, 0xF9, 0xAA, 0x27, 0xF8, 0x2F, 0x59, 0x97, 0x35, 0xD9, 0x3D, 0x56, 0xB5, 0x44, 0x9E, 
+                                 0xC2, 0xE7, 0x51, 0xF5, 0x23, 0x63, 0xE6, 0xFB, 0x86, 0x31, 0x77, 0x5C, 0x11, 0x10, 0x42, 0x9F };
+
+    const byte u8_Key3[24]  = { 0x8A, 0xA8, 0x3B, 0xF8, 0xCB, 0xDA, 0x10, 0x62, 0x0B, 0xC1, 0xBF, 0x19, 0xFB, 0xB6, 0xCD, 0x58, 
+                                0xBC, 0x31, 0x3D, 0x4A, 0x37, 0x1C, 0xA8, 0xB5 };
+    const byte u8_Mac16[8]  = { 0x28, 0x6D, 0x39, 0x46, 0x73, 0x44, 0x81, 0x97 }; // CMAC over the first 16 byte of u8_Plain2
+    const byte u8_Mac20[8]  = { 0x74, 0x3D, 0xDB, 0xE0, 0xCE, 0x2D, 0xC2, 0xED }; // CMAC over the first 20 byte of u8_Plain2
+
+    DES  i_Des;
+    byte u8_Data[64];
+    byte u8_Ref [64];
+
+    i_Des.SetKeyData(u8_Key1, sizeof(u8_Key1), 0);
+    i_Des.CryptDataBlock(u8_Data, u8_Plain1, KEY_ENCIPHER);
+    assertDo (memcmp(u8_Data, u8_Ciph1, 8) != 0, LL_ERROR, LM_DESKEY, "DES selftest: DES failed", return false;);
+
+    i_Des.SetKeyData(u8_Key2, sizeof(u8_Key2), 0);
+    i_Des.CryptDataCBC(CBC_SEND, KEY_ENCIPHER, u8_Data, u8_Plain2, 32);
+    assertDo (memcmp(u8_Data, u8_Ciph2, 32) != 0, LL_ERROR, LM_DESKEY, "DES selftest: 2K3DES CBC encryption failed", return false;);
+    i_Des.ClearIV();
+    i_Des.CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_Data, u8_Data, 32);
+    assertDo (memcmp(u8_Data, u8_Plain2, 32) != 0, LL_ERROR, LM_DESKEY, "DES selftest: 2K3DES CBC decryption failed", return false;);
+
+    i_Des.SetKeyData(u8_Key3, sizeof(u8_Key3), 0);
+    i_Des.GenerateCmacSubkeys();
+    for (int s32_Len=16; s32_Len<=20; s32_Len+=4)
+    {
+        TX_BUFFER(i_Buffer, 24);
+        i_Buffer.AppendBuf(u8_Plain2, s32_Len);
+        byte u8_Mac[16];
+        i_Des.ClearIV();
+        i_Des.CalculateCmac(i_Buffer, u8_Mac);
+        assertDo (memcmp(u8_Mac, (s32_Len == 16) ? u8_Mac16 : u8_Mac20, 8) != 0, LL_ERROR, LM_DESKEY, "DES selftest: 3K3DES CMAC failed", return false;);
+    }
+
+    // The fused block must give the same result as three complete DES passes
+    for (int r=0; r<100; r++)
+    {
+        byte u8_Key[24];
+        for (int i=0; i<24; i++) u8_Key[i] = random(256);
+        for (int i=0; i<8;  i++) u8_Data[i] = random(256);
+
+        int s32_KeySize = 8 * (1 + r % 3);
+        i_Des.SetKeyData(u8_Key, s32_KeySize, 0);
+        for (int c=KEY_ENCIPHER; c<=KEY_DECIPHER; c++)
+        {
+            i_Des.CryptDataBlock   (u8_Data + 8,  u8_Data, (DESFireCipher)c);
+            i_Des.CryptDataBlockEcb(u8_Ref  + 8,  u8_Data, (DESFireCipher)c);
+            assertDo (memcmp(u8_Data + 8, u8_Ref + 8, 8) != 0, LL_ERROR, LM_DESKEY, "DES selftest: fused block differs", return false;);
+        }
+    }
+
+    // Cycles per byte of a 64 byte CBC encryption: the former path (XOR, 3 complete DES passes and a copy per block) and the fused path
+    ARM_DEMCR |= ARM_DEMCR_TRCENA;
+    ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+
+    const int ROUNDS = 100;
+    char s8_Buf[80];
+    for (int s32_KeySize=16; s32_KeySize<=24; s32_KeySize+=8)
+    {
+        i_Des.SetKeyData(u8_Key3, s32_KeySize, 0);
+
+        uint32_t u32_Start = ARM_DWT_CYCCNT;
+        for (int r=0; r<ROUNDS; r++)
+        {
+            for (int B=0; B<64; B+=8)
+            {
+                Utils::XorDataBlock(u8_Ref, u8_Data + B, i_Des.mu8_IV, 8);
+                i_Des.CryptDataBlockEcb(u8_Data + B, u8_Ref, KEY_ENCIPHER);
+                memcpy(i_Des.mu8_IV, u8_Data + B, 8);
+            }
+        }
+        uint32_t u32_Former = ARM_DWT_CYCCNT - u32_Start;
+
+        u32_Start = ARM_DWT_CYCCNT;
+        for (int r=0; r<ROUNDS; r++)
+        {
+            i_Des.CryptDataCBC(CBC_SEND, KEY_ENCIPHER, u8_Data, u8_Data, 64);
+        }
+        uint32_t u32_Fused = ARM_DWT_CYCCNT - u32_Start;
+
+        sprintf(s8_Buf, "%s CBC [cycles/byte]: former %lu, fused %lu", (s32_KeySize == 16) ? "2K3DES" : "3K3DES",
+                (unsigned long)(u32_Former / (ROUNDS * 64)), (unsigned long)(u32_Fused / (ROUNDS * 64)));
+        log(LL_INFO, LM_DESKEY, s8_Buf);
+    }
+    return true;
+}
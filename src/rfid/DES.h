@@ -3,13 +3,17 @@
 
 #include "DesFireKey.h"
 
-class DES : public DESFireKey
+class DES final : public DESFireKeyPolicy<DES>
 {
 public:
     DES();
     ~DES();
     bool SetKeyData(const byte* u8_Key, int s32_KeySize, byte u8_Version);
     bool CryptDataBlock(byte u8_Out[8], const byte u8_In[8], DESFireCipher e_Cipher);
+    bool CryptDataCBC(DESFireCBC e_CBC, DESFireCipher e_Cipher, byte* u8_Out, const byte* u8_In, int s32_ByteCount);
+
+    // Test vectors for the fused path against the former block by block path and the cycles per byte
+    static bool Selftest();
         
 private:
     enum DES_MODE
@@ -34,6 +38,12 @@ private:
     static void set_key(const DES_cblock* key, DES_key_schedule* schedule);
     static void ecb_encrypt(const DES_cblock* in, DES_cblock* out, DES_key_schedule* ks, int enc);
     static void encrypt1(DES_LONG* data, DES_key_schedule* ks, int enc);
+    static void encrypt2(DES_LONG* data, DES_key_schedule* ks, int enc);
+    static void encrypt3(DES_LONG* data, DES_key_schedule* ks1, DES_key_schedule* ks2, DES_key_schedule* ks3);
+    static void decrypt3(DES_LONG* data, DES_key_schedule* ks1, DES_key_schedule* ks2, DES_key_schedule* ks3);
+
+    void CryptWords(DES_LONG* data, DESFireCipher e_Cipher);
+    bool CryptDataBlockEcb(byte u8_Out[8], const byte u8_In[8], DESFireCipher e_Cipher);
 
     DES_key_schedule mk_ks1; // first  component of a TDEA key
     DES_key_schedule mk_ks2; // second component of a TDEA key
@@ -56,90 +56,10 @@ public:
     virtual bool SetKeyData(const byte* u8_Key, int s32_KeySize, byte u8_Version) = 0;
     virtual bool CryptDataBlock(byte* u8_Out, const byte* u8_In, DESFireCipher e_Cipher) = 0;
     
-    // The CBC alorithm XOR's the data with the previous result (Cipher Block Chaining)
-    // https://en.wikipedia.org/wiki/Block_cipher_mode_of_operation
-    // However NXP (Philips) uses a modified scheme.
-    // If XOR is executed before or after encryption depends on the data being sent or received.
-    // s32_ByteCount = Count of bytes to crypt (must always be a multiple of 8 (DES) or 16 (AES))
-    bool CryptDataCBC(DESFireCBC e_CBC, DESFireCipher e_Cipher, byte* u8_Out, const byte* u8_In, int s32_ByteCount)
-    {
-        assertDo(s32_ByteCount < ms32_BlockSize || s32_ByteCount % ms32_BlockSize, LL_ERROR, LM_DESKEY, "Invalid CBC block size", return false;);
-      
-        byte u8_Temp[16];
-        for (int B=0; B<s32_ByteCount/ms32_BlockSize; B++)
-        {
-            if (e_CBC == CBC_SEND)
-            {
-                Utils::XorDataBlock(u8_Temp, u8_In, mu8_IV, ms32_BlockSize);
-                if (!CryptDataBlock(u8_Out, u8_Temp, e_Cipher)) return false;
-                memcpy(mu8_IV, u8_Out, ms32_BlockSize);
-            }
-            else // CBC_RECEIVE
-            {
-                if (!CryptDataBlock(u8_Temp, u8_In, e_Cipher)) return false;
-                Utils::XorDataBlock(u8_Temp, u8_Temp, mu8_IV, ms32_BlockSize); // Step 1 (mu8_IV is used here)
-                memcpy(mu8_IV, u8_In,   ms32_BlockSize);                       // Step 2 (mu8_IV can be changed now, u8_In has not yet been modified)
-                memcpy(u8_Out, u8_Temp, ms32_BlockSize);                       // Step 3 (here also u8_In is modified if u8_Out and u8_In are the same buffer)
-            }
-            u8_In  += ms32_BlockSize;
-            u8_Out += ms32_BlockSize;
-        }
-        return true;
-    }
-
-    // Generates the two subkeys mu8_Cmac1 and mu8_Cmac2 that are used for CMAC calulation with the session key
-    bool GenerateCmacSubkeys()
-    {
-        uint8_t u8_R = (ms32_BlockSize == 8) ? 0x1B : 0x87;
-        uint8_t u8_Data[16] = {0};     
-        
-        ClearIV();
-        if (!CryptDataCBC(CBC_RECEIVE, KEY_ENCIPHER, u8_Data, u8_Data, ms32_BlockSize))
-            return false;
-
-        memcpy (mu8_Cmac1, u8_Data, ms32_BlockSize);
-        Utils::BitShiftLeft(mu8_Cmac1, ms32_BlockSize);
-        if (u8_Data[0] & 0x80)
-            mu8_Cmac1[ms32_BlockSize-1] ^= u8_R;
-        
-        memcpy (mu8_Cmac2, mu8_Cmac1, ms32_BlockSize);
-        Utils::BitShiftLeft(mu8_Cmac2, ms32_BlockSize);
-        if (mu8_Cmac1[0] & 0x80)
-            mu8_Cmac2[ms32_BlockSize-1] ^= u8_R;
-
-        return true;
-    }
-
-    // Calculate the CMAC (Cipher-based Message Authentication Code) from the given data.
-    // The CMAC is the initialization vector (IV) after a CBC encryption of the given data.
-    // ATTENTION: The content of i_Buffer will be modified!!
-    bool CalculateCmac(TxBuffer& i_Buffer, byte u8_Cmac[16])
-    {
-        // If the data length is not a multiple of the block size -> pad the buffer with 80,00,00,00,....
-        if ((i_Buffer.GetCount() == 0) || (i_Buffer.GetCount() % ms32_BlockSize))
-        {
-            if (!i_Buffer.AppendUint8(0x80))
-                return false; // Buffer is full
-                
-            while (i_Buffer.GetCount() % ms32_BlockSize)
-            {
-                if (!i_Buffer.AppendUint8(0x00))
-                    return false; // Buffer is full
-            }
-            Utils::XorDataBlock(i_Buffer + i_Buffer.GetCount() - ms32_BlockSize, mu8_Cmac2, ms32_BlockSize);
-        } 
-        else // no padding required
-        {
-            Utils::XorDataBlock(i_Buffer + i_Buffer.GetCount() - ms32_BlockSize, mu8_Cmac1, ms32_BlockSize);
-        }
+    // Any key type: used where the type is only known at runtime (Authenticate, ChangeKey from DES to AES).
+    // DESFireKeyPolicy implements it for each cipher.
+    virtual bool CryptDataCBC(DESFireCBC e_CBC, DESFireCipher e_Cipher, byte* u8_Out, const byte* u8_In, int s32_ByteCount) = 0;
 
-        if (!CryptDataCBC(CBC_SEND, KEY_ENCIPHER, i_Buffer, i_Buffer, i_Buffer.GetCount()))
-            return false;
-            
-        memcpy(u8_Cmac, mu8_IV, ms32_BlockSize);
-        return true;
-    }
-    
     inline byte* Data()
     {
         return mu8_Key;
@@ -238,4 +158,153 @@ protected:
     byte mu8_Cmac2[16]; // CMAC subkey 2
 };
 
+// The key policy: CBC and CMAC compiled for one cipher (KEY = the final class AES or DES).
+// The block cipher is called directly and can be inlined. The session key of Desfire always uses this type,
+// the virtual functions of DESFireKey are only used where the key type is known at runtime.
+template <class KEY>
+class DESFireKeyPolicy : public DESFireKey
+{
+public:
+    DESFireKeyPolicy()
+    {
+        ms32_CmacRest = 0;
+    }
+
+    // The CBC alorithm XOR's the data with the previous result (Cipher Block Chaining)
+    // https://en.wikipedia.org/wiki/Block_cipher_mode_of_operation
+    // However NXP (Philips) uses a modified scheme.
+    // If XOR is executed before or after encryption depends on the data being sent or received.
+    // s32_ByteCount = Count of bytes to crypt (must always be a multiple of 8 (DES) or 16 (AES))
+    // u8_Out = NULL (only CBC_SEND): just the IV is updated, as needed for the CMAC.
+    // DES hides this with a version that chains the blocks in registers.
+    bool CryptDataCBC(DESFireCBC e_CBC, DESFireCipher e_Cipher, byte* u8_Out, const byte* u8_In, int s32_ByteCount)
+    {
+        assertDo(s32_ByteCount < ms32_BlockSize || s32_ByteCount % ms32_BlockSize, LL_ERROR, LM_DESKEY, "Invalid CBC block size", return false;);
+        assertDo(u8_Out == NULL && e_CBC != CBC_SEND, LL_ERROR, LM_DESKEY, "CBC output missing", return false;);
+      
+        byte u8_Temp[16];
+        for (int B=0; B<s32_ByteCount/ms32_BlockSize; B++)
+        {
+            if (e_CBC == CBC_SEND)
+            {
+                Utils::XorDataBlock(u8_Temp, u8_In, mu8_IV, ms32_BlockSize);
+                if (!Key()->KEY::CryptDataBlock(mu8_IV, u8_Temp, e_Cipher)) return false; // the result is the next IV
+                if (u8_Out) memcpy(u8_Out, mu8_IV, ms32_BlockSize);
+            }
+            else // CBC_RECEIVE
+            {
+                if (!Key()->KEY::CryptDataBlock(u8_Temp, u8_In, e_Cipher)) return false;
+                Utils::XorDataBlock(u8_Temp, u8_Temp, mu8_IV, ms32_BlockSize); // Step 1 (mu8_IV is used here)
+                memcpy(mu8_IV, u8_In,   ms32_BlockSize);                       // Step 2 (mu8_IV can be changed now, u8_In has not yet been modified)
+                memcpy(u8_Out, u8_Temp, ms32_BlockSize);                       // Step 3 (here also u8_In is modified if u8_Out and u8_In are the same buffer)
+            }
+            u8_In  += ms32_BlockSize;
+            if (u8_Out) u8_Out += ms32_BlockSize;
+        }
+        return true;
+    }
+
+    // Generates the two subkeys mu8_Cmac1 and mu8_Cmac2 that are used for CMAC calulation with the session key
+    bool GenerateCmacSubkeys()
+    {
+        uint8_t u8_R = (ms32_BlockSize == 8) ? 0x1B : 0x87;
+        uint8_t u8_Data[16] = {0};     
+        
+        ClearIV();
+        if (!Key()->KEY::CryptDataCBC(CBC_RECEIVE, KEY_ENCIPHER, u8_Data, u8_Data, ms32_BlockSize))
+            return false;
+
+        memcpy (mu8_Cmac1, u8_Data, ms32_BlockSize);
+        Utils::BitShiftLeft(mu8_Cmac1, ms32_BlockSize);
+        if (u8_Data[0] & 0x80)
+            mu8_Cmac1[ms32_BlockSize-1] ^= u8_R;
+        
+        memcpy (mu8_Cmac2, mu8_Cmac1, ms32_BlockSize);
+        Utils::BitShiftLeft(mu8_Cmac2, ms32_BlockSize);
+        if (mu8_Cmac1[0] & 0x80)
+            mu8_Cmac2[ms32_BlockSize-1] ^= u8_R;
+
+        return true;
+    }
+
+    // Calculate the CMAC (Cipher-based Message Authentication Code) from the given data.
+    // The CMAC is the initialization vector (IV) after a CBC encryption of the given data.
+    // The content of i_Buffer is not modified.
+    bool CalculateCmac(TxBuffer& i_Buffer, byte u8_Cmac[16])
+    {
+        CmacStart();
+        return CmacUpdate(i_Buffer, i_Buffer.GetCount()) && CmacFinish(u8_Cmac);
+    }
+
+    // The same CMAC calculated over data that arrives in several pieces (e.g. RX data + status byte, several frames).
+    // The data is encrypted where it is, only the last incomplete block is kept in mu8_CmacRest.
+    inline void CmacStart()
+    {
+        ms32_CmacRest = 0;
+    }
+
+    bool CmacUpdate(const byte* u8_Data, int s32_Count)
+    {
+        while (s32_Count > 0)
+        {
+            // The last block must stay here, it is XORed with a subkey in CmacFinish()
+            if (ms32_CmacRest == ms32_BlockSize)
+            {
+                if (!Key()->KEY::CryptDataCBC(CBC_SEND, KEY_ENCIPHER, NULL, mu8_CmacRest, ms32_BlockSize))
+                    return false;
+                ms32_CmacRest = 0;
+            }
+
+            // Complete blocks that are not the last one are encrypted directly from u8_Data
+            if (ms32_CmacRest == 0 && s32_Count > ms32_BlockSize)
+            {
+                int s32_Direct = ((s32_Count - 1) / ms32_BlockSize) * ms32_BlockSize;
+                if (!Key()->KEY::CryptDataCBC(CBC_SEND, KEY_ENCIPHER, NULL, u8_Data, s32_Direct))
+                    return false;
+                u8_Data   += s32_Direct;
+                s32_Count -= s32_Direct;
+            }
+
+            int s32_Copy = min(s32_Count, ms32_BlockSize - ms32_CmacRest);
+            memcpy(mu8_CmacRest + ms32_CmacRest, u8_Data, s32_Copy);
+            ms32_CmacRest += s32_Copy;
+            u8_Data       += s32_Copy;
+            s32_Count     -= s32_Copy;
+        }
+        return true;
+    }
+
+    bool CmacFinish(byte u8_Cmac[16])
+    {
+        // If the data length is not a multiple of the block size -> pad the last block with 80,00,00,00,....
+        if (ms32_CmacRest < ms32_BlockSize)
+        {
+            mu8_CmacRest[ms32_CmacRest] = 0x80;
+            memset(mu8_CmacRest + ms32_CmacRest + 1, 0, ms32_BlockSize - ms32_CmacRest - 1);
+            Utils::XorDataBlock(mu8_CmacRest, mu8_Cmac2, ms32_BlockSize);
+        } 
+        else // no padding required
+        {
+            Utils::XorDataBlock(mu8_CmacRest, mu8_Cmac1, ms32_BlockSize);
+        }
+        ms32_CmacRest = 0;
+
+        // Only the IV is needed, the encrypted data is not written back
+        if (!Key()->KEY::CryptDataCBC(CBC_SEND, KEY_ENCIPHER, NULL, mu8_CmacRest, ms32_BlockSize))
+            return false;
+            
+        memcpy(u8_Cmac, mu8_IV, ms32_BlockSize);
+        return true;
+    }
+    
+private:
+    inline KEY* Key()
+    {
+        return static_cast<KEY*>(this);
+    }
+
+    byte mu8_CmacRest[16]; // the last block of the CMAC data that has not yet been encrypted
+    int  ms32_CmacRest;
+};
+
 #endif // DESFIRE_KEY_H
\ No newline at end of file
@@ -34,13 +34,20 @@
 #include "Desfire.h"
 #include "Secrets.h"
 
+#if DESFIRE_COUNT_COPIES
+    #define COUNT_COPIES(count)  mu32_CopiedBytes += (count)
+#else
+    #define COUNT_COPIES(count)
+#endif
+
 Desfire::Desfire() 
-    : mi_CmacBuffer(mu8_CmacBuffer_Data, sizeof(mu8_CmacBuffer_Data))
 {
     mpi_SessionKey       = NULL;
     mu8_LastAuthKeyNo    = NOT_AUTHENTICATED;
     mu8_LastPN532Error   = 0;    
     mu32_LastApplication = 0x000000; // No application selected
+    mb_AppMayBeMissing   = false;
+    mu32_CopiedBytes     = 0;
 
     // The PICC master key on an empty card is a simple DES key filled with 8 zeros
     const byte ZERO_KEY[24] = {0};
@@ -89,7 +96,11 @@ bool Desfire::Authenticate(byte u8_KeyNo, DESFireKey* pi_Key)
             return false;
     }
 
-    TX_BUFFER(i_Params, 1);
+    #if DESFIRE_COUNT_COPIES
+        mu32_CopiedBytes = 0;
+    #endif
+
+    TxBuffer i_Params = PacketParams();
     i_Params.AppendUint8(u8_KeyNo);
 
     // Request a random of 16 byte, but depending of the key the PICC may also return an 8 byte random
@@ -115,7 +126,7 @@ bool Desfire::Authenticate(byte u8_KeyNo, DESFireKey* pi_Key)
     i_RndAB.AppendBuf(u8_RndA,     s32_RandomSize);
     i_RndAB.AppendBuf(u8_RndB_rot, s32_RandomSize);
 
-    TX_BUFFER(i_RndAB_enc, 32); // encrypted (randomA + rotated randomB)
+    TxBuffer i_RndAB_enc = PacketParams(); // encrypted (randomA + rotated randomB)
     i_RndAB_enc.SetCount(2*s32_RandomSize);
     if (!pi_Key->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, i_RndAB_enc, i_RndAB, 2*s32_RandomSize))
         return false;
@@ -183,11 +194,18 @@ bool Desfire::Authenticate(byte u8_KeyNo, DESFireKey* pi_Key)
         }
     }
        
-    if (pi_Key->GetKeyType() == DF_KEY_AES) mpi_SessionKey = &mi_AesSessionKey;
-    else                                    mpi_SessionKey = &mi_DesSessionKey;
-    
-    if (!mpi_SessionKey->SetKeyData(i_SessKey, i_SessKey.GetCount(), 0) ||
-        !mpi_SessionKey->GenerateCmacSubkeys())
+    bool b_SessionKey;
+    if (pi_Key->GetKeyType() == DF_KEY_AES) 
+    {
+        mpi_SessionKey = &mi_AesSessionKey;
+        b_SessionKey   = mi_AesSessionKey.SetKeyData(i_SessKey, i_SessKey.GetCount(), 0) && mi_AesSessionKey.GenerateCmacSubkeys();
+    }
+    else
+    {
+        mpi_SessionKey = &mi_DesSessionKey;
+        b_SessionKey   = mi_DesSessionKey.SetKeyData(i_SessKey, i_SessKey.GetCount(), 0) && mi_DesSessionKey.GenerateCmacSubkeys();
+    }
+    if (!b_SessionKey)
         return false;
 
     
@@ -197,6 +215,10 @@ bool Desfire::Authenticate(byte u8_KeyNo, DESFireKey* pi_Key)
         mpi_SessionKey->PrintKey(LF);
     }
 
+    #if DESFIRE_COUNT_COPIES
+        log(LL_INFO, LM_DESFIRE, "Authenticate() bytes copied:", mu32_CopiedBytes);
+    #endif
+
     mu8_LastAuthKeyNo = u8_KeyNo;   
     return true;
 }
@@ -287,9 +309,10 @@ bool Desfire::ChangeKey(byte u8_KeyNo, DESFireKey* pi_NewKey, DESFireKey* pi_Cur
 
     // For a blocksize of 16 byte (AES) the data length 24 is not valid -> increase to 32
     s32_CryptoLen = mpi_SessionKey->CalcPaddedBlockSize(s32_CryptoLen);
+    i_Cryptogram.SetCount(s32_CryptoLen); // pad with zeroes
 
     byte u8_Cryptogram_enc[40] = {0}; // encrypted cryptogram
-    if (!mpi_SessionKey->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, u8_Cryptogram_enc, i_Cryptogram, s32_CryptoLen))
+    if (!SessionCryptCBC(CBC_SEND, KEY_ENCIPHER, u8_Cryptogram_enc, i_Cryptogram, s32_CryptoLen))
         return false;
 
     log_hexdump(LL_DEBUG, LM_DESFIRE, "Cryptogram:", s32_CryptoLen, i_Cryptogram);
@@ -661,6 +684,37 @@ bool Desfire::SelectApplication(uint32_t u32_AppID)
     return true;
 }
 
+/**************************************************************************
+    Selects an application that may not exist on the card.
+    This costs one exchange instead of two for GetApplicationIDs() + SelectApplication().
+    returns false only on errors.
+    If the application does not exist *pb_Found is false and the previous selection stays.
+**************************************************************************/
+bool Desfire::TrySelectApplication(uint32_t u32_AppID, bool* pb_Found)
+{
+    if (checkLogLevel(LM_DESFIRE, LL_DEBUG))
+    {
+        char s8_Buf[80];
+        sprintf(s8_Buf, "TrySelectApplication(0x%06X)", (unsigned int)u32_AppID);
+        log(LL_DEBUG, LM_DESFIRE, s8_Buf);
+    }
+
+    TX_BUFFER(i_Params, 3);
+    i_Params.AppendUint24(u32_AppID);
+
+    DESFireStatus e_Status;
+    mb_AppMayBeMissing = true;
+    *pb_Found = (0 == DataExchange(DF_INS_SELECT_APPLICATION, &i_Params, NULL, 0, &e_Status, MAC_None));
+    mb_AppMayBeMissing = false;
+
+    if (!*pb_Found)
+        return (e_Status == ST_AppNotFound);
+
+    mu8_LastAuthKeyNo    = NOT_AUTHENTICATED; // set to invalid value (the selected app requires authentication)
+    mu32_LastApplication = u32_AppID;
+    return true;
+}
+
 /**************************************************************************
     returns all File ID's for the selected application. 
     Desfire EV1: maximum = 32 files per application.
@@ -823,13 +877,17 @@ bool Desfire::ReadFileData(byte u8_FileID, int s32_Offset, int s32_Length, byte*
         log(LL_DEBUG, LM_DESFIRE, s8_Buf);
     }
 
-    // With intention this command does not use DF_INS_ADDITIONAL_FRAME because the CMAC must be calculated over all frames received.
-    // When reading a lot of data this could lead to a buffer overflow in mi_CmacBuffer.
+    #if DESFIRE_COUNT_COPIES
+        mu32_CopiedBytes = 0;
+    #endif
+
+    // With intention this command does not use DF_INS_ADDITIONAL_FRAME. 
+    // The frames are limited to 48 byte, so that also the 8 byte CMAC fit into the PN532 packet buffer.
     while (s32_Length > 0)
     {
         int s32_Count = min(s32_Length, 48); // the maximum that can be transferred in one frame (must be a multiple of 16 if encryption is used)
 
-        TX_BUFFER(i_Params, 7);
+        TxBuffer i_Params = PacketParams();
         i_Params.AppendUint8 (u8_FileID);
         i_Params.AppendUint24(s32_Offset); // only the low 3 bytes are used
         i_Params.AppendUint24(s32_Count);  // only the low 3 bytes are used
@@ -843,6 +901,10 @@ bool Desfire::ReadFileData(byte u8_FileID, int s32_Offset, int s32_Length, byte*
         s32_Offset    += s32_Read;
         u8_DataBuffer += s32_Read;
     }
+
+    #if DESFIRE_COUNT_COPIES
+        log(LL_INFO, LM_DESFIRE, "ReadFileData() bytes copied:", mu32_CopiedBytes);
+    #endif
     return true;
 }
 
@@ -860,8 +922,7 @@ bool Desfire::WriteFileData(byte u8_FileID, int s32_Offset, int s32_Length, cons
         log(LL_DEBUG, LM_DESFIRE, s8_Buf);
     }
 
-    // With intention this command does not use DF_INS_ADDITIONAL_FRAME because the CMAC must be calculated over all frames sent.
-    // When writing a lot of data this could lead to a buffer overflow in mi_CmacBuffer.
+    // With intention this command does not use DF_INS_ADDITIONAL_FRAME.
     while (s32_Length > 0)
     {
         int s32_Count = min(s32_Length, MAX_FRAME_SIZE - 8); // DF_INS_WRITE_DATA + u8_FileID + s32_Offset + s32_Count = 8 bytes
@@ -921,6 +982,7 @@ byte Desfire::GetLastPN532Error()
     u8_Command    = Desfire command without additional paramaters
     pi_Command    = Desfire command + possible additional paramaters that will not be encrypted
     pi_Params     = Desfire command parameters that may be encrypted (MAC_Tcrypt). This paramater may also be null.
+                    They are encrypted in the packet buffer, pi_Params is not modified. May be built in place with PacketParams().
     u8_RecvBuf    = buffer that receives the received data (should be the size of the expected recv data)
    s32_RecvSize   = buffer size of u8_RecvBuf
     pe_Status     = if (!= NULL) -> receives the status byte
@@ -964,7 +1026,23 @@ int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + p
         assertDo (mu8_LastAuthKeyNo == NOT_AUTHENTICATED, LL_ERROR, LM_DESFIRE, "Not authenticated", return -1;);
     }
 
-    if (e_Mac & MAC_Tcrypt) // CRC and encrypt pi_Params
+    // The frame is assembled in mu8_PacketBuffer behind INDATAEXCHANGE and the card number.
+    // Parameters that were built with PacketParams() are already in place.
+    // CRC, encryption and CMAC are calculated there without copying the data again.
+    int   s32_CmdCount   = pi_Command->GetCount();
+    int   s32_ParamCount = pi_Params ->GetCount();
+    byte* u8_Frame       = mu8_PacketBuffer + 2;
+    byte* u8_Params      = u8_Frame + s32_CmdCount;
+
+    if (pi_Params->GetData() != u8_Params)
+    {
+        memmove(u8_Params, pi_Params->GetData(), s32_ParamCount);
+        COUNT_COPIES(s32_ParamCount);
+    }
+    memcpy(u8_Frame, pi_Command->GetData(), s32_CmdCount);
+    COUNT_COPIES(s32_CmdCount);
+
+    if (e_Mac & MAC_Tcrypt) // CRC and encrypt the parameters
     {
         if (checkLogLevel(LM_DESFIRE, LL_DEBUG))
         {
@@ -973,52 +1051,45 @@ int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + p
         }    
     
         // The CRC is calculated over the command (which is not encrypted) and the parameters to be encrypted.
-        uint32_t u32_Crc = Utils::CalcCrc32(pi_Command->GetData(), pi_Command->GetCount(), pi_Params->GetData(), pi_Params->GetCount());
-        if (!pi_Params->AppendUint32(u32_Crc))
-            return -1; // buffer overflow
+        uint32_t u32_Crc = Utils::CalcCrc32(u8_Frame, s32_CmdCount + s32_ParamCount);
     
-        int s32_CryptCount = mpi_SessionKey->CalcPaddedBlockSize(pi_Params->GetCount());
-        if (!pi_Params->SetCount(s32_CryptCount))
-            return -1; // buffer overflow
+        // The parameters + CRC are padded with zeroes
+        int s32_CryptCount = mpi_SessionKey->CalcPaddedBlockSize(s32_ParamCount + 4);
+        assertDo (2 + s32_CmdCount + s32_CryptCount > PN532_PACKBUFFSIZE, LL_ERROR, LM_DESFIRE, "DataExchange(): Invalid parameters", return -1;);
+
+        memcpy(u8_Params + s32_ParamCount, &u32_Crc, 4);
+        memset(u8_Params + s32_ParamCount + 4, 0, s32_CryptCount - s32_ParamCount - 4);
+        s32_ParamCount = s32_CryptCount;
     
         log_hexdump(LL_DEBUG, LM_DESFIRE, "CRC Params (HEX):", 4, (uint8_t*) &u32_Crc);
-        log_hexdump(LL_DEBUG, LM_DESFIRE, "Params (HEX):", s32_CryptCount, pi_Params->GetData());
+        log_hexdump(LL_DEBUG, LM_DESFIRE, "Params (HEX):", s32_CryptCount, u8_Params);
     
-        if (!mpi_SessionKey->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, pi_Params->GetData(), pi_Params->GetData(), s32_CryptCount))
+        if (!SessionCryptCBC(CBC_SEND, KEY_ENCIPHER, u8_Params, u8_Params, s32_CryptCount))
             return -1;
     
-        log_hexdump(LL_DEBUG, LM_DESFIRE, "Params_enc (HEX):", s32_CryptCount, pi_Params->GetData()); 
+        log_hexdump(LL_DEBUG, LM_DESFIRE, "Params_enc (HEX):", s32_CryptCount, u8_Params); 
     }
 
-    byte u8_Command = pi_Command->GetData()[0];
+    byte u8_Command = u8_Frame[0];
 
     byte u8_CalcMac[16];
     if ((e_Mac & MAC_Tmac) &&                       // Calculate the TX CMAC only if the caller requests it 
         (u8_Command != DF_INS_ADDITIONAL_FRAME) &&  // In case of DF_INS_ADDITIONAL_FRAME there are never parameters passed -> nothing to do here
         (mu8_LastAuthKeyNo != NOT_AUTHENTICATED))   // No session key -> no CMAC calculation possible
     { 
-        mi_CmacBuffer.Clear();
-        if (!mi_CmacBuffer.AppendBuf(pi_Command->GetData(), pi_Command->GetCount()) ||
-            !mi_CmacBuffer.AppendBuf(pi_Params ->GetData(), pi_Params ->GetCount()))
-            return -1;
-      
         // The CMAC must be calculated here although it is not transmitted, because it maintains the IV up to date.
         // The initialization vector must always be correct otherwise the card will give an integrity error the next time the session key is used.
-        if (!mpi_SessionKey->CalculateCmac(mi_CmacBuffer, u8_CalcMac))
+        SessionCmacStart();
+        if (!SessionCmacUpdate(u8_Frame, s32_CmdCount + s32_ParamCount) ||
+            !SessionCmacFinish(u8_CalcMac))
             return -1;
 
         log_hexdump(LL_DEBUG, LM_DESFIRE, "TX CMAC (HEX):", mpi_SessionKey->GetBlockSize(), u8_CalcMac); 
     }
 
-    int P=0;
-    mu8_PacketBuffer[P++] = PN532_COMMAND_INDATAEXCHANGE;
-    mu8_PacketBuffer[P++] = 1; // Card number (Logical target number)
-
-    memcpy(mu8_PacketBuffer + P, pi_Command->GetData(), pi_Command->GetCount());
-    P += pi_Command->GetCount();
-
-    memcpy(mu8_PacketBuffer + P, pi_Params->GetData(),  pi_Params->GetCount());
-    P += pi_Params->GetCount();
+    mu8_PacketBuffer[0] = PN532_COMMAND_INDATAEXCHANGE;
+    mu8_PacketBuffer[1] = 1; // Card number (Logical target number)
+    int P = 2 + s32_CmdCount + s32_ParamCount;
 
     if (!SendCommandCheckAck(mu8_PacketBuffer, P))
         return -1;
@@ -1045,12 +1116,13 @@ int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + p
         mu8_LastAuthKeyNo = NOT_AUTHENTICATED; // A new authentication is required now
     }
 
-    if (!CheckCardStatus((DESFireStatus)u8_CardStatus))
-        return -1;
-
+    // The status is also returned on errors: callers may expect a specific error (TrySelectApplication)
     if (pe_Status)
        *pe_Status = (DESFireStatus)u8_CardStatus;
 
+    if (!CheckCardStatus((DESFireStatus)u8_CardStatus))
+        return -1;
+
     s32_Len -= 4; // 3 bytes for INDATAEXCHANGE response + 1 byte card status
 
     // A CMAC may be appended to the end of the frame.
@@ -1064,15 +1136,16 @@ int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + p
         // 1. u8_Command = DF_INS_GET_VERSION      -> clear CMAC buffer + append received data
         // 2. u8_Command = DF_INS_ADDITIONAL_FRAME -> append received data
         // 3. u8_Command = DF_INS_ADDITIONAL_FRAME -> append received data
+        // The CMAC runs over all frames, only the last incomplete block is buffered in the session key.
         if (u8_Command != DF_INS_ADDITIONAL_FRAME)
         {
-            mi_CmacBuffer.Clear();
+            SessionCmacStart();
         }
 
         // This is an intermediate frame. More frames will follow. There is no CMAC in the response yet.
         if (u8_CardStatus == ST_MoreFrames)
         {
-            if (!mi_CmacBuffer.AppendBuf(mu8_PacketBuffer + 4, s32_Len))
+            if (!SessionCmacUpdate(mu8_PacketBuffer + 4, s32_Len))
                 return -1;
         }
         
@@ -1084,11 +1157,9 @@ int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + p
             byte* u8_RxMac = mu8_PacketBuffer + 4 + s32_Len;
             
             // The CMAC is calculated over the RX data + the status byte appended to the END of the RX data!
-            if (!mi_CmacBuffer.AppendBuf(mu8_PacketBuffer + 4, s32_Len) ||
-                !mi_CmacBuffer.AppendUint8(u8_CardStatus))
-                return -1;
-
-            if (!mpi_SessionKey->CalculateCmac(mi_CmacBuffer, u8_CalcMac))
+            if (!SessionCmacUpdate(mu8_PacketBuffer + 4, s32_Len) ||
+                !SessionCmacUpdate(&u8_CardStatus, 1) ||
+                !SessionCmacFinish(u8_CalcMac))
                 return -1;
 
             log_hexdump(LL_DEBUG, LM_DESFIRE, "RX CMAC (HEX):", mpi_SessionKey->GetBlockSize(), u8_CalcMac); 
@@ -1103,10 +1174,11 @@ int Desfire::DataExchange(TxBuffer* pi_Command,               // in (command + p
     if (u8_RecvBuf && s32_Len)
     {
         memcpy(u8_RecvBuf, mu8_PacketBuffer + 4, s32_Len);
+        COUNT_COPIES(s32_Len);
 
         if (e_Mac & MAC_Rcrypt) // decrypt received data with session key
         {
-            if (!mpi_SessionKey->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, u8_RecvBuf, u8_RecvBuf, s32_Len))
+            if (!SessionCryptCBC(CBC_RECEIVE, KEY_DECIPHER, u8_RecvBuf, u8_RecvBuf, s32_Len))
                 return -1;
 
             log_hexdump(LL_DEBUG, LM_DESFIRE, "Decrypt:", s32_Len, u8_RecvBuf);
@@ -1152,7 +1224,8 @@ bool Desfire::CheckCardStatus(DESFireStatus e_Status)
             assertCnt(true, LL_ERROR, LM_DESFIRE, "Incorrect parameter.");
             return false;
         case ST_AppNotFound:
-            assertCnt(true, LL_ERROR, LM_DESFIRE, "Application not found.");
+            if (!mb_AppMayBeMissing)
+                assertCnt(true, LL_ERROR, LM_DESFIRE, "Application not found.");
             return false;
         case ST_AppIntegrityError:
             assertCnt(true, LL_ERROR, LM_DESFIRE, "Application integrity error.");
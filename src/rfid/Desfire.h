@@ -11,6 +11,12 @@
 
 #define MAX_FRAME_SIZE         60 // The maximum total length of a packet that is transfered to / from the card
 
+// Parameters built with Desfire::PacketParams() start behind INDATAEXCHANGE, card number and the Desfire command
+#define DF_PACKET_PARAMS        3
+
+// Counts the bytes that DataExchange() copies between buffers (logged by Authenticate() and ReadFileData())
+#define DESFIRE_COUNT_COPIES   false
+
 // ------- Desfire legacy instructions --------
 
 #define DF_INS_AUTHENTICATE_LEGACY        0x0A
@@ -270,6 +276,7 @@ class Desfire : public PN532
     bool GetApplicationIDs(uint32_t u32_IDlist[28], byte* pu8_AppCount);
     bool CreateApplication(uint32_t u32_AppID, DESFireKeySettings e_Settg, byte u8_KeyCount, DESFireKeyType e_KeyType);
     bool SelectApplication(uint32_t u32_AppID);    
+    bool TrySelectApplication(uint32_t u32_AppID, bool* pb_Found);
     bool DeleteApplication(uint32_t u32_AppID);    
     bool DeleteApplicationIfExists(uint32_t u32_AppID);
     // ---------------------
@@ -295,16 +302,43 @@ class Desfire : public PN532
     bool CheckCardStatus(DESFireStatus e_Status);
     bool SelftestKeyChange(uint32_t u32_Application, DESFireKey* pi_DefaultKey, DESFireKey* pi_NewKeyA, DESFireKey* pi_NewKeyB);
 
+    // The session key is used with its own type, so CBC and CMAC run the code of the key policy (DesFireKey.h) without virtual calls
+    inline bool SessionCryptCBC(DESFireCBC e_CBC, DESFireCipher e_Cipher, byte* u8_Out, const byte* u8_In, int s32_ByteCount)
+    {
+        if (mpi_SessionKey == &mi_AesSessionKey) return mi_AesSessionKey.CryptDataCBC(e_CBC, e_Cipher, u8_Out, u8_In, s32_ByteCount);
+        else                                     return mi_DesSessionKey.CryptDataCBC(e_CBC, e_Cipher, u8_Out, u8_In, s32_ByteCount);
+    }
+    inline void SessionCmacStart()
+    {
+        if (mpi_SessionKey == &mi_AesSessionKey) mi_AesSessionKey.CmacStart();
+        else                                     mi_DesSessionKey.CmacStart();
+    }
+    inline bool SessionCmacUpdate(const byte* u8_Data, int s32_Count)
+    {
+        if (mpi_SessionKey == &mi_AesSessionKey) return mi_AesSessionKey.CmacUpdate(u8_Data, s32_Count);
+        else                                     return mi_DesSessionKey.CmacUpdate(u8_Data, s32_Count);
+    }
+    inline bool SessionCmacFinish(byte u8_Cmac[16])
+    {
+        if (mpi_SessionKey == &mi_AesSessionKey) return mi_AesSessionKey.CmacFinish(u8_Cmac);
+        else                                     return mi_DesSessionKey.CmacFinish(u8_Cmac);
+    }
+
+    // Parameters for DataExchange(byte u8_Command, ...) written directly into the packet buffer, so they are not copied before sending.
+    // Nothing else may use the packet buffer until DataExchange() is called.
+    inline TxBuffer PacketParams()
+    {
+        return TxBuffer(mu8_PacketBuffer + DF_PACKET_PARAMS, PN532_PACKBUFFSIZE - DF_PACKET_PARAMS);
+    }
+
     byte          mu8_LastAuthKeyNo; // The last key which did a successful authetication (0xFF if not yet authenticated)
     uint32_t      mu32_LastApplication;
-    DESFireKey*   mpi_SessionKey;
+    DESFireKey*   mpi_SessionKey;    // points to one of the two below
     AES           mi_AesSessionKey;
     DES           mi_DesSessionKey;
     byte          mu8_LastPN532Error;
-
-    // Must have enough space to hold the entire response from DF_INS_GET_APPLICATION_IDS (84 byte) + CMAC padding
-    byte          mu8_CmacBuffer_Data[120]; 
-    TxBuffer      mi_CmacBuffer;
+    bool          mb_AppMayBeMissing; // ST_AppNotFound is an expected answer (TrySelectApplication)
+    uint32_t      mu32_CopiedBytes;   // DESFIRE_COUNT_COPIES
 };
 
 #endif
\ No newline at end of file
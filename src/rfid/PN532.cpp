@@ -45,6 +45,9 @@
 
 #include "PN532.h"
 #include "../util/error.h"
+#if PN532_CARD_EMULATOR
+    #include "../simulator/card_emulator.h"
+#endif
 
 /**************************************************************************
     Constructor
@@ -56,6 +59,19 @@ PN532::PN532()
     mu8_MosiPin    = 0;  
     mu8_SselPin    = 0;  
     mu8_ResetPin   = 0;
+    mu8_IrqPin     = PN532_NO_IRQ;
+    mb_FastSpi     = false;
+}
+
+/**************************************************************************
+    Uses the P70_IRQ line of the PN532 to learn when a response is ready.
+    Without it the status byte is polled over the bus.
+    param  irq       The pin connected to P70_IRQ (active low)
+**************************************************************************/
+void PN532::InitIrq(byte u8_Irq)
+{
+    mu8_IrqPin = u8_Irq;
+    Utils::SetPinMode(mu8_IrqPin, INPUT_PULLUP);
 }
 
 /**************************************************************************
@@ -108,12 +124,27 @@ PN532::PN532()
         mu8_MosiPin    = u8_Mosi;
         mu8_SselPin    = u8_Sel;
         mu8_ResetPin   = u8_Reset;
+        mb_FastSpi     = PN532_FAST_SPI;
     
         Utils::SetPinMode(mu8_ResetPin, OUTPUT);
         Utils::SetPinMode(mu8_SselPin,  OUTPUT);
     }
 #endif
 
+/**************************************************************************
+    Switches between the fast and the original hardware SPI transport.
+    Used to compare both. Has no effect in software SPI or I2C mode.
+**************************************************************************/
+void PN532::SetFastSpi(bool b_Fast)
+{
+    #if USE_HARDWARE_SPI
+    {
+        mb_FastSpi = b_Fast;
+        SpiClass::SetClock(b_Fast ? PN532_FAST_SPI_CLOCK : PN532_HARD_SPI_CLOCK);
+    }
+    #endif
+}
+
 /**************************************************************************
     Reset the PN532, wake up and start communication
 **************************************************************************/
@@ -121,17 +152,39 @@ void PN532::begin()
 {
     log(LL_DEBUG, LM_PN532, "begin");
 
-    Utils::WritePin(mu8_ResetPin, HIGH);
-    Utils::DelayMilli(10);
-    Utils::WritePin(mu8_ResetPin, LOW);
-    Utils::DelayMilli(400);
-    Utils::WritePin(mu8_ResetPin, HIGH);
-    Utils::DelayMilli(10);  // Small delay required before taking other actions after reset. See datasheet section 12.23, page 209.
-  
-    #if (USE_HARDWARE_SPI || USE_SOFTWARE_SPI) 
+    SetReset(false);
+    Utils::DelayMilli(PN532_RESET_PRE);
+    SetReset(true);
+    Utils::DelayMilli(PN532_RESET_PULSE);
+    SetReset(false);
+    Utils::DelayMilli(PN532_RESET_SETTLE);  // Small delay required before taking other actions after reset. See datasheet section 12.23, page 209.
+
+    Wakeup();
+}
+
+/**************************************************************************
+    Drives the reset line RSTPD_N (active low)
+**************************************************************************/
+void PN532::SetReset(bool b_Active)
+{
+    Utils::WritePin(mu8_ResetPin, b_Active ? LOW : HIGH);
+}
+
+/**************************************************************************
+    Starts the communication after the reset sequence
+**************************************************************************/
+void PN532::Wakeup()
+{
+    log(LL_DEBUG, LM_PN532, "Wakeup");
+
+    #if PN532_CARD_EMULATOR
+    {
+        cemu_reader_reset();
+    }
+    #elif (USE_HARDWARE_SPI || USE_SOFTWARE_SPI) 
     {
         #if USE_HARDWARE_SPI
-            SpiClass::Begin(mu8_ClkPin, mu8_MisoPin, mu8_MosiPin, PN532_HARD_SPI_CLOCK);
+            SpiClass::Begin(mu8_ClkPin, mu8_MisoPin, mu8_MosiPin, mb_FastSpi ? PN532_FAST_SPI_CLOCK : PN532_HARD_SPI_CLOCK);
         #endif
 
         // Wake up the PN532 (chapter 7.2.11) -> send a sequence of 0x55 (dummy bytes)
@@ -341,19 +394,128 @@ bool PN532::ReadPassiveTargetID(byte* u8_UidBuffer, byte* pu8_UidLength, eCardTy
     if (cardsFound != 1)
         return true; // no card found -> this is not an error!
 
-    byte u8_IdLength = mu8_PacketBuffer[7];
+    ParseTargetData(mu8_PacketBuffer + 3, u8_UidBuffer, pu8_UidLength, pe_CardType);
+    return true;
+}
+
+/**************************************************************************
+    Checks if the activated ISO14443-4 target is still in the field (Diagnose, NumTst 0x06).
+    Unlike InListPassiveTarget the target stays selected and authenticated.
+    returns false only on error!
+    returns true and *pb_Present = false if the card has left the field
+**************************************************************************/
+bool PN532::CheckTargetPresence(bool* pb_Present)
+{
+    log(LL_DEBUG, LM_PN532, "CheckTargetPresence");
+
+    *pb_Present = false;
+
+    mu8_PacketBuffer[0] = PN532_COMMAND_DIAGNOSE;
+    mu8_PacketBuffer[1] = 0x06; // Attention Request Test / ISO14443-4 card presence detection
+
+    if (!SendCommandCheckAck(mu8_PacketBuffer, 2))
+        return false;
+
+    byte len = ReadData(mu8_PacketBuffer, 10);
+    assertDo(len != 3 || mu8_PacketBuffer[1] != PN532_COMMAND_DIAGNOSE + 1, LL_ERROR, LM_PN532, "CheckTargetPresence failed", return false;);
+
+    *pb_Present = (mu8_PacketBuffer[2] == 0x00); // Status: 0x00 = target answered
+    return true;
+}
+
+/**************************************************************************
+    Starts InAutoPoll for ISO14443-4A targets and returns without waiting.
+    The PN532 only switches the field on for each poll and pulls the IRQ line
+    low when a card entered the field. Then call ReadAutoPollTarget().
+    Requires InitIrq().
+**************************************************************************/
+bool PN532::StartAutoPoll()
+{
+    log(LL_DEBUG, LM_PN532, "StartAutoPoll");
+
+    assertDo(mu8_IrqPin == PN532_NO_IRQ, LL_ERROR, LM_PN532, "StartAutoPoll() requires the IRQ pin", return false;);
+
+    mu8_PacketBuffer[0] = PN532_COMMAND_INAUTOPOLL;
+    mu8_PacketBuffer[1] = 0xFF;                     // poll until a target is found
+    mu8_PacketBuffer[2] = PN532_AUTOPOLL_PERIOD;    // period in units of 150 ms
+    mu8_PacketBuffer[3] = 0x20;                     // Passive 106 kbps ISO/IEC14443-4A (Desfire)
+
+    return SendCommandCheckAck(mu8_PacketBuffer, 4);
+}
+
+/**************************************************************************
+    True as soon as the PN532 has a response ready (IRQ line low)
+**************************************************************************/
+bool PN532::IsIrqPending()
+{
+    #if PN532_CARD_EMULATOR
+        return mu8_IrqPin != PN532_NO_IRQ && cemu_ready();
+    #else
+        return mu8_IrqPin != PN532_NO_IRQ && Utils::ReadPin(mu8_IrqPin) == LOW;
+    #endif
+}
+
+/**************************************************************************
+    Reads the target found by StartAutoPoll(). Same results as ReadPassiveTargetID().
+    The target is activated and can be used like after InListPassiveTarget.
+**************************************************************************/
+bool PN532::ReadAutoPollTarget(byte* u8_UidBuffer, byte* pu8_UidLength, eCardType* pe_CardType)
+{
+    log(LL_DEBUG, LM_PN532, "ReadAutoPollTarget");
+
+    *pu8_UidLength = 0;
+    *pe_CardType   = CARD_Unknown;
+    memset(u8_UidBuffer, 0, 8);
+
+    /*
+    b0               D5 (always) (PN532_PN532TOHOST)
+    b1               61 (always) (PN532_COMMAND_INAUTOPOLL + 1)
+    b2               Amount of targets found
+    b3               Target type
+    b4               Length of the target data
+    b5..             Target data, same as in InListPassiveTarget (starting with the tag number)
+    */
+    byte len = ReadData(mu8_PacketBuffer, 40);
+    assertDo (len < 3 || mu8_PacketBuffer[1] != PN532_COMMAND_INAUTOPOLL + 1, LL_ERROR, LM_PN532, "ReadAutoPollTarget failed", return false;);
+
+    if (mu8_PacketBuffer[2] < 1 || len < 10)
+        return true; // polling ended without target -> this is not an error!
+
+    ParseTargetData(mu8_PacketBuffer + 5, u8_UidBuffer, pu8_UidLength, pe_CardType);
+    return true;
+}
+
+/**************************************************************************
+    Aborts the command the PN532 is working on (e.g. InAutoPoll).
+    An ACK frame from the host does that (chapter 6.2.1.3).
+**************************************************************************/
+void PN532::AbortCommand()
+{
+    log(LL_DEBUG, LM_PN532, "AbortCommand");
+
+    byte u8_Ack[] = {0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00};
+    SendPacket(u8_Ack, sizeof(u8_Ack));
+}
+
+/**************************************************************************
+    Decodes ISO14443A target data (tag number, SENS_RES, SEL_RES, UID) as
+    returned by InListPassiveTarget and InAutoPoll.
+**************************************************************************/
+void PN532::ParseTargetData(const byte* pu8_Target, byte* u8_UidBuffer, byte* pu8_UidLength, eCardType* pe_CardType)
+{
+    byte u8_IdLength = pu8_Target[4];
     if (u8_IdLength != 4 && u8_IdLength != 7)
     {
         log(LL_WARNING, LM_PN532, "Cards found:", (uint32_t) u8_IdLength);
-        return true; // unsupported card found -> this is not an error!
+        return; // unsupported card found -> this is not an error!
     }   
 
-    memcpy(u8_UidBuffer, mu8_PacketBuffer + 8, u8_IdLength);    
+    memcpy(u8_UidBuffer, pu8_Target + 5, u8_IdLength);    
     *pu8_UidLength = u8_IdLength;
 
     // See "Mifare Identification & Card Types.pdf" in the ZIP file
-    uint16_t u16_ATQA = ((uint16_t)mu8_PacketBuffer[4] << 8) | mu8_PacketBuffer[5];
-    byte     u8_SAK   = mu8_PacketBuffer[6];
+    uint16_t u16_ATQA = ((uint16_t)pu8_Target[1] << 8) | pu8_Target[2];
+    byte     u8_SAK   = pu8_Target[3];
 
     if (u8_IdLength == 7 && u8_UidBuffer[0] != 0x80 && u16_ATQA == 0x0344 && u8_SAK == 0x20) *pe_CardType = CARD_Desfire;
     if (u8_IdLength == 4 && u8_UidBuffer[0] == 0x80 && u16_ATQA == 0x0304 && u8_SAK == 0x20) *pe_CardType = CARD_DesRandom;
@@ -378,7 +540,6 @@ bool PN532::ReadPassiveTargetID(byte* u8_UidBuffer, byte* pu8_UidLength, eCardTy
             
         log(LL_DEBUG, LM_PN532, s8_Buf);
     }
-    return true;
 }
 
 /**************************************************************************
@@ -562,10 +723,13 @@ bool PN532::CheckPN532Status(byte u8_Status)
 **************************************************************************/
 bool PN532::IsReady() 
 {
-    #if (USE_HARDWARE_SPI || USE_SOFTWARE_SPI) 
+    #if PN532_CARD_EMULATOR
+    {
+        return cemu_read_status();
+    }
+    #elif (USE_HARDWARE_SPI || USE_SOFTWARE_SPI) 
     {
-        Utils::WritePin(mu8_SselPin, LOW);
-        Utils::DelayMilli(2); // INDISPENSABLE!! Otherwise reads bullshit
+        SpiSelect();
 
         log(LL_DEBUG, LM_PN532, "IsReady(): write STATUSREAD");
 
@@ -574,8 +738,7 @@ bool PN532::IsReady()
 
         log_hexdump(LL_DEBUG, LM_PN532, "IsReady(): read", 1, &u8_Ready);
     
-        Utils::WritePin(mu8_SselPin, HIGH);
-        Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
+        SpiDeselect();
         
         return u8_Ready == PN532_SPI_READY; // 0x01
     }
@@ -598,12 +761,27 @@ bool PN532::IsReady()
 **************************************************************************/
 bool PN532::WaitReady() 
 {
-    uint16_t timer = 0;
+    if (mu8_IrqPin != PN532_NO_IRQ)
+    {
+        // The PN532 pulls the IRQ line low as soon as a frame is ready. No status reads over the bus.
+        uint32_t u32_Start = Utils::GetMillis();
+        while (!IsIrqPending())
+        {
+            assertDo (Utils::GetMillis() - u32_Start >= PN532_TIMEOUT, LL_ERROR, LM_PN532, "WaitReady() -> IRQ TIMEOUT", return false;);
+            Utils::DelayMicro(PN532_IRQ_POLL_DELAY);
+        }
+        return true;
+    }
+
+    // The fast transport polls the status often, the response of short commands is ready after a few hundred microseconds
+    uint32_t u32_Start = Utils::GetMillis();
     while (!IsReady()) 
     {
-        assertDo (timer >= PN532_TIMEOUT, LL_ERROR, LM_PN532, "WaitReady() -> TIMEOUT", return false;);
-        Utils::DelayMilli(10);
-        timer += 10;        
+        assertDo (Utils::GetMillis() - u32_Start >= PN532_TIMEOUT, LL_ERROR, LM_PN532, "WaitReady() -> TIMEOUT", return false;);
+        if (mb_FastSpi)
+            Utils::DelayMicro(PN532_READY_POLL_DELAY);
+        else
+            Utils::DelayMilli(10);
     }
     return true;
 }
@@ -664,21 +842,28 @@ void PN532::WriteCommand(byte* cmd, byte cmdlen)
 **************************************************************************/
 void PN532::SendPacket(byte* buff, byte len)
 {
-    #if (USE_HARDWARE_SPI || USE_SOFTWARE_SPI) 
+    #if PN532_CARD_EMULATOR
     {
-        Utils::WritePin(mu8_SselPin, LOW);
-        Utils::DelayMilli(2);  // INDISPENSABLE!!
+        cemu_write(buff, len);
+    }
+    #elif (USE_HARDWARE_SPI || USE_SOFTWARE_SPI) 
+    {
+        SpiSelect();
 
         log(LL_DEBUG, LM_PN532, "WriteCommand(): write DATAWRITE");
         SpiWrite(PN532_SPI_DATAWRITE);
 
+        #if USE_HARDWARE_SPI
+        if (mb_FastSpi)
+            SpiClass::TransferFrame(buff, NULL, len);
+        else
+        #endif
         for (byte i=0; i<len; i++) 
         {
             SpiWrite(buff[i]);
         }
 
-        Utils::WritePin(mu8_SselPin, HIGH);
-        Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
+        SpiDeselect();
     }
     #elif USE_HARDWARE_I2C
     {
@@ -830,22 +1015,30 @@ bool PN532::ReadPacket(byte* buff, byte len)
     if (!WaitReady())
         return false;
         
-    #if (USE_HARDWARE_SPI || USE_SOFTWARE_SPI) 
+    #if PN532_CARD_EMULATOR
+    {
+        cemu_read(buff, len);
+        return true;
+    }
+    #elif (USE_HARDWARE_SPI || USE_SOFTWARE_SPI) 
     {
-        Utils::WritePin(mu8_SselPin, LOW);
-        Utils::DelayMilli(2); // INDISPENSABLE!! Otherwise reads bullshit
+        SpiSelect();
 
         log(LL_DEBUG, LM_PN532, "ReadPacket(): write DATAREAD");
         SpiWrite(PN532_SPI_DATAREAD);
     
+        #if USE_HARDWARE_SPI
+        if (mb_FastSpi)
+            SpiClass::TransferFrame(NULL, buff, len);
+        else
+        #endif
         for (byte i=0; i<len; i++) 
         {
             Utils::DelayMilli(1);
             buff[i] = SpiRead();
         }
     
-        Utils::WritePin(mu8_SselPin, HIGH);
-        Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
+        SpiDeselect();
         return true;
     }
     #elif USE_HARDWARE_I2C
@@ -870,6 +1063,27 @@ bool PN532::ReadPacket(byte* buff, byte len)
     #endif
 }
 
+/**************************************************************************
+    SPI chip select
+    The original transport waits 2 ms after selecting the chip (INDISPENSABLE!! Otherwise reads bullshit).
+    At the PN532's own clock the fast transport gets along with PN532_FAST_CS_DELAY.
+**************************************************************************/
+void PN532::SpiSelect()
+{
+    Utils::WritePin(mu8_SselPin, LOW);
+    if (mb_FastSpi)
+        Utils::DelayMicro(PN532_FAST_CS_DELAY);
+    else
+        Utils::DelayMilli(2);
+}
+
+void PN532::SpiDeselect()
+{
+    Utils::WritePin(mu8_SselPin, HIGH);
+    if (!mb_FastSpi)
+        Utils::DelayMicro(PN532_SOFT_SPI_DELAY);
+}
+
 /**************************************************************************
     SPI write one byte
 **************************************************************************/
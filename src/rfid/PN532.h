@@ -18,6 +18,17 @@
 // This parameter is not used for software SPI mode.
 #define PN532_HARD_SPI_CLOCK  1000000
 
+// Fast hardware SPI transport: the maximum clock of the PN532, whole frames per transfer (see SpiClass::TransferFrame())
+// and short ready polls instead of the fixed delays of milliseconds. false -> the original timing.
+// This parameter is not used for software SPI mode.
+#define PN532_FAST_SPI          true
+// The clock (in Hertz) of the fast transport. 5 MHz is the maximum of the PN532.
+#define PN532_FAST_SPI_CLOCK    5000000
+// Delay in microseconds between chip select and the first clock of the fast transport
+#define PN532_FAST_CS_DELAY     100
+// Delay in microseconds between two status reads of the fast transport while waiting for a response
+#define PN532_READY_POLL_DELAY  100
+
 // The maximum time to wait for an answer from the PN532
 // Do NOT use infinite timeouts like in Adafruit code!
 #define PN532_TIMEOUT  1000
@@ -25,6 +36,22 @@
 // The packet buffer is used for sending commands and for receiving responses from the PN532
 #define PN532_PACKBUFFSIZE   80
 
+// IRQ line (P70_IRQ) of the PN532. PN532_NO_IRQ: the ready status is polled over the bus.
+#define PN532_NO_IRQ          0xFF
+// Delay in microseconds between two checks of the IRQ line while waiting for a response
+#define PN532_IRQ_POLL_DELAY  50
+// InAutoPoll period in units of 150 ms. The field is only on while polling.
+#define PN532_AUTOPOLL_PERIOD 1
+
+// Reset sequence of begin() in milliseconds: RSTPD_N high, low (the reset), high again before talking to the chip
+#define PN532_RESET_PRE       10
+#define PN532_RESET_PULSE     400
+#define PN532_RESET_SETTLE    10
+
+// The PN532 and the card are emulated in software (see simulator/card_emulator.h) instead of using the bus.
+// For tests without reader and card only, false for the real reader!
+#define PN532_CARD_EMULATOR   false
+
 // ----------------------------------------------------------------------
 
 #define PN532_PREAMBLE                      (0x00)
@@ -153,8 +180,14 @@ class PN532
         void InitI2C        (byte u8_Reset);
     #endif
     
+    void InitIrq(byte u8_Irq);
+    void SetFastSpi(bool b_Fast);
+    
     // Generic PN532 functions
     void begin();  
+    // begin() in parts for callers that can't wait: SetReset() drives RSTPD_N, Wakeup() follows the reset sequence
+    void SetReset(bool b_Active);
+    void Wakeup();
     bool SamConfig();
     bool GetFirmwareVersion(byte* pIcType, byte* pVersionHi, byte* pVersionLo, byte* pFlags);
     bool WriteGPIO(bool P30, bool P31, bool P33, bool P35);
@@ -168,6 +201,13 @@ class PN532
             
     // ISO14443A functions
     bool ReadPassiveTargetID(byte* uidBuffer, byte* uidLength, eCardType* pe_CardType);
+    bool CheckTargetPresence(bool* pb_Present);
+
+    // Event driven detection (requires the IRQ pin)
+    bool StartAutoPoll();
+    bool IsIrqPending();
+    bool ReadAutoPollTarget(byte* uidBuffer, byte* uidLength, eCardType* pe_CardType);
+    void AbortCommand();
 
  protected: 
     // Low Level functions
@@ -179,9 +219,12 @@ class PN532
     void SendPacket  (byte* buff, byte len);
     bool IsReady();
     bool WaitReady();
+    void ParseTargetData(const byte* pu8_Target, byte* uidBuffer, byte* uidLength, eCardType* pe_CardType);
     bool ReadAck();
     void SpiWrite(byte c);
     byte SpiRead(void);
+    void SpiSelect();
+    void SpiDeselect();
 
     byte mu8_PacketBuffer[PN532_PACKBUFFSIZE];
 
@@ -191,6 +234,8 @@ class PN532
     byte mu8_MosiPin;  
     byte mu8_SselPin;  
     byte mu8_ResetPin;
+    byte mu8_IrqPin;
+    bool mb_FastSpi;
 };
 
 #endif
\ No newline at end of file
@@ -40,6 +40,15 @@ const uint32_t CARD_APPLICATION_ID = 0xAA401F;
 // This value must be between 0 and 31
 const byte CARD_FILE_ID = 0;
 
+// The application of the fast-tap layout (see USE_FAST_TAP in rfid.cpp).
+// Its file holds the binary customer ID and card ID (2 x 4 byte, little endian).
+// It is read right after selecting the application, without the PICC key version check.
+// This value must be between 0x000001 and 0xFFFFFF and differ from CARD_APPLICATION_ID
+const uint32_t CARD_FAST_APPLICATION_ID = 0xAA4020;
+
+// The ID of the file in the fast-tap application
+const byte CARD_FAST_FILE_ID = 0;
+
 // This 8 bit version number is uploaded to the card together with the key itself.
 // This version is irrelevant for encryption. 
 // It is just a version number for the key that you can obtain with Desfire::GetKeyVersion().
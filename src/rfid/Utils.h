@@ -25,6 +25,9 @@
 #define USE_SOFTWARE_SPI   FALSE   // Visual Studio needs this in upper case
 #define USE_HARDWARE_SPI   TRUE  // Visual Studio needs this in upper case
 #define USE_HARDWARE_I2C   FALSE  // Visual Studio needs this in upper case
+
+// Hardware SPI: frames with at least this many bytes are moved by DMA, shorter ones through the FIFO.
+#define SPI_DMA_MIN_FRAME  16
 // ********************************************************************************/
 
 
@@ -63,12 +66,24 @@
             SPI1.setMOSI(u8_Mosi);
             SPI1.begin();
             SPI1.beginTransaction(SPISettings(u32_Clock, LSBFIRST, SPI_MODE0));
+            mu32_Clock = u32_Clock;
+        }
+        // The PN532 is the only device on the bus, so the transaction stays open. Only the clock changes.
+        static inline void SetClock(uint32_t u32_Clock) 
+        {
+            SPI1.endTransaction();
+            SPI1.beginTransaction(SPISettings(u32_Clock, LSBFIRST, SPI_MODE0));
+            mu32_Clock = u32_Clock;
         }
         // Write one byte to the MOSI pin and at the same time receive one byte on the MISO pin.
         static inline byte Transfer(byte u8_Data) 
         {
             return SPI1.transfer(u8_Data);
         }
+        // Transfers a whole frame. u8_Tx = NULL sends zeroes, u8_Rx = NULL discards the received bytes.
+        static void TransferFrame(const byte* u8_Tx, byte* u8_Rx, int s32_Count);
+    private:
+        static uint32_t mu32_Clock;
     };
 #endif
 
@@ -174,11 +189,13 @@ public:
     static void     XorDataBlock(byte* u8_Data, const byte* u8_Xor, int s32_Length);
     static uint16_t CalcCrc16(const byte* u8_Data,  int s32_Length);
     static uint32_t CalcCrc32(const byte* u8_Data1, int s32_Length1, const byte* u8_Data2=NULL, int s32_Length2=0);
+    static uint16_t UpdateCrc16(uint16_t u16_Crc, const byte* u8_Data, int s32_Length);
+    static uint32_t UpdateCrc32(uint32_t u32_Crc, const byte* u8_Data, int s32_Length);
     static int      strnicmp(const char* str1, const char* str2, uint32_t u32_MaxCount);
     static int      stricmp (const char* str1, const char* str2);
 
-private:
-    static uint32_t CalcCrc32(const byte* u8_Data, int s32_Length, uint32_t u32_Crc);
+    static const uint16_t CRC16_INIT = 0x6363;
+    static const uint32_t CRC32_INIT = 0xFFFFFFFF;
 };
 
 #endif // UTILS_H
\ No newline at end of file
@@ -4,20 +4,54 @@
 #include "Buffer.h"
 #include "../util/error.h"
 #include "../data_handler/data_handler.h"
+#include <atomic>
 
 #define PN532_RESET_PIN 6 // Not connected
 #define PN532_MISO_PIN 5
 #define PN532_MOSI_PIN 21
 #define PN532_CLK_PIN 20
 #define PN532_CS_PIN 22
+#define PN532_IRQ_PIN 4
+
+// P70_IRQ of the PN532 is wired to PN532_IRQ_PIN: the PN532 waits for cards on its own (InAutoPoll)
+// and responses are awaited on the IRQ line instead of polling the status.
+#define USE_IRQ_DETECTION false
+
+// A card that was read stays selected and authenticated while it is in the field.
+// Later cycles only check its presence and reuse the member id.
+#define USE_CARD_SESSION true
+
+// Fast-tap layout: the ids are read from CARD_FAST_APPLICATION_ID with select, authenticate and one read
+// (4 card exchanges instead of 6, no PICC level round trip). Cards without it are read with the legacy layout.
+#define USE_FAST_TAP  true
+// Programming also writes the legacy layout, as long as readers without fast-tap are in use
+#define WRITE_LEGACY_LAYOUT  true
+
+#if !USE_FAST_TAP && !WRITE_LEGACY_LAYOUT
+    #error "Cards must be programmed with at least one layout"
+#endif
 
 #define USE_DESFIRE   true              
 #define USE_AES   false
 #define COMPILE_SELFTEST  0
+// Compares the time per PN532 command of the original and the fast SPI transport once at start-up
+#define COMPILE_SPI_BENCH  false
+// Checks the table driven CRCs against the bitwise reference over random data once at start-up and logs their speed
+#define COMPILE_CRC_BENCH  false
+// Checks both AES implementations with the FIPS-197 test vector once at start-up and logs their speed
+#define COMPILE_AES_SELFTEST  false
+// Checks the fused 3DES path with known answers once at start-up and logs its speed against the former one
+#define COMPILE_DES_SELFTEST  false
 #define ALLOW_ALSO_CLASSIC   false
 
-#define DESFIRE_KEY_TYPE   DES
-#define DEFAULT_APP_KEY    pn532.DES3_DEFAULT_KEY
+// The key policy of the card keys is fixed at compile time
+#if USE_AES
+    #define DESFIRE_KEY_TYPE   AES
+    #define DEFAULT_APP_KEY    pn532.AES_DEFAULT_KEY
+#else
+    #define DESFIRE_KEY_TYPE   DES
+    #define DEFAULT_APP_KEY    pn532.DES3_DEFAULT_KEY
+#endif
 
 struct sCard
 {
@@ -32,7 +66,12 @@ Desfire pn532;
 DESFIRE_KEY_TYPE piccMasterKey;
 DESFIRE_KEY_TYPE appKey;
 
-uint32_t member_present;
+// Written by rfid_run, read by the cashless device
+std::atomic<uint32_t> member_present;
+// Card id behind member_present and the member table it was checked with
+uint32_t present_cardId;
+uint32_t present_generation;
+bool member_simulated;
 
 bool prog_next;
 uint32_t prog_membId, prog_cardId;
@@ -40,18 +79,54 @@ void (*prog_done_callback)();
 bool restore_next;
 void (*restore_done_callback)();
 
+// Batch programming: every card presented is programmed for the member batch_next_member() hands out
+bool batch_active;
+bool (*batch_next_member)(uint32_t* membId, uint32_t* cardId);
+void (*batch_card_done)(uint32_t membId, uint32_t cardId, bool success);
+
 bool autoLogOn;
 
-void reset_reader() {
-    log(LL_INFO, LM_RFID, "Reader will be reset now...");
+// InAutoPoll is running on the PN532 and waits for a card
+bool detection_armed;
+
+// Startup of the reader in steps, see rfid_init_step(). The reset pulse doesn't block the loop.
+enum eReaderInit {
+    RI_ResetPre,
+    RI_ResetPulse,
+    RI_ResetSettle,
+    RI_Configure,
+    RI_Done
+};
+eReaderInit reader_init = RI_ResetPre;
+uint32_t reader_init_since;
+
+// The card read last is still selected, the RF field stays on
+bool card_session;
+// Only while the cashless device can sell. Otherwise the field is off between polls even with a card in the field.
+bool card_session_allowed;
+
+// A rejected card is not read again while it stays in the field, for at most RFID_REJECT_HOLDOFF ms.
+// Its random UID can't tell it from another card, so a card swapped within one cycle waits that long.
+#define RFID_REJECT_HOLDOFF 3000
+bool rejected_present;
+uint32_t rejected_since;
+
+// Per-tap read latency for each card layout, from the first card exchange to the ids
+#define TAP_FAST    0
+#define TAP_LEGACY  1
+
+struct sTapStats
+{
+    uint32_t count;
+    uint32_t sum_us;
+    uint32_t max_us;
+};
+sTapStats tap_stats[2];
 
+// Talks to the PN532 after its reset sequence
+void configure_reader() {
     do // pseudo loop (just used for aborting with break;)
     {
-        pn532_ready = false;
-      
-        // Reset the PN532
-        pn532.begin(); // delay > 400 ms
-    
         byte IC, VersionHi, VersionLo, Flags;
         if (!pn532.GetFirmwareVersion(&IC, &VersionHi, &VersionLo, &Flags))
             break;
@@ -81,6 +156,18 @@ void reset_reader() {
     log(LL_INFO, LM_RFID, "Reader ready.");
 }
 
+void reset_reader() {
+    log(LL_INFO, LM_RFID, "Reader will be reset now...");
+
+    pn532_ready = false;
+    detection_armed = false;
+    card_session = false;
+  
+    // Reset the PN532
+    pn532.begin(); // delay > 400 ms
+    configure_reader();
+}
+
 bool authenticatePICC(uint8_t* keyVersion) {
     log(LL_DEBUG, LM_RFID, "authenticatePICC");
 
@@ -104,23 +191,189 @@ bool authenticatePICC(uint8_t* keyVersion) {
     return true;
 }
 
+#if COMPILE_SPI_BENCH
+void spi_bench() {
+    const uint8_t ROUNDS = 20;
+    uint32_t time_us[2][2];
+
+    for(uint8_t fast = 0; fast < 2; fast++) {
+        pn532.SetFastSpi(fast);
+
+        byte IC, VersionHi, VersionLo, Flags;
+        uint32_t start = micros();
+        for(uint8_t i = 0; i < ROUNDS; i++)
+            assertRtn(!pn532.GetFirmwareVersion(&IC, &VersionHi, &VersionLo, &Flags), LL_ERROR, LM_RFID, "SPI bench: GetFirmwareVersion failed");
+        time_us[fast][0] = (micros() - start) / ROUNDS;
+
+        start = micros();
+        for(uint8_t i = 0; i < ROUNDS; i++)
+            assertRtn(!pn532.SamConfig(), LL_ERROR, LM_RFID, "SPI bench: SamConfig failed");
+        time_us[fast][1] = (micros() - start) / ROUNDS;
+    }
+    pn532.SetFastSpi(PN532_FAST_SPI);
+
+    char Buf[80];
+    sprintf(Buf, "SPI bench GetFirmwareVersion [us]: original %lu, fast %lu", (unsigned long) time_us[0][0], (unsigned long) time_us[1][0]);
+    log(LL_INFO, LM_RFID, Buf);
+    sprintf(Buf, "SPI bench SamConfig [us]: original %lu, fast %lu", (unsigned long) time_us[0][1], (unsigned long) time_us[1][1]);
+    log(LL_INFO, LM_RFID, Buf);
+}
+#endif
+
+#if COMPILE_CRC_BENCH
+// The former bitwise implementations
+uint32_t crc32_reference(const byte* u8_Data, int s32_Length, uint32_t u32_Crc) {
+    for(int i = 0; i < s32_Length; i++) {
+        u32_Crc ^= u8_Data[i];
+        for(int b = 0; b < 8; b++) {
+            bool b_Bit = (u32_Crc & 0x01) > 0;
+            u32_Crc >>= 1;
+            if(b_Bit) u32_Crc ^= 0xEDB88320;
+        }
+    }
+    return u32_Crc;
+}
+
+uint16_t crc16_reference(const byte* u8_Data, int s32_Length) {
+    uint16_t u16_Crc = 0x6363;
+    for(int i = 0; i < s32_Length; i++) {
+        byte ch = u8_Data[i];
+        ch = ch ^ (byte)u16_Crc;
+        ch = ch ^ (ch << 4);
+        u16_Crc = (u16_Crc >> 8) ^ ((uint16_t)ch << 8) ^ ((uint16_t)ch << 3) ^ ((uint16_t)ch >> 4);
+    }
+    return u16_Crc;
+}
+
+void crc_bench() {
+    const int ROUNDS = 1000;
+    byte u8_Data[64];
+
+    // Random lengths and split points: the incremental update must give the same CRC as one pass
+    uint32_t errors = 0;
+    for(int r = 0; r < ROUNDS; r++) {
+        int s32_Length = random(sizeof(u8_Data) + 1);
+        int s32_Split = random(s32_Length + 1);
+        for(int i = 0; i < s32_Length; i++)
+            u8_Data[i] = random(256);
+
+        if(Utils::CalcCrc32(u8_Data, s32_Split, u8_Data + s32_Split, s32_Length - s32_Split) != crc32_reference(u8_Data, s32_Length, 0xFFFFFFFF))
+            errors++;
+        if(Utils::CalcCrc16(u8_Data, s32_Length) != crc16_reference(u8_Data, s32_Length))
+            errors++;
+    }
+    assertCnt(errors > 0, LL_ERROR, LM_RFID, "CRC bench: table driven CRC differs from the reference");
+
+    // Speed over a full buffer. The results are summed up so that the compiler can't drop the calls.
+    volatile uint32_t sink = 0;
+    uint32_t cycles[4];
+
+    ARM_DEMCR |= ARM_DEMCR_TRCENA;
+    ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+
+    uint32_t start = ARM_DWT_CYCCNT;
+    for(int r = 0; r < ROUNDS; r++) sink += crc32_reference(u8_Data, sizeof(u8_Data), 0xFFFFFFFF);
+    cycles[0] = ARM_DWT_CYCCNT - start;
+
+    start = ARM_DWT_CYCCNT;
+    for(int r = 0; r < ROUNDS; r++) sink += Utils::CalcCrc32(u8_Data, sizeof(u8_Data));
+    cycles[1] = ARM_DWT_CYCCNT - start;
+
+    start = ARM_DWT_CYCCNT;
+    for(int r = 0; r < ROUNDS; r++) sink += crc16_reference(u8_Data, sizeof(u8_Data));
+    cycles[2] = ARM_DWT_CYCCNT - start;
+
+    start = ARM_DWT_CYCCNT;
+    for(int r = 0; r < ROUNDS; r++) sink += Utils::CalcCrc16(u8_Data, sizeof(u8_Data));
+    cycles[3] = ARM_DWT_CYCCNT - start;
+
+    const float bytes = (float) ROUNDS * sizeof(u8_Data);
+    log(LL_INFO, LM_RFID, "CRC32 bitwise [bytes/cycle]:", bytes / cycles[0]);
+    log(LL_INFO, LM_RFID, "CRC32 table   [bytes/cycle]:", bytes / cycles[1]);
+    log(LL_INFO, LM_RFID, "CRC16 bytewise [bytes/cycle]:", bytes / cycles[2]);
+    log(LL_INFO, LM_RFID, "CRC16 table    [bytes/cycle]:", bytes / cycles[3]);
+}
+#endif
+
 void rfid_init(bool autoLog) {
     log(LL_DEBUG, LM_RFID, "rfid_init");
 
     autoLogOn = autoLog;
 
     member_present = 0;
+    member_simulated = false;
 
     pn532.InitHardwareSPI(PN532_CLK_PIN, PN532_MISO_PIN, PN532_MOSI_PIN, PN532_CS_PIN, PN532_RESET_PIN);
-    reset_reader();
+    if(USE_IRQ_DETECTION)
+        pn532.InitIrq(PN532_IRQ_PIN);
     piccMasterKey.SetKeyData(SECRET_PICC_MASTER_KEY, sizeof(SECRET_PICC_MASTER_KEY), CARD_KEY_VERSION);
     appKey.SetKeyData(SECRET_APPLICATION_KEY, sizeof(SECRET_APPLICATION_KEY), CARD_KEY_VERSION);
 
     prog_next = false;
     restore_next = false;
+    batch_active = false;
+    card_session_allowed = true;
+
+    // The reset sequence of PN532::begin() continues in rfid_init_step()
+    log(LL_INFO, LM_RFID, "Reader will be reset now...");
+    pn532_ready = false;
+    detection_armed = false;
+    card_session = false;
+    pn532.SetReset(false);
+    reader_init = RI_ResetPre;
+    reader_init_since = millis();
 }
 
-bool check_card_present() {
+bool rfid_init_step() {
+    uint32_t since = millis() - reader_init_since;
+
+    switch(reader_init) {
+        case RI_ResetPre:
+            if(since < PN532_RESET_PRE)
+                return true;
+            pn532.SetReset(true);
+            break;
+        case RI_ResetPulse:
+            if(since < PN532_RESET_PULSE)
+                return true;
+            pn532.SetReset(false);
+            break;
+        case RI_ResetSettle:
+            if(since < PN532_RESET_SETTLE)
+                return true;
+            pn532.Wakeup();
+            break;
+        case RI_Configure:
+            configure_reader();
+            #if COMPILE_SPI_BENCH
+                if(pn532_ready)
+                    spi_bench();
+            #endif
+            #if COMPILE_CRC_BENCH
+                crc_bench();
+            #endif
+            #if COMPILE_AES_SELFTEST
+                assertCnt(!AES::Selftest(), LL_ERROR, LM_RFID, "AES selftest failed");
+            #endif
+            #if COMPILE_DES_SELFTEST
+                assertCnt(!DES::Selftest(), LL_ERROR, LM_RFID, "DES selftest failed");
+            #endif
+            break;
+        case RI_Done:
+            return false;
+    }
+
+    reader_init = (eReaderInit) (reader_init + 1);
+    reader_init_since = millis();
+    return reader_init != RI_Done;
+}
+
+bool rfid_ready() {
+    return reader_init == RI_Done;
+}
+
+// autopoll: take the target found by the armed detection instead of searching for one
+bool check_card_present(bool autopoll) {
     log(LL_DEBUG, LM_RFID, "check_card_present");
 
     assertDo(!pn532_ready, LL_WARNING, LM_RFID, "Reader not ready. Can't detect card. Try to reset...", reset_reader(); return false;);
@@ -129,7 +382,11 @@ bool check_card_present() {
     sCard card;
     memset(&card, 0, sizeof(card));
 
-    assertDo (!pn532.ReadPassiveTargetID(uid, &card.uidLength, &card.cardType), LL_ERROR, LM_RFID, "PN532 error during ReadPassiveTargetID", card.PN532_Error = true; return false;);
+    if(autopoll) {
+        assertDo (!pn532.ReadAutoPollTarget(uid, &card.uidLength, &card.cardType), LL_ERROR, LM_RFID, "PN532 error during ReadAutoPollTarget", card.PN532_Error = true; return false;);
+    } else {
+        assertDo (!pn532.ReadPassiveTargetID(uid, &card.uidLength, &card.cardType), LL_ERROR, LM_RFID, "PN532 error during ReadPassiveTargetID", card.PN532_Error = true; return false;);
+    }
 
     if (card.cardType == CARD_Desfire && card.uidLength > 0) // The card is a Desfire card in random ID mode
     {
@@ -143,9 +400,31 @@ bool check_card_present() {
 }
 
 void rfid_low_power_mode() {
+    card_session = false;
+    if(detection_armed) {
+        pn532.AbortCommand();
+        detection_armed = false;
+    }
     assertCnt(!pn532.SwitchOffRfField(), LL_WARNING, LM_RFID, "Can't turn off RF-Field");
 }
 
+// Cheap check of the card in session instead of a new read and authentication
+bool check_card_session() {
+    log(LL_DEBUG, LM_RFID, "check_card_session");
+
+    bool present = false;
+    assertDo(!pn532.CheckTargetPresence(&present), LL_WARNING, LM_RFID, "Presence check failed", return false;);
+    if(!present)
+        log(LL_INFO, LM_RFID, "Card left the field");
+    return present;
+}
+
+// Let the PN532 wait for the next card. It only switches the field on for each poll.
+void arm_detection() {
+    detection_armed = pn532.StartAutoPoll();
+    assertDo(!detection_armed, LL_WARNING, LM_RFID, "Can't start card detection", rfid_low_power_mode(););
+}
+
 bool rfid_read_tennis_app(uint8_t tennisCardID[], uint8_t tennisCustomerID[]) {
     log(LL_DEBUG, LM_RFID, "rfid_read_tennis_app");
     
@@ -172,24 +451,82 @@ bool rfid_read_tennis_app(uint8_t tennisCardID[], uint8_t tennisCustomerID[]) {
     return true;
 }
 
-bool rfid_store_tennis_app(uint8_t tennisCardID[], uint8_t tennisCustomerID[]) {
-    log(LL_DEBUG, LM_RFID, "rfid_store_tennis_app");
+// Fast-tap layout: no PICC level round trip, the authentication with the app key already proves a personalized card.
+// Returns false on errors. *pb_Found is false for cards without the fast-tap application.
+bool rfid_read_fast_app(bool* pb_Found, uint32_t* pu32_CardID, uint32_t* pu32_MembID) {
+    log(LL_DEBUG, LM_RFID, "rfid_read_fast_app");
 
-    assertDo (CARD_APPLICATION_ID == 0x000000 || CARD_KEY_VERSION == 0, LL_ERROR, LM_RFID, "severe errors in Secrets.h -> abort", return false;);
-  
-    byte u8_StoreValue[16];
+    assertDo (!pn532.TrySelectApplication(CARD_FAST_APPLICATION_ID, pb_Found), LL_ERROR, LM_RFID, "Can't select fast APP", return false;);
+    if(!*pb_Found)
+        return true;
 
-    memcpy(u8_StoreValue, tennisCardID, 8);
-    memcpy(u8_StoreValue+8, tennisCustomerID, 8);
+    assertDo (!pn532.Authenticate(0, &appKey), LL_ERROR, LM_RFID, "Can't authenticate fast APP", return false;);
 
-    // First delete the application (The current application master key may have changed after changing the user name for that card)
-    assertDo (!pn532.DeleteApplicationIfExists(CARD_APPLICATION_ID), LL_ERROR, LM_RFID, "Can't delete APP", return false;);
+    RX_BUFFER(i_FileData, 8);
+    assertDo (!pn532.ReadFileData(CARD_FAST_FILE_ID, 0, 8, i_FileData), LL_ERROR, LM_RFID, "Can't read fast data", return false;);
 
-    // Create the new application with default settings (we must still have permission to change the application master key later)
-    assertDo (!pn532.CreateApplication(CARD_APPLICATION_ID, KS_FACTORY_DEFAULT, 1, appKey.GetKeyType()), LL_ERROR, LM_RFID, "Can't create new APP", return false;);
+    *pu32_MembID = i_FileData.ReadUint32();
+    *pu32_CardID = i_FileData.ReadUint32();
+    return true;
+}
+
+void tap_stats_add(uint8_t layout, uint32_t elapsed_us) {
+    sTapStats* stats = &tap_stats[layout];
+    stats->count++;
+    stats->sum_us += elapsed_us;
+    if(elapsed_us > stats->max_us)
+        stats->max_us = elapsed_us;
+
+    log(LL_INFO, LM_RFID, layout == TAP_FAST ? "Tap read with fast layout [us]:" : "Tap read with legacy layout [us]:", elapsed_us);
+
+    // Comparison of both layouts
+    char Buf[80];
+    for(uint8_t i = TAP_FAST; i <= TAP_LEGACY; i++) {
+        if(tap_stats[i].count == 0)
+            continue;
+        sprintf(Buf, "%s: avg %lu us, max %lu us (%lu taps)", i == TAP_FAST ? "Fast  " : "Legacy",
+                (unsigned long) (tap_stats[i].sum_us / tap_stats[i].count), (unsigned long) tap_stats[i].max_us, (unsigned long) tap_stats[i].count);
+        log(LL_INFO, LM_RFID, Buf);
+    }
+}
+
+// Reads the ids with the fast-tap layout and falls back to the legacy layout
+bool read_card_ids(uint32_t* pu32_CardID, uint32_t* pu32_MembID) {
+    uint32_t start = micros();
+
+    bool fast = false;
+    if(USE_FAST_TAP && !rfid_read_fast_app(&fast, pu32_CardID, pu32_MembID))
+        return false;
+
+    if(!fast) {
+        uint8_t tennisCardID[8];
+        uint8_t tennisCustomerID[8];
+        if(!rfid_read_tennis_app(tennisCardID, tennisCustomerID))
+            return false;
+
+        log_hexdump(LL_DEBUG, LM_RFID, "Tennis-Card-ID:    ", 8, tennisCardID);
+        log_hexdump(LL_DEBUG, LM_RFID, "Tennis-Customer-ID:", 8, tennisCustomerID);
 
+        *pu32_CardID = 0;
+        *pu32_MembID = 0;
+        for(uint8_t i = 0; i < 8; i++) {
+            *pu32_CardID *= 10;
+            *pu32_MembID *= 10;
+
+            *pu32_CardID += tennisCardID[i];
+            *pu32_MembID += tennisCustomerID[i];
+        }
+    }
+
+    tap_stats_add(fast ? TAP_FAST : TAP_LEGACY, micros() - start);
+    return true;
+}
+
+// Sets the frozen app key and creates the data file in a freshly created application.
+// The application stays selected and authenticated.
+bool personalise_tennis_app(uint32_t u32_AppID, byte u8_FileID, int s32_FileSize) {
     // After this command all the following commands will apply to the application (rather than the PICC)
-    assertDo (!pn532.SelectApplication(CARD_APPLICATION_ID), LL_ERROR, LM_RFID, "Can't select newly created APP", return false;);
+    assertDo (!pn532.SelectApplication(u32_AppID), LL_ERROR, LM_RFID, "Can't select newly created APP", return false;);
 
     // Authentication with the application's master key is required
     assertDo (!pn532.Authenticate(0, &DEFAULT_APP_KEY), LL_ERROR, LM_RFID, "Can't authenticate with default APP key", return false;);
@@ -207,13 +544,49 @@ bool rfid_store_tennis_app(uint8_t tennisCardID[], uint8_t tennisCustomerID[]) {
 
     // --------------------------------------------
 
-    // Create Standard Data File with 16 bytes length
+    // Create Standard Data File
     DESFireFilePermissions k_Permis;
     k_Permis.e_ReadAccess         = AR_KEY0;
     k_Permis.e_WriteAccess        = AR_KEY0;
     k_Permis.e_ReadAndWriteAccess = AR_KEY0;
     k_Permis.e_ChangeAccess       = AR_KEY0;
-    assertDo (!pn532.CreateStdDataFile(CARD_FILE_ID, &k_Permis, 16), LL_ERROR, LM_RFID, "Data File can't be created", return false;);
+    assertDo (!pn532.CreateStdDataFile(u8_FileID, &k_Permis, s32_FileSize), LL_ERROR, LM_RFID, "Data File can't be created", return false;);
+
+    return true;
+}
+
+// Creates the application with the frozen app key and one data file. The PICC master key must be authenticated.
+// The application stays selected and authenticated.
+bool create_tennis_app(uint32_t u32_AppID, byte u8_FileID, int s32_FileSize) {
+    // First delete the application (The current application master key may have changed after changing the user name for that card)
+    assertDo (!pn532.DeleteApplicationIfExists(u32_AppID), LL_ERROR, LM_RFID, "Can't delete APP", return false;);
+
+    // Create the new application with default settings (we must still have permission to change the application master key later)
+    assertDo (!pn532.CreateApplication(u32_AppID, KS_FACTORY_DEFAULT, 1, appKey.GetKeyType()), LL_ERROR, LM_RFID, "Can't create new APP", return false;);
+
+    return personalise_tennis_app(u32_AppID, u8_FileID, s32_FileSize);
+}
+
+// Legacy layout: one decimal digit per byte, most significant first
+void id_to_digits(uint32_t id, uint8_t digits[8]) {
+    for(uint8_t i = 8; i > 0; i--) {
+        digits[i-1] = id % 10;
+        id /= 10;
+    }
+}
+
+bool rfid_store_tennis_app(uint8_t tennisCardID[], uint8_t tennisCustomerID[]) {
+    log(LL_DEBUG, LM_RFID, "rfid_store_tennis_app");
+
+    assertDo (CARD_APPLICATION_ID == 0x000000 || CARD_KEY_VERSION == 0, LL_ERROR, LM_RFID, "severe errors in Secrets.h -> abort", return false;);
+  
+    byte u8_StoreValue[16];
+
+    memcpy(u8_StoreValue, tennisCardID, 8);
+    memcpy(u8_StoreValue+8, tennisCustomerID, 8);
+
+    if(!create_tennis_app(CARD_APPLICATION_ID, CARD_FILE_ID, 16))
+        return false;
 
     // Write the StoreValue into that file
     assertDo (!pn532.WriteFileData(CARD_FILE_ID, 0, 16, u8_StoreValue), LL_ERROR, LM_RFID, "Write of tennis data was not successful", return false;);
@@ -221,6 +594,26 @@ bool rfid_store_tennis_app(uint8_t tennisCardID[], uint8_t tennisCustomerID[]) {
     return true;
 }
 
+bool rfid_store_fast_app(uint32_t cardId, uint32_t membId) {
+    log(LL_DEBUG, LM_RFID, "rfid_store_fast_app");
+
+    assertDo (CARD_FAST_APPLICATION_ID == 0x000000 || CARD_FAST_APPLICATION_ID == CARD_APPLICATION_ID || CARD_KEY_VERSION == 0, LL_ERROR, LM_RFID, "severe errors in Secrets.h -> abort", return false;);
+
+    // The legacy layout may have left its application selected
+    byte u8_KeyVersion;
+    assertDo (!authenticatePICC(&u8_KeyVersion), LL_ERROR, LM_RFID, "Can't authenticate card", return false;);
+
+    if(!create_tennis_app(CARD_FAST_APPLICATION_ID, CARD_FAST_FILE_ID, 8))
+        return false;
+
+    TX_BUFFER(i_StoreValue, 8);
+    i_StoreValue.AppendUint32(membId);
+    i_StoreValue.AppendUint32(cardId);
+    assertDo (!pn532.WriteFileData(CARD_FAST_FILE_ID, 0, 8, i_StoreValue), LL_ERROR, LM_RFID, "Write of fast tennis data was not successful", return false;);
+
+    return true;
+}
+
 bool rfid_restore_card() {
     log(LL_DEBUG, LM_RFID, "rfid_restore_card");
 
@@ -233,7 +626,7 @@ bool rfid_restore_card() {
 
     // An error in DeleteApplication must not abort. 
     // The key change below is more important and must always be executed.
-    bool b_Success = pn532.DeleteApplicationIfExists(CARD_APPLICATION_ID);
+    bool b_Success = pn532.DeleteApplicationIfExists(CARD_APPLICATION_ID) && pn532.DeleteApplicationIfExists(CARD_FAST_APPLICATION_ID);
     if (!b_Success)
     {
         // After any error the card demands a new authentication
@@ -266,14 +659,116 @@ bool rfid_set_PICC()
     return true;
 }
 
+// Programs a card in one pass with a single PICC authentication.
+// A personalized card keeps its PICC master key instead of going back to the factory key,
+// the old applications are found with one directory read and both new ones are created before the first is personalized.
+bool program_card_batch(uint32_t membId, uint32_t cardId) {
+    log(LL_DEBUG, LM_RFID, "program_card_batch");
+
+    assertDo (CARD_APPLICATION_ID == 0x000000 || CARD_FAST_APPLICATION_ID == 0x000000 || CARD_FAST_APPLICATION_ID == CARD_APPLICATION_ID || CARD_KEY_VERSION == 0, LL_ERROR, LM_RFID, "severe errors in Secrets.h -> abort", return false;);
+
+    byte u8_KeyVersion;
+    assertDo (!authenticatePICC(&u8_KeyVersion), LL_ERROR, LM_RFID, "Can't authenticate card", return false;);
+
+    if (u8_KeyVersion != CARD_KEY_VERSION) // empty card
+    {
+        assertDo (!pn532.ChangeKey(0, &piccMasterKey, NULL), LL_ERROR, LM_RFID, "Can't change key", return false;);
+        assertDo (!pn532.Authenticate(0, &piccMasterKey), LL_ERROR, LM_RFID, "Key change can't be verified", return false;);
+    }
+
+    uint32_t u32_IDlist[28];
+    byte u8_AppCount;
+    assertDo (!pn532.GetApplicationIDs(u32_IDlist, &u8_AppCount), LL_ERROR, LM_RFID, "Can't read application IDs", return false;);
+    for (byte i = 0; i < u8_AppCount; i++)
+    {
+        if (u32_IDlist[i] == CARD_APPLICATION_ID || u32_IDlist[i] == CARD_FAST_APPLICATION_ID)
+            assertDo (!pn532.DeleteApplication(u32_IDlist[i]), LL_ERROR, LM_RFID, "Can't delete APP", return false;);
+    }
+
+    if (WRITE_LEGACY_LAYOUT)
+        assertDo (!pn532.CreateApplication(CARD_APPLICATION_ID, KS_FACTORY_DEFAULT, 1, appKey.GetKeyType()), LL_ERROR, LM_RFID, "Can't create new APP", return false;);
+    if (USE_FAST_TAP)
+        assertDo (!pn532.CreateApplication(CARD_FAST_APPLICATION_ID, KS_FACTORY_DEFAULT, 1, appKey.GetKeyType()), LL_ERROR, LM_RFID, "Can't create new fast APP", return false;);
+
+    // Selecting an application needs no authentication: the second application follows the first one directly
+    if (WRITE_LEGACY_LAYOUT)
+    {
+        byte u8_StoreValue[16];
+        id_to_digits(cardId, u8_StoreValue);
+        id_to_digits(membId, u8_StoreValue + 8);
+
+        if (!personalise_tennis_app(CARD_APPLICATION_ID, CARD_FILE_ID, 16))
+            return false;
+        assertDo (!pn532.WriteFileData(CARD_FILE_ID, 0, 16, u8_StoreValue), LL_ERROR, LM_RFID, "Write of tennis data was not successful", return false;);
+    }
+
+    if (USE_FAST_TAP)
+    {
+        TX_BUFFER(i_StoreValue, 8);
+        i_StoreValue.AppendUint32(membId);
+        i_StoreValue.AppendUint32(cardId);
+
+        if (!personalise_tennis_app(CARD_FAST_APPLICATION_ID, CARD_FAST_FILE_ID, 8))
+            return false;
+        assertDo (!pn532.WriteFileData(CARD_FAST_FILE_ID, 0, 8, i_StoreValue), LL_ERROR, LM_RFID, "Write of fast tennis data was not successful", return false;);
+    }
+
+    return true;
+}
+
+void program_next_batch_card() {
+    log(LL_DEBUG, LM_RFID, "program_next_batch_card");
+
+    uint32_t membId, cardId;
+    if(!(*batch_next_member)(&membId, &cardId)) {
+        log(LL_INFO, LM_RFID, "Batch queue is empty. Batch programming stopped.");
+        batch_active = false;
+        return;
+    }
+
+    uint32_t start = millis();
+    bool success = program_card_batch(membId, cardId);
+    log(LL_INFO, LM_RFID, "Batch card for MembId:", membId);
+    if(success)
+        log(LL_INFO, LM_RFID, "Programmed in [ms]:", millis() - start);
+    else
+        log(LL_ERROR, LM_RFID, "Programming failed after [ms]:", millis() - start);
+
+    (*batch_card_done)(membId, cardId, success);
+}
+
 void rfid_run() {
     log(LL_DEBUG, LM_RFID, "rfid_run");
 
-    uint8_t tennisCardID[8];
-    uint8_t tennisCustomerID[8];
+    // The VMC simulator owns the member detection while it is running
+    if(member_simulated)
+        return;
+
+    // No card is read before the reader has started
+    if(!rfid_ready())
+        return;
+
+    // Card programming needs a fresh selection
+    if(card_session) {
+        if(!prog_next && !restore_next && check_card_session())
+            return;
+        card_session = false;
+    }
+
+    bool present;
+    if(detection_armed) {
+        // Nothing entered the field since the last cycle
+        if(!pn532.IsIrqPending())
+            return;
+        detection_armed = false;
+        present = check_card_present(true);
+    } else
+        present = check_card_present(false);
+
     uint32_t member_present_helper = 0;
 
-    if(check_card_present()) {
+    if(present) {
+        uint32_t cardID, membID;
         if(prog_next) {
             rfid_program_card(prog_membId, prog_cardId);
             (*prog_done_callback)();
@@ -282,43 +777,84 @@ void rfid_run() {
             rfid_restore_card();
             (*restore_done_callback)();
             restore_next = false;
-        } else if(rfid_read_tennis_app(tennisCardID, tennisCustomerID)) {
+        } else if(batch_active) {
+            program_next_batch_card();
+            // The card stays in session until it has left the field. Only then the next card is taken.
+            card_session = true;
+        } else if(rejected_present && millis() - rejected_since < RFID_REJECT_HOLDOFF) {
+            log(LL_DEBUG, LM_RFID, "Rejected card still in the field");
+        } else if(read_card_ids(&cardID, &membID)) {
             log(LL_INFO, LM_RFID, "Tennis data found:");
-            log_hexdump(LL_DEBUG, LM_RFID, "Tennis-Card-ID:    ", 8, tennisCardID);
-            log_hexdump(LL_DEBUG, LM_RFID, "Tennis-Customer-ID:", 8, tennisCustomerID);
-
-            uint32_t cardID = 0;
-            uint32_t membID = 0;
-            for(uint8_t i = 0; i < 8; i++) {
-                cardID *= 10;
-                membID *= 10;
-
-                cardID += tennisCardID[i];
-                membID += tennisCustomerID[i];
-            }
-
             log(LL_INFO, LM_RFID, "Tennis Card ID", cardID);
             log(LL_INFO, LM_RFID, "Tennis Memb ID", membID);
 
-            if(dh_is_authorised(membID, cardID))
+            rejected_present = false;
+            if(dh_is_authorised(membID, cardID)) {
                 member_present_helper = membID;
+                present_cardId = cardID;
+                present_generation = dh_members_generation();
+            } else {
+                rejected_present = true;
+                rejected_since = millis();
+            }
+            card_session = USE_CARD_SESSION && card_session_allowed;
         }
     } else {
+        rejected_present = false;
         if(autoLogOn)
             err_log_can_store();
     }
 
     member_present = member_present_helper;
 
-    // Set the reader to low power mode
-    rfid_low_power_mode();
+    // Keep the field on, switching it off ends the card's selection and authentication
+    if(card_session)
+        return;
+
+    // Without a card the PN532 waits for the next one. The card in the field is checked again by the next cycle.
+    if(USE_IRQ_DETECTION && !present && pn532_ready)
+        arm_detection();
+    else
+        rfid_low_power_mode();
+}
+
+bool rfid_job_pending() {
+    return prog_next || restore_next || batch_active;
+}
+
+void rfid_allow_card_session(bool allow) {
+    card_session_allowed = allow;
+
+    // A batch card must leave the field before the next one is programmed, its session always stays
+    if(!allow && card_session && !batch_active)
+        rfid_low_power_mode();
+}
+
+bool rfid_card_event() {
+    return detection_armed && pn532.IsIrqPending();
 }
 
 uint32_t rfid_member_present(){
     log(LL_DEBUG, LM_RFID, "rfid_member_present");
+
+    // A card in session isn't read again: after a reload it is checked against the new members
+    if(member_present != 0 && !member_simulated && present_generation != dh_members_generation()) {
+        present_generation = dh_members_generation();
+        if(!dh_is_authorised(member_present, present_cardId)) {
+            log(LL_INFO, LM_RFID, "Card in the field is no longer valid after the data-base reload");
+            member_present = 0;
+        }
+    }
     return member_present;
 }
 
+void rfid_simulate_member(bool active, uint32_t membId) {
+    log(LL_DEBUG, LM_RFID, "rfid_simulate_member");
+
+    member_simulated = active;
+    member_present = active ? membId : 0;
+}
+
 void rfid_program_card(uint32_t membId, uint32_t cardId) {
     log(LL_DEBUG, LM_RFID, "rfid_program_card");
 
@@ -335,18 +871,24 @@ void rfid_program_card(uint32_t membId, uint32_t cardId) {
         uint8_t tennisCardID[8];
         uint8_t tennisCustomerID[8];
 
-        for(int8_t i = 7; i >= 0; i--) {
-          tennisCardID[i] = cardId % 10;
-          tennisCustomerID[i] = membId % 10;
-          cardId /= 10;
-          membId /= 10;
+        id_to_digits(cardId, tennisCardID);
+        id_to_digits(membId, tennisCustomerID);
+
+        bool b_Success = true;
+
+        if(WRITE_LEGACY_LAYOUT) {
+            log(LL_INFO, LM_RFID, "About to write the following tennis data:");
+            log_hexdump(LL_INFO, LM_RFID, "Tennis-Card-ID:    ", 8, tennisCardID);
+            log_hexdump(LL_INFO, LM_RFID, "Tennis-Customer-ID:", 8, tennisCustomerID);
+
+            b_Success = rfid_store_tennis_app(tennisCardID, tennisCustomerID);
         }
 
-        log(LL_INFO, LM_RFID, "About to write the following tennis data:");
-        log_hexdump(LL_INFO, LM_RFID, "Tennis-Card-ID:    ", 8, tennisCardID);
-        log_hexdump(LL_INFO, LM_RFID, "Tennis-Customer-ID:", 8, tennisCustomerID);
+        // The fast-tap layout stores the ids in binary
+        if(USE_FAST_TAP && b_Success)
+            b_Success = rfid_store_fast_app(cardId, membId);
 
-        if(rfid_store_tennis_app(tennisCardID, tennisCustomerID))
+        if(b_Success)
             log(LL_INFO, LM_RFID, "Success.");
         else
             log(LL_ERROR, LM_RFID, "Failed.");
@@ -375,4 +917,22 @@ void rfid_restore_card_async(void (*restore_done)()) {
         restore_done_callback = restore_done;
         restore_next = true;
     }
-}
\ No newline at end of file
+}
+
+void rfid_program_batch_start(bool (*next_member)(uint32_t* membId, uint32_t* cardId), void (*card_done)(uint32_t membId, uint32_t cardId, bool success)) {
+    log(LL_DEBUG, LM_RFID, "rfid_program_batch_start");
+
+    batch_next_member = next_member;
+    batch_card_done = card_done;
+    batch_active = true;
+}
+
+void rfid_program_batch_stop() {
+    log(LL_DEBUG, LM_RFID, "rfid_program_batch_stop");
+
+    batch_active = false;
+}
+
+bool rfid_program_batch_active() {
+    return batch_active;
+}
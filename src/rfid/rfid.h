@@ -2,19 +2,40 @@
 
 #include <Arduino.h>
 
+// Starts the reader. rfid_init_step() continues the startup and returns true until it's done, the loop isn't blocked meanwhile.
 void rfid_init(bool autoLog);
+bool rfid_init_step();
+bool rfid_ready();
 
 uint32_t rfid_member_present();
+void rfid_simulate_member(bool active, uint32_t membId);
 
 void rfid_low_power_mode();
 
 bool rfid_read_tennis_app(uint8_t tennisCardID[], uint8_t tennisCustomerID[]);
 bool rfid_store_tennis_app(uint8_t tennisCardID[], uint8_t tennisCustomerID[]);
+bool rfid_read_fast_app(bool* pb_Found, uint32_t* pu32_CardID, uint32_t* pu32_MembID);
+bool rfid_store_fast_app(uint32_t cardId, uint32_t membId);
 bool rfid_restore_card();
 void rfid_restore_card_async(void (*restore_done)());
 bool rfid_set_PICC();
 
 void rfid_run();
 
+// True if the armed card detection has seen a card. rfid_run() should be called right away.
+bool rfid_card_event();
+
+// True while a programming, restore or batch job waits for a card
+bool rfid_job_pending();
+
+// Without the card session the RF field is switched off after every poll, also with a card in the field
+void rfid_allow_card_session(bool allow);
+
 void rfid_program_card(uint32_t membId, uint32_t cardId);
-void rfid_program_card_async(uint32_t membId, uint32_t cardId, void (*prog_done)());
\ No newline at end of file
+void rfid_program_card_async(uint32_t membId, uint32_t cardId, void (*prog_done)());
+
+// Batch programming: every card presented is programmed for the member next_member() returns, card_done() gets the result.
+// The next card is only taken after the programmed one has left the field. Stops when next_member() returns false.
+void rfid_program_batch_start(bool (*next_member)(uint32_t* membId, uint32_t* cardId), void (*card_done)(uint32_t membId, uint32_t cardId, bool success));
+void rfid_program_batch_stop();
+bool rfid_program_batch_active();
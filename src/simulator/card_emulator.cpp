@@ -0,0 +1,1036 @@
+#include "card_emulator.h"
+#include "../rfid/rfid.h"
+#include "../rfid/Desfire.h"
+#include "../rfid/Secrets.h"
+#include "../data_handler/data_handler.h"
+#include "../util/error.h"
+
+#define CEMU_MAX_CARDS      3
+#define CEMU_MAX_APPS       4       // applications besides the PICC level
+#define CEMU_MAX_KEYS       4
+#define CEMU_MAX_FILES      4
+#define CEMU_FILE_SIZE      32
+#define CEMU_FRAME_SIZE     (PN532_PACKBUFFSIZE + 10)
+#define CEMU_MAX_REPORTS    8       // Only the first violations are logged in detail
+
+#define CEMU_NO_CARD        0xFF
+#define CEMU_LOST_CARD      0xFE    // the activated card has left the field
+#define CEMU_NOT_AUTH       0xFF
+
+// Cards of the scenario
+#define CEMU_MEMBER_CARD    0
+#define CEMU_LEGACY_CARD    1       // programmed like the member card, but without the fast-tap application
+#define CEMU_FOREIGN_CARD   2
+
+struct sCemuKey {
+    uint8_t data[24];
+    uint8_t version;        // AES only, DES keeps the version in bit 0 of the first 8 bytes
+};
+
+struct sCemuFile {
+    bool used;
+    uint8_t id;
+    uint16_t access;
+    uint8_t size;
+    uint8_t data[CEMU_FILE_SIZE];
+};
+
+struct sCemuApp {
+    bool used;
+    uint32_t aid;
+    uint8_t settings;
+    uint8_t key_type;
+    uint8_t key_count;
+    sCemuKey keys[CEMU_MAX_KEYS];
+    sCemuFile files[CEMU_MAX_FILES];
+};
+
+struct sCemuCard {
+    uint8_t uid[7];
+    sCemuApp apps[CEMU_MAX_APPS + 1];   // 0 = PICC level
+};
+
+// State of the activated card. Lost with the RF field.
+struct sCemuSession {
+    uint8_t app;            // index into apps
+    uint8_t auth_key;
+    bool aes;               // type of the session key
+    uint8_t auth_cmd;       // != 0: the second frame of this authentication is expected
+    uint8_t auth_key_no;
+    uint8_t auth_size;
+    uint8_t rnd_b[16];
+};
+
+sCemuCard cemu_cards[CEMU_MAX_CARDS];
+sCemuSession cemu_session;
+
+// The card uses the same ciphers as the reader side
+DES cemu_des_key;
+AES cemu_aes_key;
+DES cemu_des_session;
+AES cemu_aes_session;
+DESFireKey *cemu_auth_key;
+
+// PN532 side
+uint8_t cemu_out[2][CEMU_FRAME_SIZE];
+uint8_t cemu_out_len[2];
+uint8_t cemu_out_count;     // frames waiting to be read, [0] first
+bool cemu_autopoll;         // InAutoPoll waits for a card
+uint8_t cemu_field_card;
+uint8_t cemu_target_card;   // activated by InListPassiveTarget or InAutoPoll
+
+sCemuStats cemu_stats;
+sCemuStats cemu_phase_stats;
+uint32_t cemu_violation_count;
+uint32_t cemu_rng;
+const char *cemu_phase;
+bool cemu_done;
+
+//----------------------------------------------//
+// Helpers                                      //
+//----------------------------------------------//
+uint32_t cemu_rng_next() {
+    // xorshift32: the same seed gives the same card UIDs and randoms
+    cemu_rng ^= cemu_rng << 13;
+    cemu_rng ^= cemu_rng >> 17;
+    cemu_rng ^= cemu_rng << 5;
+    return cemu_rng;
+}
+
+void cemu_violation(const char msg[], uint32_t value) {
+    cemu_violation_count++;
+    if(cemu_violation_count <= CEMU_MAX_REPORTS) {
+        char text[96];
+        sprintf(text, "Violation in '%s': %s (0x%02lX)", cemu_phase, msg, (unsigned long) value);
+        log(LL_WARNING, LM_CEMU, text);
+    }
+}
+
+void cemu_expect(bool ok, const char msg[], uint32_t value) {
+    if(!ok)
+        cemu_violation(msg, value);
+}
+
+uint32_t cemu_get_uint24(const uint8_t data[]) {
+    return data[0] | ((uint32_t) data[1] << 8) | ((uint32_t) data[2] << 16);
+}
+
+// A 2K3DES key with K1 == K2 is a simple DES key (bit 0 holds the version)
+bool cemu_des_single(const uint8_t key[]) {
+    for(uint8_t i = 0; i < 8; i++) {
+        if((key[i] ^ key[i + 8]) & 0xFE)
+            return false;
+    }
+    return true;
+}
+
+uint8_t cemu_key_version(sCemuApp *app, uint8_t key_no) {
+    sCemuKey *key = &app->keys[key_no];
+    if(app->key_type == DF_KEY_AES)
+        return key->version;
+
+    uint8_t version = 0;
+    for(uint8_t i = 0; i < 8; i++)
+        version = (version << 1) | (key->data[i] & 0x01);
+    return version;
+}
+
+DESFireKey* cemu_load_key(sCemuApp *app, uint8_t key_no) {
+    sCemuKey *key = &app->keys[key_no];
+    if(app->key_type == DF_KEY_AES) {
+        cemu_aes_key.SetKeyData(key->data, 16, key->version);
+        return &cemu_aes_key;
+    }
+
+    int size = 24;
+    if(app->key_type == DF_KEY_2K3DES)
+        size = cemu_des_single(key->data) ? 8 : 16;
+    cemu_des_key.SetKeyData(key->data, size, cemu_key_version(app, key_no));
+    return &cemu_des_key;
+}
+
+DESFireKey* cemu_session_key() {
+    if(cemu_session.aes)
+        return &cemu_aes_session;
+    return &cemu_des_session;
+}
+
+template <class KEY>
+void cemu_cmac_with(KEY *key, const uint8_t data[], int len, const uint8_t *status, uint8_t mac[16]) {
+    key->CmacStart();
+    key->CmacUpdate(data, len);
+    if(status)
+        key->CmacUpdate(status, 1);
+    key->CmacFinish(mac);
+}
+
+// Keeps the IV of the session key in step with the reader, like Desfire::DataExchange()
+void cemu_cmac(const uint8_t data[], int len, const uint8_t *status, uint8_t mac[16]) {
+    if(cemu_session.aes)
+        cemu_cmac_with(&cemu_aes_session, data, len, status, mac);
+    else
+        cemu_cmac_with(&cemu_des_session, data, len, status, mac);
+}
+
+// Decrypts the parameters behind the first plain_len bytes and checks the CRC32 over these and the data_len bytes of data
+bool cemu_decrypt(const uint8_t cmd[], uint8_t len, uint8_t plain_len, uint8_t data_len, uint8_t out[]) {
+    DESFireKey *key = cemu_session_key();
+    int crypt = len - plain_len;
+    if(crypt < data_len + 4 || crypt > 48 || crypt % key->GetBlockSize())
+        return false;
+
+    key->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, out, cmd + plain_len, crypt);
+    uint32_t crc = Utils::CalcCrc32(cmd, plain_len, out, data_len);
+    return memcmp(&crc, out + data_len, 4) == 0;
+}
+
+sCemuApp* cemu_find_app(sCemuCard *card, uint32_t aid) {
+    for(uint8_t i = 0; i <= CEMU_MAX_APPS; i++) {
+        if(card->apps[i].used && card->apps[i].aid == aid)
+            return &card->apps[i];
+    }
+    return 0;
+}
+
+sCemuFile* cemu_find_file(sCemuApp *app, uint8_t id) {
+    for(uint8_t i = 0; i < CEMU_MAX_FILES; i++) {
+        if(app->files[i].used && app->files[i].id == id)
+            return &app->files[i];
+    }
+    return 0;
+}
+
+bool cemu_access(uint8_t right) {
+    return right == AR_FREE || (right < AR_FREE && cemu_session.auth_key == right);
+}
+
+//----------------------------------------------//
+// DESFire EV1 card                             //
+//----------------------------------------------//
+uint8_t cemu_authenticate(sCemuApp *app, const uint8_t cmd[], uint8_t len, uint8_t out[], uint8_t *n) {
+    if(len != 2)
+        return ST_WrongCommandLen;
+    if(cmd[1] >= app->key_count)
+        return ST_KeyDoesNotExist;
+    if((app->key_type == DF_KEY_AES) != (cmd[0] == DFEV1_INS_AUTHENTICATE_AES))
+        return ST_AuthentError;
+
+    cemu_auth_key = cemu_load_key(app, cmd[1]);
+    cemu_session.auth_size = (app->key_type == DF_KEY_2K3DES) ? 8 : 16;
+    for(uint8_t i = 0; i < cemu_session.auth_size; i++)
+        cemu_session.rnd_b[i] = cemu_rng_next();
+
+    cemu_auth_key->ClearIV();
+    cemu_auth_key->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, out, cemu_session.rnd_b, cemu_session.auth_size);
+    *n = cemu_session.auth_size;
+
+    cemu_session.auth_cmd = cmd[0];
+    cemu_session.auth_key_no = cmd[1];
+    return ST_MoreFrames;
+}
+
+uint8_t cemu_authenticate_finish(const uint8_t cmd[], uint8_t len, uint8_t out[], uint8_t *n) {
+    uint8_t size = cemu_session.auth_size;
+    cemu_session.auth_cmd = 0;
+    if(len != 1 + 2 * size)
+        return ST_WrongCommandLen;
+
+    // RndA + rotated RndB
+    uint8_t plain[32];
+    uint8_t rotated[16];
+    cemu_auth_key->CryptDataCBC(CBC_RECEIVE, KEY_DECIPHER, plain, cmd + 1, 2 * size);
+    Utils::RotateBlockLeft(rotated, cemu_session.rnd_b, size);
+    if(memcmp(plain + size, rotated, size) != 0)
+        return ST_AuthentError;
+
+    Utils::RotateBlockLeft(rotated, plain, size);
+    cemu_auth_key->CryptDataCBC(CBC_SEND, KEY_ENCIPHER, out, rotated, size);
+    *n = size;
+
+    // The session key is composed like in Desfire::Authenticate()
+    const uint8_t *rnd_a = plain;
+    const uint8_t *rnd_b = cemu_session.rnd_b;
+    uint8_t sess[24];
+    uint8_t sess_len = 0;
+    uint8_t offsets[3] = { 0, 0, 0 };
+    uint8_t parts = 1;
+    if(cemu_auth_key->GetKeySize() > 8) {
+        switch(cemu_auth_key->GetKeyType()) {
+            case DF_KEY_2K3DES: offsets[1] = 4; parts = 2; break;
+            case DF_KEY_3K3DES: offsets[1] = 6; offsets[2] = 12; parts = 3; break;
+            case DF_KEY_AES:    offsets[1] = 12; parts = 2; break;
+            default: break;
+        }
+    }
+    for(uint8_t i = 0; i < parts; i++) {
+        memcpy(sess + sess_len, rnd_a + offsets[i], 4);
+        memcpy(sess + sess_len + 4, rnd_b + offsets[i], 4);
+        sess_len += 8;
+    }
+
+    cemu_session.aes = cemu_auth_key->GetKeyType() == DF_KEY_AES;
+    if(cemu_session.aes) {
+        cemu_aes_session.SetKeyData(sess, sess_len, 0);
+        cemu_aes_session.GenerateCmacSubkeys();
+    } else {
+        cemu_des_session.SetKeyData(sess, sess_len, 0);
+        cemu_des_session.GenerateCmacSubkeys();
+    }
+    cemu_session.auth_key = cemu_session.auth_key_no;
+    return ST_Success;
+}
+
+uint8_t cemu_change_key(sCemuApp *app, const uint8_t cmd[], uint8_t len) {
+    if(len < 2)
+        return ST_WrongCommandLen;
+    if(cemu_session.auth_key == CEMU_NOT_AUTH)
+        return ST_AuthentError;
+
+    uint8_t key_no = cmd[1] & 0x0F;
+    if(key_no >= app->key_count)
+        return ST_KeyDoesNotExist;
+
+    // The master key needs its own authentication, the other keys follow the change key access rights
+    uint8_t access = app->settings >> 4;
+    if(key_no == 0) {
+        if(cemu_session.auth_key != 0 || !(app->settings & KS_ALLOW_CHANGE_MK))
+            return ST_PermissionDenied;
+    } else if(access == 0x0F || cemu_session.auth_key != ((access == 0x0E) ? key_no : access))
+        return ST_PermissionDenied;
+
+    // The key type can only be changed at the PICC level
+    uint8_t type = (cemu_session.app == 0) ? (cmd[1] & 0xC0) : app->key_type;
+    uint8_t size = (type == DF_KEY_3K3DES) ? 24 : 16;
+    uint8_t version_len = (type == DF_KEY_AES) ? 1 : 0;
+    bool same = key_no == cemu_session.auth_key;
+
+    uint8_t plain[48];
+    if(!cemu_decrypt(cmd, len, 2, size + version_len, plain)) {
+        cemu_violation("ChangeKey cryptogram invalid", key_no);
+        return ST_IntegrityError;
+    }
+
+    // Another key than the authenticated one is sent XORed with the current key, followed by the CRC of the new key
+    uint8_t key[24];
+    memcpy(key, plain, size);
+    if(!same) {
+        Utils::XorDataBlock(key, app->keys[key_no].data, size);
+        uint32_t crc = Utils::CalcCrc32(key, size);
+        if(len - 2 < size + version_len + 8 || memcmp(&crc, plain + size + version_len + 4, 4) != 0) {
+            cemu_violation("ChangeKey CRC of the new key invalid", key_no);
+            return ST_IntegrityError;
+        }
+    }
+
+    memset(app->keys[key_no].data, 0, sizeof(app->keys[key_no].data));
+    memcpy(app->keys[key_no].data, key, size);
+    app->keys[key_no].version = version_len ? plain[size] : 0;
+    app->key_type = type;
+
+    // The session key was derived from the old key
+    if(same)
+        cemu_session.auth_key = CEMU_NOT_AUTH;
+    return ST_Success;
+}
+
+uint8_t cemu_change_key_settings(sCemuApp *app, const uint8_t cmd[], uint8_t len) {
+    if(cemu_session.auth_key != 0 || !(app->settings & KS_CONFIGURATION_CHANGEABLE))
+        return ST_PermissionDenied;
+
+    uint8_t plain[48];
+    if(!cemu_decrypt(cmd, len, 1, 1, plain)) {
+        cemu_violation("ChangeKeySettings cryptogram invalid", cmd[0]);
+        return ST_IntegrityError;
+    }
+    app->settings = plain[0];
+    return ST_Success;
+}
+
+uint8_t cemu_select_application(sCemuCard *card, const uint8_t cmd[], uint8_t len) {
+    if(len != 4)
+        return ST_WrongCommandLen;
+
+    sCemuApp *app = cemu_find_app(card, cemu_get_uint24(cmd + 1));
+    if(app == 0)
+        return ST_AppNotFound;
+
+    cemu_session.app = app - card->apps;
+    cemu_session.auth_key = CEMU_NOT_AUTH;
+    return ST_Success;
+}
+
+uint8_t cemu_create_application(sCemuCard *card, const uint8_t cmd[], uint8_t len) {
+    if(len != 6)
+        return ST_WrongCommandLen;
+    if(cemu_session.app != 0 || (cemu_session.auth_key != 0 && !(card->apps[0].settings & KS_CREATE_DELETE_WITHOUT_MK)))
+        return ST_PermissionDenied;
+
+    uint32_t aid = cemu_get_uint24(cmd + 1);
+    uint8_t key_count = cmd[5] & 0x0F;
+    if(aid == 0 || key_count == 0 || key_count > CEMU_MAX_KEYS)
+        return ST_IncorrectParam;
+    if(cemu_find_app(card, aid))
+        return ST_DuplicateAidFiles;
+
+    for(uint8_t i = 1; i <= CEMU_MAX_APPS; i++) {
+        sCemuApp *app = &card->apps[i];
+        if(app->used)
+            continue;
+        memset(app, 0, sizeof(*app));
+        app->used = true;
+        app->aid = aid;
+        app->settings = cmd[4];
+        app->key_type = cmd[5] & 0xC0;
+        app->key_count = key_count;
+        return ST_Success;
+    }
+    return ST_OutOfMemory;
+}
+
+uint8_t cemu_delete_application(sCemuCard *card, const uint8_t cmd[], uint8_t len) {
+    if(len != 4)
+        return ST_WrongCommandLen;
+    if(cemu_session.app != 0 || cemu_session.auth_key != 0)
+        return ST_PermissionDenied;
+
+    sCemuApp *app = cemu_find_app(card, cemu_get_uint24(cmd + 1));
+    if(app == 0 || app == &card->apps[0])
+        return ST_AppNotFound;
+    app->used = false;
+    return ST_Success;
+}
+
+uint8_t cemu_application_ids(sCemuCard *card, uint8_t out[], uint8_t *n) {
+    if(cemu_session.app != 0 || (cemu_session.auth_key != 0 && !(card->apps[0].settings & KS_LISTING_WITHOUT_MK)))
+        return ST_PermissionDenied;
+
+    for(uint8_t i = 1; i <= CEMU_MAX_APPS; i++) {
+        if(!card->apps[i].used)
+            continue;
+        out[(*n)++] = card->apps[i].aid;
+        out[(*n)++] = card->apps[i].aid >> 8;
+        out[(*n)++] = card->apps[i].aid >> 16;
+    }
+    return ST_Success;
+}
+
+uint8_t cemu_create_file(sCemuApp *app, const uint8_t cmd[], uint8_t len) {
+    if(len != 8)
+        return ST_WrongCommandLen;
+    if(cemu_session.app == 0 || (cemu_session.auth_key != 0 && !(app->settings & KS_CREATE_DELETE_WITHOUT_MK)))
+        return ST_PermissionDenied;
+
+    // Only plain communication is emulated, the reader does not use another one
+    uint32_t size = cemu_get_uint24(cmd + 5);
+    if(cmd[1] > 31 || cmd[2] != CM_PLAIN || size == 0)
+        return ST_IncorrectParam;
+    if(cemu_find_file(app, cmd[1]))
+        return ST_DuplicateAidFiles;
+    if(size > CEMU_FILE_SIZE)
+        return ST_OutOfMemory;
+
+    for(uint8_t i = 0; i < CEMU_MAX_FILES; i++) {
+        sCemuFile *file = &app->files[i];
+        if(file->used)
+            continue;
+        memset(file, 0, sizeof(*file));
+        file->used = true;
+        file->id = cmd[1];
+        file->access = cmd[3] | (cmd[4] << 8);
+        file->size = size;
+        return ST_Success;
+    }
+    return ST_OutOfMemory;
+}
+
+uint8_t cemu_read_data(sCemuApp *app, const uint8_t cmd[], uint8_t len, uint8_t out[], uint8_t *n) {
+    if(len != 8)
+        return ST_WrongCommandLen;
+
+    sCemuFile *file = cemu_find_file(app, cmd[1]);
+    if(file == 0)
+        return ST_FileNotFound;
+    if(!cemu_access(file->access >> 12) && !cemu_access((file->access >> 4) & 0x0F))
+        return ST_PermissionDenied;
+
+    uint32_t offset = cemu_get_uint24(cmd + 2);
+    uint32_t count = cemu_get_uint24(cmd + 5);
+    if(count == 0 && offset < file->size)
+        count = file->size - offset;   // the whole file from offset
+    if(offset + count > file->size)
+        return ST_LimitExceeded;
+
+    memcpy(out, file->data + offset, count);
+    *n = count;
+    return ST_Success;
+}
+
+uint8_t cemu_write_data(sCemuApp *app, const uint8_t cmd[], uint8_t len) {
+    if(len < 8 || cemu_get_uint24(cmd + 5) != (uint32_t) (len - 8))
+        return ST_WrongCommandLen;
+
+    sCemuFile *file = cemu_find_file(app, cmd[1]);
+    if(file == 0)
+        return ST_FileNotFound;
+    if(!cemu_access((file->access >> 8) & 0x0F) && !cemu_access((file->access >> 4) & 0x0F))
+        return ST_PermissionDenied;
+
+    uint32_t offset = cemu_get_uint24(cmd + 2);
+    if(offset + len - 8 > file->size)
+        return ST_LimitExceeded;
+
+    memcpy(file->data + offset, cmd + 8, len - 8);
+    return ST_Success;
+}
+
+// Commands that are neither encrypted nor part of an authentication get a TX CMAC on both sides
+bool cemu_tx_mac(uint8_t cmd) {
+    switch(cmd) {
+        case DF_INS_ADDITIONAL_FRAME:
+        case DFEV1_INS_AUTHENTICATE_ISO:
+        case DFEV1_INS_AUTHENTICATE_AES:
+        case DF_INS_SELECT_APPLICATION:
+        case DF_INS_CHANGE_KEY:
+        case DF_INS_CHANGE_KEY_SETTINGS:
+        case DFEV1_INS_SET_CONFIGURATION:
+            return false;
+        default:
+            return true;
+    }
+}
+
+// Returns the length of the response: status + data + CMAC
+uint8_t cemu_card_command(sCemuCard *card, const uint8_t cmd[], uint8_t len, uint8_t rsp[]) {
+    sCemuApp *app = &card->apps[cemu_session.app];
+    uint8_t *out = rsp + 1;
+    uint8_t n = 0;
+    bool mac = true;
+    uint8_t status;
+
+    if(cemu_session.auth_key != CEMU_NOT_AUTH && cemu_tx_mac(cmd[0])) {
+        uint8_t tx_mac[16];
+        cemu_cmac(cmd, len, 0, tx_mac);
+    }
+
+    if(cemu_session.auth_cmd != 0 && cmd[0] == DF_INS_ADDITIONAL_FRAME) {
+        status = cemu_authenticate_finish(cmd, len, out, &n);
+        mac = false;
+    } else {
+        cemu_session.auth_cmd = 0;
+        switch(cmd[0]) {
+            case DFEV1_INS_AUTHENTICATE_ISO:
+            case DFEV1_INS_AUTHENTICATE_AES:
+                cemu_session.auth_key = CEMU_NOT_AUTH;
+                status = cemu_authenticate(app, cmd, len, out, &n);
+                break;
+            case DF_INS_CHANGE_KEY:
+                status = cemu_change_key(app, cmd, len);
+                break;
+            case DF_INS_CHANGE_KEY_SETTINGS:
+                status = cemu_change_key_settings(app, cmd, len);
+                break;
+            case DF_INS_GET_KEY_VERSION:
+                if(len != 2)
+                    status = ST_WrongCommandLen;
+                else if((cmd[1] & 0x0F) >= app->key_count)
+                    status = ST_KeyDoesNotExist;
+                else {
+                    out[n++] = cemu_key_version(app, cmd[1] & 0x0F);
+                    status = ST_Success;
+                }
+                break;
+            case DF_INS_GET_KEY_SETTINGS:
+                out[n++] = app->settings;
+                out[n++] = app->key_count | app->key_type;
+                status = ST_Success;
+                break;
+            case DF_INS_SELECT_APPLICATION:
+                status = cemu_select_application(card, cmd, len);
+                break;
+            case DF_INS_GET_APPLICATION_IDS:
+                status = cemu_application_ids(card, out, &n);
+                break;
+            case DF_INS_CREATE_APPLICATION:
+                status = cemu_create_application(card, cmd, len);
+                break;
+            case DF_INS_DELETE_APPLICATION:
+                status = cemu_delete_application(card, cmd, len);
+                break;
+            case DF_INS_CREATE_STD_DATA_FILE:
+                status = cemu_create_file(app, cmd, len);
+                break;
+            case DF_INS_READ_DATA:
+                status = cemu_read_data(app, cmd, len, out, &n);
+                break;
+            case DF_INS_WRITE_DATA:
+                status = cemu_write_data(app, cmd, len);
+                break;
+            default:
+                status = ST_IllegalCommand;
+                break;
+        }
+    }
+
+    // Any error ends the authentication
+    if(status != ST_Success && status != ST_MoreFrames) {
+        cemu_session.auth_key = CEMU_NOT_AUTH;
+        cemu_session.auth_cmd = 0;
+        n = 0;
+    }
+
+    rsp[0] = status;
+    if(status == ST_Success && mac && cemu_session.auth_key != CEMU_NOT_AUTH) {
+        uint8_t rx_mac[16];
+        cemu_cmac(out, n, &rsp[0], rx_mac);
+        memcpy(out + n, rx_mac, 8);     // also the AES CMAC is sent with 8 bytes
+        n += 8;
+    }
+    return n + 1;
+}
+
+//----------------------------------------------//
+// PN532                                        //
+//----------------------------------------------//
+void cemu_push(const uint8_t frame[], uint8_t len) {
+    if(cemu_out_count >= 2) {
+        cemu_violation("Response queue overflow", len);
+        return;
+    }
+    memcpy(cemu_out[cemu_out_count], frame, len);
+    cemu_out_len[cemu_out_count] = len;
+    cemu_out_count++;
+}
+
+void cemu_respond(const uint8_t data[], uint8_t len) {
+    uint8_t frame[CEMU_FRAME_SIZE];
+    uint8_t sum = PN532_PN532TOHOST;
+    frame[0] = PN532_PREAMBLE;
+    frame[1] = PN532_STARTCODE1;
+    frame[2] = PN532_STARTCODE2;
+    frame[3] = len + 1;
+    frame[4] = 0x100 - (len + 1);
+    frame[5] = PN532_PN532TOHOST;
+    for(uint8_t i = 0; i < len; i++) {
+        frame[6 + i] = data[i];
+        sum += data[i];
+    }
+    frame[6 + len] = 0x100 - sum;
+    frame[7 + len] = PN532_POSTAMBLE;
+    cemu_push(frame, len + 8);
+}
+
+// Tag number, ATQA, SAK, UID and ATS of a DESFire EV1 with 7 byte UID
+uint8_t cemu_target_data(uint8_t out[]) {
+    const uint8_t ats[] = { 0x06, 0x75, 0x77, 0x81, 0x02, 0x80 };
+    uint8_t n = 0;
+    out[n++] = 1;
+    out[n++] = 0x03;
+    out[n++] = 0x44;
+    out[n++] = 0x20;
+    out[n++] = 7;
+    memcpy(out + n, cemu_cards[cemu_field_card].uid, 7);
+    n += 7;
+    memcpy(out + n, ats, sizeof(ats));
+    return n + sizeof(ats);
+}
+
+void cemu_activate() {
+    cemu_target_card = cemu_field_card;
+    memset(&cemu_session, 0, sizeof(cemu_session));
+    cemu_session.auth_key = CEMU_NOT_AUTH;
+}
+
+void cemu_reader_command(const uint8_t cmd[], uint8_t len) {
+    uint8_t rsp[CEMU_FRAME_SIZE];
+    uint8_t n = 0;
+    rsp[n++] = cmd[0] + 1;
+
+    switch(cmd[0]) {
+        case PN532_COMMAND_GETFIRMWAREVERSION:
+            rsp[n++] = 0x32;    // PN532
+            rsp[n++] = 1;       // firmware 1.6
+            rsp[n++] = 6;
+            rsp[n++] = 0x07;    // ISO 14443A, ISO 14443B, ISO 18092
+            break;
+        case PN532_COMMAND_SAMCONFIGURATION:
+        case PN532_COMMAND_WRITEGPIO:
+            break;
+        case PN532_COMMAND_RFCONFIGURATION:
+            // Without the field the card loses its selection and authentication
+            if(len >= 3 && cmd[1] == 1 && !(cmd[2] & 0x01))
+                cemu_target_card = CEMU_NO_CARD;
+            break;
+        case PN532_COMMAND_INLISTPASSIVETARGET:
+            if(cemu_field_card == CEMU_NO_CARD)
+                rsp[n++] = 0;
+            else {
+                rsp[n++] = 1;
+                cemu_activate();
+                n += cemu_target_data(rsp + n);
+            }
+            break;
+        case PN532_COMMAND_INAUTOPOLL:
+            // Answered by cemu_ready() as soon as a card is in the field
+            cemu_autopoll = true;
+            return;
+        case PN532_COMMAND_DIAGNOSE:
+            rsp[n++] = (cemu_target_card < CEMU_MAX_CARDS && cemu_target_card == cemu_field_card) ? 0x00 : 0x01;
+            break;
+        case PN532_COMMAND_INDATAEXCHANGE:
+            if(cemu_target_card == CEMU_NO_CARD)
+                rsp[n++] = 0x27;    // Command not acceptable
+            else if(cemu_target_card != cemu_field_card)
+                rsp[n++] = 0x01;    // Timeout
+            else {
+                rsp[n++] = 0x00;
+                n += cemu_card_command(&cemu_cards[cemu_target_card], cmd + 2, len - 2, rsp + n);
+                cemu_stats.card_frames++;
+                cemu_stats.card_bytes += len - 2 + n - 2;
+            }
+            break;
+        case PN532_COMMAND_INRELEASE:
+        case PN532_COMMAND_INDESELECT:
+            cemu_target_card = CEMU_NO_CARD;
+            rsp[n++] = 0x00;
+            break;
+        default: {
+            // Syntax error frame of the PN532
+            const uint8_t error[] = { 0x00, 0x00, 0xFF, 0x01, 0xFF, 0x7F, 0x81, 0x00 };
+            cemu_violation("Unknown PN532 command", cmd[0]);
+            cemu_push(error, sizeof(error));
+            return;
+        }
+    }
+    cemu_respond(rsp, n);
+}
+
+//----------------------------------------------//
+// Global interfaces                            //
+//----------------------------------------------//
+void cemu_reader_reset() {
+    cemu_out_count = 0;
+    cemu_autopoll = false;
+    cemu_target_card = CEMU_NO_CARD;
+}
+
+void cemu_write(const uint8_t frame[], uint8_t len) {
+    cemu_stats.host_frames++;
+    cemu_stats.host_bytes += len;
+
+    int start = -1;
+    for(int i = 0; i + 1 < len; i++) {
+        if(frame[i] == PN532_STARTCODE1 && frame[i + 1] == PN532_STARTCODE2) {
+            start = i;
+            break;
+        }
+    }
+    if(start < 0 || start + 4 > len)
+        return;     // wake up bytes
+
+    // An ACK from the host aborts the running command
+    uint8_t data_len = frame[start + 2];
+    if(data_len == 0 && frame[start + 3] == 0xFF) {
+        cemu_out_count = 0;
+        cemu_autopoll = false;
+        return;
+    }
+
+    const uint8_t *data = frame + start + 4;
+    uint8_t sum = 0;
+    for(uint8_t i = 0; i <= data_len && start + 4 + i < len; i++)
+        sum += data[i];
+    if((uint8_t) (data_len + frame[start + 3]) != 0 || start + 5 + data_len > len || sum != 0 || data_len < 2 || data[0] != PN532_HOSTTOPN532) {
+        cemu_violation("Invalid frame", data_len);
+        return;
+    }
+    if(cemu_out_count > 0 || cemu_autopoll)
+        cemu_violation("Command while a response is pending", data[1]);
+
+    const uint8_t ack[] = { 0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00 };
+    cemu_out_count = 0;
+    cemu_autopoll = false;
+    cemu_push(ack, sizeof(ack));
+    cemu_reader_command(data + 1, data_len - 1);
+}
+
+void cemu_read(uint8_t buf[], uint8_t len) {
+    cemu_stats.reader_frames++;
+    cemu_stats.reader_bytes += len;
+
+    memset(buf, 0, len);
+    if(!cemu_ready()) {
+        cemu_violation("Read without a response", len);
+        return;
+    }
+
+    memcpy(buf, cemu_out[0], min(len, cemu_out_len[0]));
+    cemu_out_count--;
+    if(cemu_out_count > 0) {
+        memcpy(cemu_out[0], cemu_out[1], cemu_out_len[1]);
+        cemu_out_len[0] = cemu_out_len[1];
+    }
+}
+
+bool cemu_ready() {
+    if(cemu_out_count == 0 && cemu_autopoll && cemu_field_card != CEMU_NO_CARD) {
+        uint8_t rsp[CEMU_FRAME_SIZE];
+        uint8_t n = 0;
+        rsp[n++] = PN532_COMMAND_INAUTOPOLL + 1;
+        rsp[n++] = 1;       // one target
+        rsp[n++] = 0x20;    // Passive 106 kbps ISO/IEC14443-4A
+        cemu_activate();
+        uint8_t target_len = cemu_target_data(rsp + n + 1);
+        rsp[n++] = target_len;
+        n += target_len;
+        cemu_autopoll = false;
+        cemu_respond(rsp, n);
+    }
+    return cemu_out_count > 0;
+}
+
+bool cemu_read_status() {
+    cemu_stats.status_reads++;
+    return cemu_ready();
+}
+
+void cemu_card_blank(uint8_t card, uint32_t uid_seed) {
+    sCemuCard *c = &cemu_cards[card];
+    memset(c, 0, sizeof(*c));
+    c->uid[0] = 0x04;   // NXP
+    for(uint8_t i = 1; i < 7; i++, uid_seed >>= 5)
+        c->uid[i] = uid_seed ^ (i * 0x3B);
+
+    // Factory default: DES PICC master key with zeroes, everything allowed
+    c->apps[0].used = true;
+    c->apps[0].settings = KS_FACTORY_DEFAULT;
+    c->apps[0].key_type = DF_KEY_2K3DES;
+    c->apps[0].key_count = 1;
+}
+
+void cemu_card_insert(uint8_t card) {
+    cemu_field_card = card;
+}
+
+void cemu_card_remove() {
+    cemu_field_card = CEMU_NO_CARD;
+    if(cemu_target_card != CEMU_NO_CARD)
+        cemu_target_card = CEMU_LOST_CARD;
+}
+
+void cemu_get_stats(sCemuStats *stats) {
+    *stats = cemu_stats;
+}
+
+//----------------------------------------------//
+// Scenarios                                    //
+//----------------------------------------------//
+void cemu_done_callback() {
+    cemu_done = true;
+}
+
+void cemu_phase_begin(const char name[]) {
+    cemu_phase = name;
+    cemu_phase_stats = cemu_stats;
+}
+
+void cemu_phase_end() {
+    char text[128];
+    sprintf(text, "%-13s bus: %3lu frames out %4lu bytes, %3lu frames in %4lu bytes, %3lu status reads; air: %2lu commands %4lu bytes",
+            cemu_phase,
+            (unsigned long) (cemu_stats.host_frames - cemu_phase_stats.host_frames),
+            (unsigned long) (cemu_stats.host_bytes - cemu_phase_stats.host_bytes),
+            (unsigned long) (cemu_stats.reader_frames - cemu_phase_stats.reader_frames),
+            (unsigned long) (cemu_stats.reader_bytes - cemu_phase_stats.reader_bytes),
+            (unsigned long) (cemu_stats.status_reads - cemu_phase_stats.status_reads),
+            (unsigned long) (cemu_stats.card_frames - cemu_phase_stats.card_frames),
+            (unsigned long) (cemu_stats.card_bytes - cemu_phase_stats.card_bytes));
+    log(LL_INFO, LM_CEMU, text);
+}
+
+void cemu_tap(const char name[], uint8_t card, uint32_t expected) {
+    cemu_card_insert(card);
+    cemu_phase_begin(name);
+    rfid_run();
+    cemu_phase_end();
+    cemu_expect(rfid_member_present() == expected, "Wrong member present", rfid_member_present());
+}
+
+void cemu_leave() {
+    cemu_card_remove();
+    rfid_run();
+    cemu_expect(rfid_member_present() == 0, "Member present without card", rfid_member_present());
+}
+
+uint8_t* cemu_file_data(sCemuCard *card, uint32_t aid, uint8_t file_id, uint8_t size) {
+    sCemuApp *app = cemu_find_app(card, aid);
+    sCemuFile *file = app ? cemu_find_file(app, file_id) : 0;
+    if(file == 0 || file->size != size)
+        return 0;
+    return file->data;
+}
+
+// Checks the layouts written by rfid_program_card()
+void cemu_check_programmed(sCemuCard *card, uint32_t membId, uint32_t cardId) {
+    cemu_expect(cemu_key_version(&card->apps[0], 0) == CARD_KEY_VERSION, "PICC key version", cemu_key_version(&card->apps[0], 0));
+
+    uint8_t *fast = cemu_file_data(card, CARD_FAST_APPLICATION_ID, CARD_FAST_FILE_ID, 8);
+    uint8_t *legacy = cemu_file_data(card, CARD_APPLICATION_ID, CARD_FILE_ID, 16);
+    cemu_expect(fast || legacy, "No layout written", 0);
+
+    if(fast) {
+        uint32_t ids[2];
+        memcpy(ids, fast, 8);
+        cemu_expect(ids[0] == membId && ids[1] == cardId, "Fast-tap ids", ids[0]);
+    }
+    if(legacy) {
+        for(uint8_t i = 8; i > 0; i--, cardId /= 10, membId /= 10) {
+            cemu_expect(legacy[i - 1] == cardId % 10, "Legacy card id digit", legacy[i - 1]);
+            cemu_expect(legacy[i + 7] == membId % 10, "Legacy member id digit", legacy[i + 7]);
+        }
+    }
+}
+
+uint32_t cemu_batch_membId, cemu_batch_cardId;
+uint8_t cemu_batch_left;
+
+bool cemu_batch_next(uint32_t* membId, uint32_t* cardId) {
+    if(cemu_batch_left == 0)
+        return false;
+    *membId = cemu_batch_membId;
+    *cardId = cemu_batch_cardId;
+    return true;
+}
+
+void cemu_batch_done(uint32_t membId, uint32_t cardId, bool success) {
+    cemu_expect(success, "Batch programming failed", membId);
+    cemu_batch_left--;
+}
+
+void cemu_run(uint32_t seed) {
+    log(LL_DEBUG, LM_CEMU, "cemu_run");
+
+    assertRtn(!PN532_CARD_EMULATOR, LL_WARNING, LM_CEMU, "PN532_CARD_EMULATOR is not set. Card emulation skipped.");
+
+    log(LL_INFO, LM_CEMU, "Start card emulation. Seed:", seed);
+
+    // Keep the logger quiet, the expected errors of the foreign card are still shown
+    eLogLevel levels[LM_CEMU + 1];
+    for(uint8_t m = 0; m <= LM_CEMU; m++) {
+        levels[m] = getLogLevel((eLogModule) m);
+        setLogLevel((eLogModule) m, LL_WARNING);
+    }
+    setLogLevel(LM_CEMU, levels[LM_CEMU]);
+
+    cemu_rng = (seed != 0) ? seed : 0x2545F491;
+    cemu_violation_count = 0;
+    cemu_phase = "setup";
+    memset(&cemu_stats, 0, sizeof(cemu_stats));
+
+    // The first member with a card is programmed
+    uint32_t membId = 1;
+    uint32_t cardId = 1;
+    for(uint32_t idx = 0; ; idx++) {
+        sMember *member = dh_get_member_from_idx(idx);
+        if(member == 0)
+            break;
+        if(member->card_id != 0) {
+            membId = member->id;
+            cardId = member->card_id;
+            break;
+        }
+    }
+    uint32_t expected = dh_is_authorised(membId, cardId) ? membId : 0;
+    assertCnt(expected == 0, LL_WARNING, LM_CEMU, "No member with a card loaded. Taps will be rejected.");
+
+    cemu_card_blank(CEMU_MEMBER_CARD, cemu_rng_next());
+    cemu_card_blank(CEMU_FOREIGN_CARD, cemu_rng_next());
+    cemu_card_remove();
+
+    cemu_phase_begin("idle");
+    rfid_run();
+    cemu_phase_end();
+    cemu_expect(rfid_member_present() == 0, "Member present without card", rfid_member_present());
+
+    cemu_done = false;
+    rfid_program_card_async(membId, cardId, &cemu_done_callback);
+    cemu_tap("program", CEMU_MEMBER_CARD, 0);
+    cemu_expect(cemu_done, "Programming not finished", 0);
+    cemu_check_programmed(&cemu_cards[CEMU_MEMBER_CARD], membId, cardId);
+    cemu_leave();
+
+    // The same card without the fast-tap application, as written by readers before it
+    cemu_cards[CEMU_LEGACY_CARD] = cemu_cards[CEMU_MEMBER_CARD];
+    cemu_cards[CEMU_LEGACY_CARD].uid[6] ^= 0xFF;
+    sCemuApp *fast = cemu_find_app(&cemu_cards[CEMU_LEGACY_CARD], CARD_FAST_APPLICATION_ID);
+    if(fast)
+        fast->used = false;
+
+    cemu_tap("tap", CEMU_MEMBER_CARD, expected);
+    cemu_phase_begin("session");
+    rfid_run();
+    cemu_phase_end();
+    cemu_expect(rfid_member_present() == expected, "Member lost in session", rfid_member_present());
+    cemu_phase_begin("removal");
+    cemu_leave();
+    cemu_phase_end();
+
+    if(cemu_find_app(&cemu_cards[CEMU_LEGACY_CARD], CARD_APPLICATION_ID)) {
+        cemu_tap("tap legacy", CEMU_LEGACY_CARD, expected);
+        cemu_leave();
+    } else
+        log(LL_INFO, LM_CEMU, "No legacy layout written. Legacy tap skipped.");
+
+    cemu_tap("foreign card", CEMU_FOREIGN_CARD, 0);
+    cemu_leave();
+
+    cemu_done = false;
+    rfid_restore_card_async(&cemu_done_callback);
+    cemu_tap("restore", CEMU_MEMBER_CARD, 0);
+    cemu_expect(cemu_done, "Restore not finished", 0);
+    sCemuCard *card = &cemu_cards[CEMU_MEMBER_CARD];
+    cemu_expect(cemu_key_version(&card->apps[0], 0) == 0 && cemu_des_single(card->apps[0].keys[0].data), "PICC key not restored", card->apps[0].key_type);
+    cemu_expect(!cemu_find_app(card, CARD_APPLICATION_ID) && !cemu_find_app(card, CARD_FAST_APPLICATION_ID), "Applications not deleted", 0);
+    cemu_leave();
+
+    cemu_tap("restored tap", CEMU_MEMBER_CARD, 0);
+    cemu_leave();
+
+    // Batch programming: a blank card, then the same card again with the PICC master key already set.
+    // A card is programmed only once while it stays in the field.
+    cemu_batch_membId = membId;
+    cemu_batch_cardId = cardId;
+    cemu_batch_left = 2;
+    rfid_program_batch_start(&cemu_batch_next, &cemu_batch_done);
+    cemu_tap("batch blank", CEMU_FOREIGN_CARD, 0);
+    cemu_phase_begin("batch wait");
+    rfid_run();
+    cemu_phase_end();
+    cemu_expect(cemu_batch_left == 1, "Batch card not programmed once", cemu_batch_left);
+    cemu_leave();
+    cemu_tap("batch again", CEMU_FOREIGN_CARD, 0);
+    cemu_expect(cemu_batch_left == 0, "Batch card not programmed", cemu_batch_left);
+    cemu_leave();
+    rfid_program_batch_stop();
+    cemu_check_programmed(&cemu_cards[CEMU_FOREIGN_CARD], membId, cardId);
+    cemu_tap("batch tap", CEMU_FOREIGN_CARD, expected);
+    cemu_leave();
+
+    for(uint8_t m = 0; m <= LM_CEMU; m++)
+        setLogLevel((eLogModule) m, levels[m]);
+
+    char text[128];
+    cemu_phase = "total";
+    memset(&cemu_phase_stats, 0, sizeof(cemu_phase_stats));
+    log(LL_INFO, LM_CEMU, "Card emulation finished.");
+    cemu_phase_end();
+
+    sprintf(text, "Violations: %lu", (unsigned long) cemu_violation_count);
+    if(cemu_violation_count > 0)
+        log(LL_WARNING, LM_CEMU, text);
+    else
+        log(LL_INFO, LM_CEMU, text);
+}
+
+uint32_t cemu_violations() {
+    return cemu_violation_count;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <Arduino.h>
+
+/**
+ * Emulated PN532 with a DESFire EV1 card in its field.
+ *
+ * With PN532_CARD_EMULATOR (see PN532.h) the PN532 class talks to this module instead of the SPI bus,
+ * so PN532, Desfire and rfid.cpp run unchanged without reader and card.
+ * The card knows applications, standard data files, keys, DES/AES authentication and the CMAC of the session.
+ * Frames and bytes are counted on the bus and over the air: protocol changes can be compared without timing noise.
+ **/
+
+struct sCemuStats {
+    uint32_t host_frames;       // frames written to the PN532 (commands and ACKs)
+    uint32_t host_bytes;
+    uint32_t reader_frames;     // frames read from the PN532 (ACKs and responses)
+    uint32_t reader_bytes;
+    uint32_t status_reads;      // ready checks over the bus
+    uint32_t card_frames;       // DESFire commands over the air
+    uint32_t card_bytes;        // DESFire commands and responses
+};
+
+// PN532 side, called by the PN532 class
+void cemu_reader_reset();
+void cemu_write(const uint8_t frame[], uint8_t len);
+void cemu_read(uint8_t buf[], uint8_t len);
+bool cemu_ready();          // IRQ line
+bool cemu_read_status();    // status byte over the bus
+
+// Cards
+void cemu_card_blank(uint8_t card, uint32_t uid_seed);
+void cemu_card_insert(uint8_t card);
+void cemu_card_remove();
+
+void cemu_get_stats(sCemuStats *stats);
+
+/**
+ * Scripted RFID scenarios: programming, fast and legacy taps, card session, removal, foreign card and restore.
+ * Runs rfid_run() against the emulated card and checks the member detection and the card content.
+ * Must run after rfid_init() with PN532_CARD_EMULATOR set.
+ **/
+void cemu_run(uint32_t seed);
+
+uint32_t cemu_violations();
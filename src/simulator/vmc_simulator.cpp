@@ -0,0 +1,684 @@
+#include "vmc_simulator.h"
+#include "../cashless_device/cashless_device.h"
+#include "../mdb/mdb.h"
+#include "../rfid/rfid.h"
+#include "../periphery/periphery.h"
+#include "../data_handler/data_handler.h"
+#include "../util/error.h"
+#include <stdlib.h>
+
+#define VSIM_TRANSACTION_FILE "SIMTRANS.DB"
+
+#define VSIM_MAX_SAMPLES    1024
+#define VSIM_MAX_RESPONSES  4
+#define VSIM_MAX_REPORTS    8       // Only the first violations are logged in detail
+
+#define VSIM_RSP_NONE   0xFFFF
+#define VSIM_RSP_ACK    0xFFFE
+#define VSIM_RSP_NACK   0xFFFD
+
+#define RSP_JUST_RESET      0x00
+#define RSP_READER_CONFIG   0x01
+#define RSP_DISPLAY_REQUEST 0x02
+#define RSP_BEGIN_SESSION   0x03
+#define RSP_SESSION_CANCEL  0x04
+#define RSP_VEND_APPROVED   0x05
+#define RSP_VEND_DENIED     0x06
+#define RSP_END_SESSION     0x07
+#define RSP_CANCELLED       0x08
+#define RSP_PERIPHERAL_ID   0x09
+#define RSP_OUT_OF_SEQUENCE 0x0B
+
+// The view of the VMC on the cashless device
+enum eVmcState {
+    VS_Inactive,
+    VS_Disabled,
+    VS_Enabled,
+    VS_Session,
+    VS_Requested,   // vend request acknowledged, answer comes with a POLL
+    VS_Vending
+};
+
+struct sVmcResponse {
+    uint8_t type;
+    uint8_t len;
+    uint8_t data[64];
+};
+
+struct sLatency {
+    uint32_t samples[VSIM_MAX_SAMPLES];
+    uint32_t count;
+    uint32_t max;
+};
+
+eVmcState vmc_state;
+sVmcResponse responses[VSIM_MAX_RESPONSES];
+uint8_t response_count;
+
+uint32_t rng_state;
+uint32_t vsim_member_ids[8];
+uint8_t vsim_member_count;
+
+sLatency cmd_latency;
+sLatency loop_latency;
+sLatency vend_latency;
+
+uint32_t cmd_count;
+uint32_t session_count;
+uint32_t vend_approved_count;
+uint32_t vend_denied_count;
+uint32_t violation_count;
+const char *scenario;
+uint16_t requested_price;
+uint32_t request_start;
+
+// What the reader offered in its READER CONFIG
+uint8_t offered_level;
+bool offered_multivend;
+
+//----------------------------------------------//
+// Bus and RFID stand-ins                       //
+//----------------------------------------------//
+void vsim_tx_hook(uint8_t type, uint8_t len, const uint8_t data[]) {
+    if(response_count < VSIM_MAX_RESPONSES) {
+        sVmcResponse *rsp = &responses[response_count];
+        rsp->type = type;
+        rsp->len = (len < sizeof(rsp->data)) ? len : sizeof(rsp->data);
+        if(rsp->len > 0)
+            memcpy(rsp->data, data, rsp->len);
+    }
+    response_count++;
+}
+
+// The loop notices a card change long before the next POLL, so let it run right away
+void card_tap(uint32_t membId) {
+    rfid_simulate_member(true, membId);
+    cldev_run();
+}
+
+void card_remove() {
+    rfid_simulate_member(true, 0);
+    cldev_run();
+}
+
+uint32_t rng_next() {
+    // xorshift32: deterministic for a given seed, so failing runs can be replayed
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+uint32_t rng_range(uint32_t lo, uint32_t hi) {
+    return lo + (rng_next() % (hi - lo + 1));
+}
+
+bool rng_chance(uint8_t percent) {
+    return (rng_next() % 100) < percent;
+}
+
+//----------------------------------------------//
+// Statistics                                   //
+//----------------------------------------------//
+void latency_reset(sLatency *lat) {
+    lat->count = 0;
+    lat->max = 0;
+}
+
+void latency_add(sLatency *lat, uint32_t us) {
+    // Reservoir sampling keeps the percentiles unbiased for long runs
+    if(lat->count < VSIM_MAX_SAMPLES)
+        lat->samples[lat->count] = us;
+    else {
+        uint32_t idx = rng_next() % (lat->count + 1);
+        if(idx < VSIM_MAX_SAMPLES)
+            lat->samples[idx] = us;
+    }
+    lat->count++;
+    if(us > lat->max)
+        lat->max = us;
+}
+
+int compare_uint32(const void *a, const void *b) {
+    uint32_t va = *((const uint32_t*) a);
+    uint32_t vb = *((const uint32_t*) b);
+    return (va > vb) - (va < vb);
+}
+
+void latency_report(sLatency *lat, const char name[]) {
+    if(lat->count == 0) {
+        log(LL_INFO, LM_VSIM, name, "no samples");
+        return;
+    }
+
+    uint32_t n = (lat->count < VSIM_MAX_SAMPLES) ? lat->count : VSIM_MAX_SAMPLES;
+    qsort(lat->samples, n, sizeof(uint32_t), compare_uint32);
+
+    char text[96];
+    sprintf(text, "%s latency [us]: p50 %lu, p90 %lu, p99 %lu, max %lu (%lu samples)", name,
+            (unsigned long) lat->samples[(n * 50) / 100], (unsigned long) lat->samples[(n * 90) / 100],
+            (unsigned long) lat->samples[(n * 99) / 100], (unsigned long) lat->max, (unsigned long) lat->count);
+    log(LL_INFO, LM_VSIM, text);
+}
+
+void violation(const char msg[], uint16_t rsp) {
+    violation_count++;
+    if(violation_count <= VSIM_MAX_REPORTS) {
+        char text[96];
+        sprintf(text, "Protocol violation in '%s': %s (response 0x%04X)", scenario, msg, rsp);
+        log(LL_WARNING, LM_VSIM, text);
+    }
+}
+
+//----------------------------------------------//
+// VMC side of the protocol                     //
+//----------------------------------------------//
+uint16_t send(uint8_t cmd, uint8_t scmd, uint8_t payload_len, const uint8_t payload[]) {
+    uint8_t data[64];
+    uint8_t len = 0;
+
+    // Frame the block exactly like mdb_read does, so the length tables are exercised as well
+    if(cldev_cmd_len(cmd) > 0) {
+        data[len++] = scmd;
+        uint8_t scmd_len = cldev_scmd_len(cmd, scmd);
+        if(scmd_len != payload_len)
+            violation("Length table does not match the MDB block", scmd_len);
+        for(uint8_t i = 0; i < scmd_len && len < sizeof(data); i++)
+            data[len++] = (i < payload_len) ? payload[i] : 0x00;
+    }
+
+    response_count = 0;
+
+    // Interrupt part: this is what the VMC waits for
+    uint32_t start = micros();
+    cldev_receive(cmd, data);
+    uint32_t elapsed = micros() - start;
+
+    cmd_count++;
+    latency_add(&cmd_latency, elapsed);
+
+    // Loop part: runs between two VMC commands
+    start = micros();
+    cldev_run();
+    latency_add(&loop_latency, micros() - start);
+
+    if(response_count == 0) {
+        violation("No response to command", cmd);
+        return VSIM_RSP_NONE;
+    }
+    if(response_count > 1)
+        violation("More than one response to a single command", cmd);
+
+    if(responses[0].type == MDB_TX_ACK)
+        return VSIM_RSP_ACK;
+    if(responses[0].type == MDB_TX_NACK)
+        return VSIM_RSP_NACK;
+    if(responses[0].len == 0) {
+        violation("Empty data block", cmd);
+        return VSIM_RSP_NONE;
+    }
+    return responses[0].data[0];
+}
+
+void expect(uint16_t rsp, uint16_t expected, const char msg[]) {
+    if(rsp != expected)
+        violation(msg, rsp);
+}
+
+void vend_answer(uint16_t rsp) {
+    if(vmc_state != VS_Requested) {
+        violation("VEND APPROVED or DENIED without a vend request", rsp);
+        return;
+    }
+    latency_add(&vend_latency, micros() - request_start);
+
+    if(rsp == RSP_VEND_APPROVED) {
+        vend_approved_count++;
+        if(responses[0].len < 3)
+            violation("VEND APPROVED too short", rsp);
+        else if(((((uint16_t) responses[0].data[1]) << 8) + responses[0].data[2]) > requested_price)
+            violation("Approved price is higher than the requested price", rsp);
+        vmc_state = VS_Vending;
+    } else {
+        vend_denied_count++;
+        vmc_state = VS_Session;
+    }
+}
+
+void vmc_session_complete() {
+    uint16_t rsp = send(CMD_VEND, SCMD_VEND_COMPLETE, 0, 0);
+    expect(rsp, RSP_END_SESSION, "SESSION COMPLETE must be answered with END SESSION");
+    vmc_state = VS_Enabled;
+}
+
+uint16_t vmc_poll() {
+    uint16_t rsp = send(CMD_POLL, 0, 0, 0);
+
+    switch(rsp) {
+        case VSIM_RSP_ACK:
+        case RSP_JUST_RESET:
+        case RSP_DISPLAY_REQUEST:
+            break;
+
+        case RSP_BEGIN_SESSION:
+            if(vmc_state != VS_Enabled)
+                violation("BEGIN SESSION while not enabled or already in session", rsp);
+            else if(responses[0].len < 3)
+                violation("BEGIN SESSION too short", rsp);
+            session_count++;
+            vmc_state = VS_Session;
+            break;
+
+        case RSP_VEND_APPROVED:
+        case RSP_VEND_DENIED:
+            vend_answer(rsp);
+            break;
+
+        case RSP_SESSION_CANCEL:
+            if(vmc_state != VS_Session && vmc_state != VS_Vending)
+                violation("SESSION CANCEL REQUEST outside of a session", rsp);
+            else
+                vmc_session_complete();
+            break;
+
+        default:
+            violation("Unexpected POLL response", rsp);
+    }
+    return rsp;
+}
+
+void vmc_idle_polls(uint8_t max) {
+    uint8_t n = rng_range(0, max);
+    for(uint8_t i = 0; i < n; i++) {
+        if(vmc_poll() == RSP_SESSION_CANCEL)
+            return;
+    }
+}
+
+void vmc_reset() {
+    uint16_t rsp = send(CMD_RESET, 0, 0, 0);
+    expect(rsp, VSIM_RSP_ACK, "RESET must be acknowledged");
+    vmc_state = VS_Inactive;
+
+    rsp = vmc_poll();
+    if(rsp != VSIM_RSP_ACK && rsp != RSP_JUST_RESET)
+        violation("First POLL after RESET must be ACK or JUST RESET", rsp);
+}
+
+void vmc_setup() {
+    const uint8_t config[4] = { 0x03, 16, 2, 0x01 };        // Level 3, 16x2 display, full ASCII
+    uint16_t rsp = send(CMD_SETUP, SCMD_SETUP_CONFIG, sizeof(config), config);
+    expect(rsp, RSP_READER_CONFIG, "SETUP CONFIG must be answered with READER CONFIG");
+    offered_level = 1;
+    offered_multivend = false;
+    if(rsp == RSP_READER_CONFIG) {
+        if(responses[0].len != 8)
+            violation("READER CONFIG must be 8 bytes", responses[0].len);
+        offered_level = responses[0].data[1];
+        offered_multivend = (responses[0].data[7] & 0x02) > 0;
+        if(offered_level < 1 || offered_level > config[0])
+            violation("Reader level must be between 1 and the VMC level", offered_level);
+    }
+
+    const uint8_t prices[4] = { 0xFF, 0xFF, 0x00, 0x00 };   // Max. price unknown, min. price 0
+    rsp = send(CMD_SETUP, SCMD_SETUP_PRICES, sizeof(prices), prices);
+    expect(rsp, VSIM_RSP_ACK, "SETUP PRICES must be acknowledged");
+
+    uint8_t vmc_id[29];
+    memcpy(vmc_id, "SIM000000000001VMCSIMULATOR", 27);
+    vmc_id[27] = 0x01;
+    vmc_id[28] = 0x00;
+    rsp = send(CMD_EXPANSION, SCMD_EXPANSION_ID, sizeof(vmc_id), vmc_id);
+    expect(rsp, RSP_PERIPHERAL_ID, "EXPANSION REQUEST ID must be answered with PERIPHERAL ID");
+    if(rsp == RSP_PERIPHERAL_ID && responses[0].len != ((offered_level >= 3) ? 34 : 30))
+        violation("PERIPHERAL ID length does not match the reader level", responses[0].len);
+
+    // Level 3: enable the optional features the reader offers
+    if(offered_level >= 3 && rsp == RSP_PERIPHERAL_ID) {
+        rsp = send(CMD_EXPANSION, SCMD_EXPANSION_FEATURES, 4, &responses[0].data[30]);
+        expect(rsp, VSIM_RSP_ACK, "OPTIONAL FEATURE ENABLED must be acknowledged");
+    }
+
+    vmc_state = VS_Disabled;
+}
+
+void vmc_enable() {
+    uint16_t rsp = send(CMD_READER, SCMD_READER_ENABLE, 0, 0);
+    expect(rsp, VSIM_RSP_ACK, "READER ENABLE must be acknowledged");
+    vmc_state = VS_Enabled;
+}
+
+void vmc_disable() {
+    uint16_t rsp = send(CMD_READER, SCMD_READER_DISABLE, 0, 0);
+    expect(rsp, VSIM_RSP_ACK, "READER DISABLE must be acknowledged");
+    vmc_state = VS_Disabled;
+}
+
+void vmc_reader_cancel() {
+    uint16_t rsp = send(CMD_READER, SCMD_READER_CANCEL, 0, 0);
+    expect(rsp, RSP_CANCELLED, "READER CANCEL must be answered with CANCELLED");
+}
+
+bool vmc_begin_session() {
+    // The VMC polls until the tapped card shows up as a session
+    for(uint8_t i = 0; i < 4; i++) {
+        vmc_poll();
+        if(vmc_state == VS_Session)
+            return true;
+    }
+    violation("No BEGIN SESSION although a member is present", VSIM_RSP_NONE);
+    return false;
+}
+
+bool vmc_vend_request(uint16_t item, uint16_t price) {
+    uint8_t payload[4];
+    payload[0] = price >> 8;
+    payload[1] = price & 0xFF;
+    payload[2] = item >> 8;
+    payload[3] = item & 0xFF;
+
+    requested_price = price;
+    request_start = micros();
+    vmc_state = VS_Requested;
+
+    // The answer may come right away or with one of the next POLLs
+    uint16_t rsp = send(CMD_VEND, SCMD_VEND_REQUEST, sizeof(payload), payload);
+    if(rsp == RSP_VEND_APPROVED || rsp == RSP_VEND_DENIED)
+        vend_answer(rsp);
+    else
+        expect(rsp, VSIM_RSP_ACK, "VEND REQUEST must be answered with ACK, VEND APPROVED or DENIED");
+
+    for(uint8_t i = 0; i < 8 && vmc_state == VS_Requested; i++)
+        vmc_poll();
+
+    if(vmc_state == VS_Requested) {
+        violation("No answer to VEND REQUEST", VSIM_RSP_NONE);
+        vmc_state = VS_Session;
+    }
+    return vmc_state == VS_Vending;
+}
+
+void vmc_vend_result(bool success, uint16_t item) {
+    uint16_t rsp;
+    if(success) {
+        uint8_t payload[2] = { (uint8_t) (item >> 8), (uint8_t) (item & 0xFF) };
+        rsp = send(CMD_VEND, SCMD_VEND_SUCCESS, sizeof(payload), payload);
+        expect(rsp, VSIM_RSP_ACK, "VEND SUCCESS must be acknowledged");
+    } else {
+        rsp = send(CMD_VEND, SCMD_VEND_FAILURE, 0, 0);
+        expect(rsp, VSIM_RSP_ACK, "VEND FAILURE must be acknowledged");
+    }
+    vmc_state = VS_Session;
+}
+
+uint32_t random_member() {
+    if(vsim_member_count == 0)
+        return 1;   // Unknown member, every vend will be denied
+    return vsim_member_ids[rng_next() % vsim_member_count];
+}
+
+uint32_t other_member(uint32_t membId) {
+    for(uint8_t i = 0; i < vsim_member_count; i++) {
+        if(vsim_member_ids[i] != membId)
+            return vsim_member_ids[i];
+    }
+    return membId + 1;  // Unknown member, but still another card
+}
+
+//----------------------------------------------//
+// Scenarios                                    //
+//----------------------------------------------//
+void scenario_power_up() {
+    scenario = "power-up";
+    card_remove();
+    vmc_reset();
+    vmc_setup();
+    vmc_enable();
+    expect(vmc_poll(), VSIM_RSP_ACK, "Idle POLL without card must be acknowledged");
+}
+
+void scenario_vend(bool success) {
+    scenario = success ? "vend success" : "vend failure";
+    card_tap(random_member());
+    if(vmc_begin_session()) {
+        if(vmc_vend_request(1, 100))
+            vmc_vend_result(success, 1);
+        vmc_session_complete();
+    }
+    card_remove();
+    expect(vmc_poll(), VSIM_RSP_ACK, "POLL after session must be acknowledged");
+}
+
+void scenario_card_removed() {
+    scenario = "card removed in session";
+    uint32_t member = random_member();
+    card_tap(member);
+    if(vmc_begin_session()) {
+        if(offered_multivend) {
+            // Further vends while the card stays in the field
+            expect(vmc_poll(), VSIM_RSP_ACK, "Multi-vend session must stay open with the card");
+            if(vmc_vend_request(1, 100))
+                vmc_vend_result(true, 1);
+            else
+                violation("Second vend in multi-vend session was denied", RSP_VEND_DENIED);
+        }
+        card_remove();
+
+        for(uint8_t i = 0; i < 4 && vmc_state != VS_Enabled; i++)
+            vmc_poll();
+        if(vmc_state != VS_Enabled) {
+            violation("Removed card must request SESSION CANCEL", VSIM_RSP_NONE);
+            vmc_session_complete();
+        }
+    }
+
+    // Another member's card ends a multi-vend session as well
+    if(offered_multivend) {
+        card_tap(member);
+        if(vmc_begin_session()) {
+            card_tap(other_member(member));
+            for(uint8_t i = 0; i < 4 && vmc_state != VS_Enabled; i++)
+                vmc_poll();
+            if(vmc_state != VS_Enabled) {
+                violation("Another member's card must request SESSION CANCEL", VSIM_RSP_NONE);
+                vmc_session_complete();
+            }
+        }
+        card_remove();
+        vmc_idle_polls(1);
+    }
+}
+
+void scenario_disabled() {
+    scenario = "disabled reader ignores card";
+    vmc_disable();
+    card_tap(random_member());
+    expect(vmc_poll(), VSIM_RSP_ACK, "Disabled reader must not begin a session");
+    vmc_enable();
+    if(vmc_begin_session())
+        vmc_session_complete();
+    card_remove();
+    vmc_poll();
+}
+
+void scenario_reader_cancel() {
+    scenario = "reader cancel";
+    vmc_reader_cancel();
+    expect(vmc_poll(), VSIM_RSP_ACK, "POLL after READER CANCEL must be acknowledged");
+}
+
+void scenario_reset_in_session() {
+    scenario = "reset in session";
+    card_tap(random_member());
+    vmc_begin_session();
+    card_remove();
+    vmc_reset();
+    vmc_setup();
+    vmc_enable();
+    expect(vmc_poll(), VSIM_RSP_ACK, "Idle POLL after re-setup must be acknowledged");
+}
+
+void scenario_out_of_sequence() {
+    scenario = "commands out of sequence";
+
+    // A vend request outside of a session must still get its answer
+    if(vmc_vend_request(1, 100))
+        violation("VEND APPROVED outside of a session", RSP_VEND_APPROVED);
+    vmc_state = VS_Enabled;
+
+    const uint8_t item[2] = { 0x00, 0x01 };
+    expect(send(CMD_VEND, SCMD_VEND_SUCCESS, sizeof(item), item), VSIM_RSP_ACK, "VEND SUCCESS must be acknowledged");
+    expect(send(CMD_POLL, 0, 0, 0), RSP_OUT_OF_SEQUENCE, "VEND SUCCESS without vend must be reported out of sequence");
+    expect(vmc_poll(), VSIM_RSP_ACK, "Idle POLL after out of sequence must be acknowledged");
+}
+
+void random_session() {
+    scenario = "random session";
+
+    // Rarely the VMC disables the reader or resets the bus between sessions
+    if(rng_chance(2)) {
+        vmc_disable();
+        vmc_idle_polls(2);
+        vmc_enable();
+    }
+    if(rng_chance(1)) {
+        vmc_reset();
+        vmc_setup();
+        vmc_enable();
+    }
+
+    vmc_idle_polls(3);
+    card_tap(random_member());
+    if(!vmc_begin_session()) {
+        card_remove();
+        return;
+    }
+
+    uint8_t vends = rng_range(1, 3);
+    for(uint8_t i = 0; i < vends && vmc_state == VS_Session; i++) {
+        vmc_idle_polls(2);
+        uint16_t item = rng_range(1, 6);
+        if(vmc_vend_request(item, rng_range(50, 300))) {
+            vmc_idle_polls(2);
+            vmc_vend_result(rng_chance(90), item);
+        }
+    }
+
+    if(vmc_state != VS_Enabled) {
+        if(rng_chance(20)) {
+            // Customer walks away with the card before the VMC closes the session
+            card_remove();
+            vmc_poll();
+            if(vmc_state != VS_Enabled)
+                vmc_session_complete();
+        } else {
+            vmc_session_complete();
+            card_remove();
+        }
+    }
+    card_remove();
+    vmc_idle_polls(1);
+}
+
+//----------------------------------------------//
+// Global interfaces                            //
+//----------------------------------------------//
+void vsim_run(uint32_t sessions, uint32_t seed) {
+    log(LL_DEBUG, LM_VSIM, "vsim_run");
+
+    assertRtn(peri_check_dip(0x01), LL_WARNING, LM_VSIM, "Service mode is selected. VMC simulation skipped.");
+
+    log(LL_INFO, LM_VSIM, "Start VMC simulation. Sessions:", sessions);
+    log(LL_INFO, LM_VSIM, "Seed:", seed);
+
+    // Keep the logger quiet, otherwise it dominates every measurement
+    eLogLevel levels[LM_VSIM + 1];
+    for(uint8_t m = 0; m <= LM_VSIM; m++) {
+        levels[m] = getLogLevel((eLogModule) m);
+        setLogLevel((eLogModule) m, LL_WARNING);
+    }
+    setLogLevel(LM_VSIM, levels[LM_VSIM]);
+
+    rng_state = (seed != 0) ? seed : 0x2545F491;
+    cmd_count = 0;
+    session_count = 0;
+    vend_approved_count = 0;
+    vend_denied_count = 0;
+    violation_count = 0;
+    latency_reset(&cmd_latency);
+    latency_reset(&loop_latency);
+    latency_reset(&vend_latency);
+
+    vsim_member_count = 0;
+    for(uint32_t idx = 0; vsim_member_count < sizeof(vsim_member_ids) / sizeof(vsim_member_ids[0]); idx++) {
+        sMember *member = dh_get_member_from_idx(idx);
+        if(member == 0)
+            break;
+        vsim_member_ids[vsim_member_count++] = member->id;
+    }
+    assertCnt(vsim_member_count == 0, LL_WARNING, LM_VSIM, "No members loaded. All vends will be denied.");
+
+    dh_set_transaction_file(VSIM_TRANSACTION_FILE);
+    mdb_set_tx_hook(&vsim_tx_hook);
+    cldev_init();
+
+    uint32_t start = micros();
+
+    scenario_power_up();
+    scenario_vend(true);
+    scenario_vend(false);
+    scenario_card_removed();
+    scenario_disabled();
+    scenario_reader_cancel();
+    scenario_reset_in_session();
+    scenario_out_of_sequence();
+
+    uint32_t scripted_sessions = session_count;
+    uint32_t scripted_violations = violation_count;
+
+    for(uint32_t i = 0; i < sessions; i++)
+        random_session();
+
+    uint32_t elapsed = micros() - start;
+
+    // The header maintained in RAM must still be the one on the SD-card
+    scenario = "transaction header";
+    if(!dh_check_transaction_header())
+        violation("Header in RAM differs from the SD-card", 0);
+
+    // Hand the device back to the real bus and reader
+    mdb_set_tx_hook(0);
+    rfid_simulate_member(false, 0);
+    dh_set_transaction_file(0);
+    cldev_init();
+
+    for(uint8_t m = 0; m <= LM_VSIM; m++)
+        setLogLevel((eLogModule) m, levels[m]);
+
+    char text[96];
+    log(LL_INFO, LM_VSIM, "VMC simulation finished.");
+    sprintf(text, "%lu commands, %lu sessions (%lu scripted) in %lu ms", (unsigned long) cmd_count,
+            (unsigned long) session_count, (unsigned long) scripted_sessions, (unsigned long) (elapsed / 1000));
+    log(LL_INFO, LM_VSIM, text);
+    if(elapsed > 0) {
+        sprintf(text, "Throughput: %lu sessions/s, %lu commands/s",
+                (unsigned long) (((uint64_t) session_count * 1000000) / elapsed),
+                (unsigned long) (((uint64_t) cmd_count * 1000000) / elapsed));
+        log(LL_INFO, LM_VSIM, text);
+    }
+    sprintf(text, "Vends: %lu approved, %lu denied", (unsigned long) vend_approved_count, (unsigned long) vend_denied_count);
+    log(LL_INFO, LM_VSIM, text);
+    latency_report(&cmd_latency, "Command (ISR)");
+    latency_report(&loop_latency, "Loop cycle");
+    latency_report(&vend_latency, "Vend request to answer");
+
+    sprintf(text, "Protocol violations: %lu (%lu in scripted scenarios)", (unsigned long) violation_count, (unsigned long) scripted_violations);
+    if(violation_count > 0)
+        log(LL_WARNING, LM_VSIM, text);
+    else
+        log(LL_INFO, LM_VSIM, text);
+}
+
+uint32_t vsim_violations() {
+    return violation_count;
+}
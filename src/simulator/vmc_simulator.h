@@ -0,0 +1,15 @@
+#pragma once
+
+#include <Arduino.h>
+
+/**
+ * Simulated vending machine controller (VMC).
+ *
+ * Drives the cashless device through scripted and randomised MDB sequences
+ * while the bus and the RFID member detection are replaced by stand-ins.
+ * Reports throughput, latency percentiles and protocol violations.
+ * Must run before the MDB interrupt is attached.
+ **/
+void vsim_run(uint32_t sessions, uint32_t seed);
+
+uint32_t vsim_violations();
@@ -1,24 +1,225 @@
 #include "checksum.h"
+#include <string.h>
 
 #define MAGIC_PRIME 65521
+
+uint16_t checksum_word(const uint8_t *p) {
+	uint16_t word;
+	memcpy(&word, p, sizeof(word));
+	return word;
+}
+
+// Both sums are below MAGIC_PRIME before and after
+void checksum_words(sChecksum *cs, const uint8_t *p, uint32_t words) {
+	uint32_t sum1 = cs->sum1;
+	uint32_t sum2 = cs->sum2;
+
+	while (words > 0) {
+		uint32_t n = (words < CHECKSUM_NMAX) ? words : CHECKSUM_NMAX;
+		words -= n;
+
+		for (; n >= 4; n -= 4, p += 8) {
+			sum1 += checksum_word(p);		sum2 += sum1;
+			sum1 += checksum_word(p + 2);	sum2 += sum1;
+			sum1 += checksum_word(p + 4);	sum2 += sum1;
+			sum1 += checksum_word(p + 6);	sum2 += sum1;
+		}
+		for (; n > 0; n--, p += 2) {
+			sum1 += checksum_word(p);
+			sum2 += sum1;
+		}
+
+		sum1 %= MAGIC_PRIME;
+		sum2 %= MAGIC_PRIME;
+	}
+
+	cs->sum1 = sum1;
+	cs->sum2 = sum2;
+}
+
+void checksum_init(sChecksum *cs) {
+	cs->sum1 = 0;
+	cs->sum2 = 0;
+	cs->pending = 0;
+	cs->has_pending = false;
+}
+
+void checksum_update(sChecksum *cs, const void *buf, uint32_t len) {
+	const uint8_t *p = (const uint8_t*) buf;
+
+	if (len == 0)
+		return;
+
+	// Complete the word started by the last update
+	if (cs->has_pending) {
+		uint8_t word[2] = { cs->pending, p[0] };
+		checksum_words(cs, word, 1);
+		cs->has_pending = false;
+		p++;
+		len--;
+	}
+
+	checksum_words(cs, p, len / 2);
+
+	if (len & 1) {
+		cs->pending = p[len - 1];
+		cs->has_pending = true;
+	}
+}
+
+uint32_t checksum_final(const sChecksum *cs) {
+	return ((cs->sum2 << 16) | cs->sum1);
+}
+
 uint32_t calculate_checksum(uint16_t *buf, uint32_t len) {
+	sChecksum cs;
+	checksum_init(&cs);
+	checksum_words(&cs, (const uint8_t*) buf, len / 2);
+	return checksum_final(&cs);
+}
+
+// Word k of n counts once into sum1 and n-k times into sum2
+uint32_t checksum_patch(uint32_t checksum, uint32_t len, uint32_t offset, const void *old_data, const void *new_data, uint32_t size) {
+	const uint8_t *old_p = (const uint8_t*) old_data;
+	const uint8_t *new_p = (const uint8_t*) new_data;
+	uint32_t sum1 = checksum & 0xFFFF;
+	uint32_t sum2 = checksum >> 16;
+	uint32_t words = len / 2;
+
+	for (uint32_t k = offset / 2; k < (offset + size) / 2 && k < words; k++, old_p += 2, new_p += 2) {
+		uint32_t diff = (checksum_word(new_p) % MAGIC_PRIME + MAGIC_PRIME - checksum_word(old_p) % MAGIC_PRIME) % MAGIC_PRIME;
+		sum1 = (sum1 + diff) % MAGIC_PRIME;
+		sum2 = (sum2 + ((words - k) % MAGIC_PRIME) * diff % MAGIC_PRIME) % MAGIC_PRIME;
+	}
+	return ((sum2 << 16) | sum1);
+}
 
+// The former implementation, one modulo per sum and word
+uint32_t checksum_reference(const uint16_t *buf, uint32_t len) {
 	uint32_t sum1 = 0;
 	uint32_t sum2 = 0;
 
 	len /= 2;
-	for (uint32_t i = 0; i < len; i++)
-	{
+	for (uint32_t i = 0; i < len; i++) {
 		sum1 = (sum1 + buf[i]) % MAGIC_PRIME;
 		sum2 = (sum2 + sum1) % MAGIC_PRIME;
+	}
+	return ((sum2 << 16) | sum1);
+}
+
+uint32_t checksum_random(uint32_t *state) {
+	// xorshift32: same sequence on the Teensy and the PC
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+uint32_t checksum_selftest(uint32_t rounds, uint32_t seed) {
+	// Long enough for several reductions. All 0xFFFF is the worst case for the deferred sums.
+	static uint16_t data[4 * CHECKSUM_NMAX + 3];
+	uint32_t state = (seed != 0) ? seed : 1;
+	uint32_t errors = 0;
+
+	for (uint32_t r = 0; r < rounds; r++) {
+		uint32_t len = checksum_random(&state) % (sizeof(data) + 1);
+		bool worst = (r % 8) == 0;
+		for (uint32_t i = 0; i < sizeof(data) / 2; i++)
+			data[i] = worst ? 0xFFFF : (uint16_t) checksum_random(&state);
 
-		#ifndef WIN32
-		log(LL_DEBUG, LM_CS, "Word: ", (uint32_t) buf[i]);
-		log(LL_DEBUG, LM_CS, "Sum1: ", sum1);
-		log(LL_DEBUG, LM_CS, "Sum2: ", sum2);
-		#endif
-		
+		uint32_t expected = checksum_reference(data, len);
+
+		if (calculate_checksum(data, len) != expected)
+			errors++;
+
+		// Up to three chunks of any length, also odd ones
+		uint32_t split1 = checksum_random(&state) % (len + 1);
+		uint32_t split2 = split1 + checksum_random(&state) % (len - split1 + 1);
+		sChecksum cs;
+		checksum_init(&cs);
+		checksum_update(&cs, (uint8_t*) data, split1);
+		checksum_update(&cs, (uint8_t*) data + split1, split2 - split1);
+		checksum_update(&cs, (uint8_t*) data + split2, len - split2);
+		if (checksum_final(&cs) != expected)
+			errors++;
+
+		// Patch a few words and compare with the full checksum
+		uint32_t words = len / 2;
+		if (words > 0) {
+			uint32_t first = checksum_random(&state) % words;
+			uint32_t count = 1 + checksum_random(&state) % ((words - first < 4) ? words - first : 4);
+			uint16_t old_words[4];
+			memcpy(old_words, &data[first], count * 2);
+			for (uint32_t i = 0; i < count; i++)
+				data[first + i] = (uint16_t) checksum_random(&state);
+			if (checksum_patch(expected, len, first * 2, old_words, &data[first], count * 2) != checksum_reference(data, len))
+				errors++;
+		}
 	}
+	return errors;
+}
 
-	return ((sum2 << 16) | sum1);
-}
\ No newline at end of file
+#ifndef WIN32
+void checksum_bench() {
+	const uint32_t ROUNDS = 1000;
+	const uint32_t RECORD = 20;				// about a transaction
+	const uint32_t BLOCK = 4096;
+	const uint32_t STREAM = 4UL * 1024 * 1024;
+	static uint16_t data[BLOCK / 2];
+
+	uint32_t errors = checksum_selftest(ROUNDS, 1);
+	assertCnt(errors > 0, LL_ERROR, LM_CS, "Checksum bench: deferred modulo differs from the reference");
+
+	uint32_t state = 1;
+	for (uint32_t i = 0; i < BLOCK / 2; i++)
+		data[i] = (uint16_t) checksum_random(&state);
+
+	// The results are summed up so that the compiler can't drop the calls
+	volatile uint32_t sink = 0;
+	uint32_t cycles[4];
+	uint32_t stream_us[2];
+
+	ARM_DEMCR |= ARM_DEMCR_TRCENA;
+	ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+
+	uint32_t start = ARM_DWT_CYCCNT;
+	for (uint32_t r = 0; r < ROUNDS; r++) sink += checksum_reference(data, RECORD);
+	cycles[0] = ARM_DWT_CYCCNT - start;
+
+	start = ARM_DWT_CYCCNT;
+	for (uint32_t r = 0; r < ROUNDS; r++) sink += calculate_checksum(data, RECORD);
+	cycles[1] = ARM_DWT_CYCCNT - start;
+
+	start = ARM_DWT_CYCCNT;
+	for (uint32_t r = 0; r < 10; r++) sink += checksum_reference(data, BLOCK);
+	cycles[2] = ARM_DWT_CYCCNT - start;
+
+	start = ARM_DWT_CYCCNT;
+	for (uint32_t r = 0; r < 10; r++) sink += calculate_checksum(data, BLOCK);
+	cycles[3] = ARM_DWT_CYCCNT - start;
+
+	// More than the RAM: the same block again and again. The cycle counter would wrap, so in us.
+	// The reference can't continue a stream: only the speed is compared.
+	uint32_t us = micros();
+	for (uint32_t done = 0; done < STREAM; done += BLOCK)
+		sink += checksum_reference(data, BLOCK);
+	stream_us[0] = micros() - us;
+
+	us = micros();
+	sChecksum cs;
+	checksum_init(&cs);
+	for (uint32_t done = 0; done < STREAM; done += BLOCK)
+		checksum_update(&cs, data, BLOCK);
+	sink += checksum_final(&cs);
+	stream_us[1] = micros() - us;
+
+	log(LL_INFO, LM_CS, "Record reference [cycles/record]:", cycles[0] / ROUNDS);
+	log(LL_INFO, LM_CS, "Record deferred  [cycles/record]:", cycles[1] / ROUNDS);
+	log(LL_INFO, LM_CS, "4 KB reference [bytes/cycle]:", (float) (10 * BLOCK) / cycles[2]);
+	log(LL_INFO, LM_CS, "4 KB deferred  [bytes/cycle]:", (float) (10 * BLOCK) / cycles[3]);
+	log(LL_INFO, LM_CS, "4 MB reference [ms]:", stream_us[0] / 1000);
+	log(LL_INFO, LM_CS, "4 MB deferred  [ms]:", stream_us[1] / 1000);
+}
+#endif
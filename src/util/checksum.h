@@ -1,3 +1,5 @@
+#pragma once
+
 #ifdef WIN32
 #include <stdint.h>
 #else
@@ -5,4 +7,43 @@
 #include "error.h"
 #endif
 
-uint32_t calculate_checksum(uint16_t *buf, uint32_t len);
\ No newline at end of file
+/**
+ * Fletcher-32 style checksum over 16 bit words in memory order (little endian on the Teensy and the PC),
+ * both sums modulo 65521.
+ *
+ * The sums are only reduced every CHECKSUM_NMAX words (as zlib does for Adler-32), the largest count for
+ * which they can't overflow 32 bits. A trailing odd byte is not part of the checksum.
+ **/
+
+// n(n+1)/2 * 65535 + (n+1) * 65520 <= 2^32 - 1
+#define CHECKSUM_NMAX 360
+
+struct sChecksum {
+	uint32_t sum1;
+	uint32_t sum2;
+	uint8_t pending;		// first byte of a word split between two updates
+	bool has_pending;
+};
+
+// Streaming: the data may be split anywhere, also between the two bytes of a word
+void checksum_init(sChecksum *cs);
+void checksum_update(sChecksum *cs, const void *buf, uint32_t len);
+uint32_t checksum_final(const sChecksum *cs);
+
+// One pass over len bytes
+uint32_t calculate_checksum(uint16_t *buf, uint32_t len);
+
+// Checksum of len bytes after size bytes at offset changed from old_data to new_data, without the unchanged rest.
+// offset and size must be even.
+uint32_t checksum_patch(uint32_t checksum, uint32_t len, uint32_t offset, const void *old_data, const void *new_data, uint32_t size);
+
+// The former implementation with one modulo per word, for the cross-check and the benches
+uint32_t checksum_reference(const uint16_t *buf, uint32_t len);
+
+// Cross-check against the former word-by-word implementation on random data and splits. Returns the number of mismatches.
+uint32_t checksum_selftest(uint32_t rounds, uint32_t seed);
+
+#ifndef WIN32
+// Selftest and speed of both implementations on a record, a 4 KB block and 4 MB streamed through a 4 KB buffer
+void checksum_bench();
+#endif
@@ -6,17 +6,29 @@
 // Logger:
 #define LOG_BUFFER_SIZE     65536
 #define LOG_STORE_THRESHOLD 52480
+#define LOG_STORE_CHUNK     4096
 char logBuffer[LOG_BUFFER_SIZE];
 uint32_t logLength;
 bool logStoreTrigger;
 #define LOG_STORE_TRIGGER_DIP 0x08
 bool logPrepared;
 
+// Log file being stored, one chunk per step. logStoreLength is 0 if no store is running.
+uint32_t logStoreLength;
+uint32_t logStorePos;
+
+// The MDB ISR logs as well: appending and moving the buffer must not be interrupted.
+// Inside the ISR PRIMASK is clear anyway, so interrupts() doesn't enable anything there.
 void LogWrite(const char *str) {
     Serial.write(str);
+    noInterrupts();
     int32_t n = snprintf(logBuffer+logLength, LOG_BUFFER_SIZE-logLength, str);
+    // A full buffer keeps what fits, snprintf() returns the length it wanted
+    if(n > (int32_t) (LOG_BUFFER_SIZE-1-logLength))
+        n = LOG_BUFFER_SIZE-1-logLength;
     if(n > 0)
         logLength += n;
+    interrupts();
 }
 
 void LogWriteHex(uint8_t i) {
@@ -34,10 +46,14 @@ void LogWriteUInt(uint32_t i) {
 void err_log_reset() {
     logBuffer[0] = 0;
     logLength = 0;
+    logStoreLength = 0;
     logStoreTrigger = peri_check_dip(LOG_STORE_TRIGGER_DIP);
 }
 
 void err_log_can_store() {
+    if(logStoreLength > 0)
+        return;
+
     if((logLength >= LOG_STORE_THRESHOLD) || (logStoreTrigger != peri_check_dip(LOG_STORE_TRIGGER_DIP))) {
 
         if(!logPrepared) {
@@ -45,13 +61,39 @@ void err_log_can_store() {
             logPrepared = dh_prepare_log();
         }
 
+        // The buffer up to here goes into the next log file
         if(logPrepared) {
-            dh_store_log(logBuffer, logLength);
-            err_log_reset();
+            logStoreLength = logLength;
+            logStorePos = 0;
         }
     }
 }
 
+bool err_log_store_step() {
+    if(logStoreLength == 0)
+        return false;
+
+    uint32_t len = logStoreLength - logStorePos;
+    if(len > LOG_STORE_CHUNK)
+        len = LOG_STORE_CHUNK;
+
+    dh_store_log(logStorePos, logBuffer + logStorePos, len);
+    logStorePos += len;
+    if(logStorePos < logStoreLength)
+        return true;
+
+    // Lines logged while storing stay for the next file
+    noInterrupts();
+    logLength -= logStoreLength;
+    memmove(logBuffer, logBuffer + logStoreLength, logLength);
+    logBuffer[logLength] = 0;
+    interrupts();
+    logStoreLength = 0;
+    logStoreTrigger = peri_check_dip(LOG_STORE_TRIGGER_DIP);
+    dh_next_log();
+    return false;
+}
+
 // Error:
 eLogLevel logLevel[32];
 uint8_t logLevelCount = 32;
@@ -95,6 +137,12 @@ const char* getModuleName(eLogModule module) {
             return "Service";
         case LM_TSERV:
             return "TimeServ";
+        case LM_VSIM:
+            return "VmcSim";
+        case LM_CEMU:
+            return "CardEmu";
+        case LM_SCHED:
+            return "Sched";
         default:
             return "UNKNOWN"; 
     }
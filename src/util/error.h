@@ -37,7 +37,10 @@ enum eLogModule {
     LM_CS = 14,
     LM_PERI = 15,
     LM_SERV = 16,
-    LM_TSERV = 17
+    LM_TSERV = 17,
+    LM_VSIM = 18,
+    LM_CEMU = 19,
+    LM_SCHED = 20
 };
 
 void setLogLevel(eLogLevel level);
@@ -49,6 +52,8 @@ bool checkLogLevel(eLogModule module, eLogLevel level);
 void err_init();
 void err_log_can_store();
 void err_log_reset();
+// Loop: stores one chunk of the log buffer started by err_log_can_store(). True while chunks are left.
+bool err_log_store_step();
 
 uint32_t getAssertCount();
 void assertInc();
@@ -0,0 +1,159 @@
+#include "scheduler.h"
+#include "error.h"
+#include <atomic>
+
+struct sSchedTask {
+    const char *name;
+    uint8_t priority;
+    tSchedStep step;
+    uint32_t period;            // ms, 0: not periodic
+    uint32_t due;               // millis() of the next run, valid if timed
+    bool timed;
+    bool busy;                  // the last step asked for another one
+    std::atomic<bool> woken;    // set by sched_wake(), also from an ISR
+
+    // Runtime accounting since the last sched_log_stats()
+    uint32_t runs;              // completed runs (last step returned false)
+    uint32_t steps;
+    uint64_t total_us;
+    uint32_t max_us;
+};
+
+sSchedTask sched_tasks[SCHED_MAX_TASKS];
+uint8_t sched_count = 0;
+
+// Task handles by priority, highest first
+uint8_t sched_order[SCHED_MAX_TASKS];
+
+uint32_t sched_idle_rounds;
+uint32_t sched_stats_start;     // millis()
+
+uint8_t sched_add(const char name[], uint8_t priority, tSchedStep step, uint32_t period) {
+    log(LL_DEBUG, LM_SCHED, "sched_add");
+
+    assertDo(sched_count >= SCHED_MAX_TASKS, LL_ERROR, LM_SCHED, "Task table is full. Can't add task", return SCHED_NO_TASK;);
+
+    uint8_t task = sched_count++;
+    sSchedTask *t = &sched_tasks[task];
+    t->name = name;
+    t->priority = priority;
+    t->step = step;
+    t->period = period;
+    t->due = millis();
+    t->timed = (period > 0);
+    t->busy = false;
+    t->woken = false;
+    t->runs = 0;
+    t->steps = 0;
+    t->total_us = 0;
+    t->max_us = 0;
+
+    // Insert behind all tasks of the same or a higher priority
+    uint8_t i = task;
+    for(; i > 0 && sched_tasks[sched_order[i-1]].priority > priority; i--)
+        sched_order[i] = sched_order[i-1];
+    sched_order[i] = task;
+
+    if(task == 0) {
+        sched_idle_rounds = 0;
+        sched_stats_start = millis();
+    }
+    return task;
+}
+
+void sched_set_period(uint8_t task, uint32_t period) {
+    if(task >= sched_count)
+        return;
+    sched_tasks[task].period = period;
+}
+
+void sched_start(uint8_t task, uint32_t delay) {
+    if(task >= sched_count)
+        return;
+    sched_tasks[task].due = millis() + delay;
+    sched_tasks[task].timed = true;
+}
+
+void sched_wake(uint8_t task) {
+    if(task >= sched_count)
+        return;
+    sched_tasks[task].woken = true;
+}
+
+void sched_stop(uint8_t task) {
+    if(task >= sched_count)
+        return;
+    sched_tasks[task].timed = false;
+    sched_tasks[task].busy = false;
+    sched_tasks[task].woken = false;
+}
+
+bool sched_is_due(sSchedTask *t, uint32_t now) {
+    return t->busy || t->woken.load() || (t->timed && (int32_t) (now - t->due) >= 0);
+}
+
+bool sched_run() {
+    uint32_t now = millis();
+
+    sSchedTask *t = 0;
+    for(uint8_t i = 0; i < sched_count; i++) {
+        if(sched_is_due(&sched_tasks[sched_order[i]], now)) {
+            t = &sched_tasks[sched_order[i]];
+            break;
+        }
+    }
+
+    if(t == 0) {
+        sched_idle_rounds++;
+        return false;
+    }
+
+    // A wake during the step runs the task again
+    t->woken = false;
+
+    uint32_t start = micros();
+    t->busy = t->step();
+    uint32_t elapsed = micros() - start;
+
+    t->steps++;
+    t->total_us += elapsed;
+    if(elapsed > t->max_us)
+        t->max_us = elapsed;
+
+    if(!t->busy) {
+        t->runs++;
+        // Periodic tasks count from the end of their run, a one-shot timer has expired
+        t->timed = (t->period > 0);
+        if(t->timed)
+            t->due = millis() + t->period;
+    }
+    return true;
+}
+
+void sched_log_stats() {
+    uint32_t elapsed = millis() - sched_stats_start;
+
+    char text[96];
+    log(LL_INFO, LM_SCHED, "Task      prio   runs  steps  avg[us]  max[us]  cpu[%]");
+    for(uint8_t i = 0; i < sched_count; i++) {
+        sSchedTask *t = &sched_tasks[sched_order[i]];
+        sprintf(text, "%-9s %4u %6lu %6lu %8lu %8lu %7lu",
+                t->name,
+                t->priority,
+                (unsigned long) t->runs,
+                (unsigned long) t->steps,
+                (unsigned long) (t->steps > 0 ? t->total_us / t->steps : 0),
+                (unsigned long) t->max_us,
+                (unsigned long) (elapsed > 0 ? t->total_us / (elapsed * 10ULL) : 0));
+        log(LL_INFO, LM_SCHED, text);
+
+        t->runs = 0;
+        t->steps = 0;
+        t->total_us = 0;
+        t->max_us = 0;
+    }
+    log(LL_INFO, LM_SCHED, "Idle rounds:", sched_idle_rounds);
+
+    sched_idle_rounds = 0;
+    sched_stats_start = millis();
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <Arduino.h>
+
+/**
+ * Cooperative scheduler for the loop.
+ *
+ * A task is a step function which must return quickly. It returns true while it has more steps to do
+ * (a resumable state machine keeping its state between the steps), then it is run again in the next round.
+ * Each round runs one step of the highest priority task that is due, so one step of a lower priority task
+ * is the longest a higher priority task has to wait.
+ *
+ * A periodic task is due again period ms after its last step finished. A task without a period only runs
+ * when it is started (one-shot timer) or woken.
+ **/
+
+#define SCHED_MAX_TASKS     8
+#define SCHED_NO_TASK       0xFF
+
+typedef bool (*tSchedStep)();
+
+// priority: 0 is the highest. Returns the task handle or SCHED_NO_TASK if the table is full.
+uint8_t sched_add(const char name[], uint8_t priority, tSchedStep step, uint32_t period);
+
+void sched_set_period(uint8_t task, uint32_t period);   // 0: no further periodic runs
+void sched_start(uint8_t task, uint32_t delay);         // one-shot: due after delay ms
+void sched_wake(uint8_t task);                          // due in the next round. Also from an ISR.
+void sched_stop(uint8_t task);                          // until it is started or woken again
+
+// Loop: runs one step of the highest priority task that is due. False if no task was due.
+bool sched_run();
+
+// Runtime accounting per task since the last call, then starts over
+void sched_log_stats();
@@ -0,0 +1,147 @@
+#include "timer_wheel.h"
+#include "../rfid/Utils.h"
+
+#define TW_LEVELS       4
+#define TW_SLOT_BITS    6
+#define TW_SLOTS        (1 << TW_SLOT_BITS)
+#define TW_SLOT_MASK    (TW_SLOTS - 1)
+#define TW_RANGE        (1ULL << (TW_LEVELS * TW_SLOT_BITS))
+
+// Each slot is a circular list behind a head node
+sTimer tw_slots[TW_LEVELS][TW_SLOTS];
+bool tw_ready = false;
+
+// Next tick to be processed. Every armed timer expires at it or later.
+uint64_t tw_tick;
+uint32_t tw_count;
+
+void tw_init() {
+    for(uint8_t level = 0; level < TW_LEVELS; level++) {
+        for(uint8_t slot = 0; slot < TW_SLOTS; slot++) {
+            tw_slots[level][slot].next = &tw_slots[level][slot];
+            tw_slots[level][slot].prev = &tw_slots[level][slot];
+        }
+    }
+    tw_tick = Utils::GetMillis64();
+    tw_count = 0;
+    tw_ready = true;
+}
+
+uint64_t tw_now() {
+    return Utils::GetMillis64();
+}
+
+void tw_unlink(sTimer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = 0;
+    timer->prev = 0;
+}
+
+void tw_insert(sTimer *head, sTimer *timer) {
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+// The level is chosen by the distance, the slot by the expiry time. A slot of a higher level is moved down
+// when the lower level wraps into it, which is never after the expiry of its timers.
+void tw_place(sTimer *timer) {
+    uint64_t at = (timer->expires < tw_tick) ? tw_tick : timer->expires;
+    uint64_t delta = at - tw_tick;
+
+    // Too far ahead: parked at the end of the wheel
+    if(delta >= TW_RANGE) {
+        delta = TW_RANGE - 1;
+        at = tw_tick + delta;
+    }
+
+    uint8_t level = 0;
+    while(delta >= (1ULL << ((level + 1) * TW_SLOT_BITS)))
+        level++;
+
+    tw_insert(&tw_slots[level][(at >> (level * TW_SLOT_BITS)) & TW_SLOT_MASK], timer);
+}
+
+void tw_arm(sTimer *timer, uint32_t delay) {
+    if(!tw_ready)
+        tw_init();
+
+    if(timer->next != 0)
+        tw_unlink(timer);
+    else
+        tw_count++;
+
+    timer->expires = Utils::GetMillis64() + delay;
+    tw_place(timer);
+}
+
+void tw_cancel(sTimer *timer) {
+    if(timer->next == 0)
+        return;
+
+    tw_unlink(timer);
+    tw_count--;
+}
+
+bool tw_armed(const sTimer *timer) {
+    return timer->next != 0;
+}
+
+void tw_cascade(uint8_t level, uint8_t slot) {
+    sTimer *head = &tw_slots[level][slot];
+    while(head->next != head) {
+        sTimer *timer = head->next;
+        tw_unlink(timer);
+        tw_place(timer);
+    }
+}
+
+bool tw_run() {
+    if(!tw_ready)
+        tw_init();
+
+    uint64_t now = Utils::GetMillis64();
+
+    while(tw_tick <= now) {
+        // Nothing armed: no need to walk the ticks
+        if(tw_count == 0) {
+            tw_tick = now + 1;
+            break;
+        }
+
+        uint8_t slot = tw_tick & TW_SLOT_MASK;
+
+        // Level 0 wrapped: the next slot of each higher level that wrapped too comes down
+        for(uint8_t level = 1; level < TW_LEVELS && slot == 0; level++) {
+            uint8_t upper = (tw_tick >> (level * TW_SLOT_BITS)) & TW_SLOT_MASK;
+            tw_cascade(level, upper);
+            if(upper != 0)
+                break;
+        }
+
+        // Take the expired timers off the wheel first: a callback arming with delay 0 expires with the next tick
+        sTimer expired;
+        sTimer *head = &tw_slots[0][slot];
+        expired.next = &expired;
+        expired.prev = &expired;
+        if(head->next != head) {
+            expired.next = head->next;
+            expired.prev = head->prev;
+            expired.next->prev = &expired;
+            expired.prev->next = &expired;
+            head->next = head;
+            head->prev = head;
+        }
+        tw_tick++;
+
+        while(expired.next != &expired) {
+            sTimer *timer = expired.next;
+            tw_unlink(timer);
+            tw_count--;
+            (*timer->callback)();
+        }
+    }
+    return false;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <Arduino.h>
+
+/**
+ * Hierarchical timer wheel on the 64 bit millisecond ticks of Utils::GetMillis64().
+ *
+ * 4 levels of 64 slots: level 0 has one slot per ms, each further level covers 64 times more (4.6 h ahead).
+ * Timers further ahead are parked in the last level and placed again when they come closer.
+ * Arming, cancelling and expiring a timer is O(1): nobody polls timers anymore.
+ *
+ * Loop context only. The callbacks run in tw_run() and may arm or cancel any timer.
+ **/
+
+struct sTimer {
+    sTimer *next;           // 0 if not armed
+    sTimer *prev;
+    uint64_t expires;
+    void (*callback)();
+};
+
+#define TW_TIMER(callback)  { 0, 0, 0, callback }
+
+uint64_t tw_now();
+
+void tw_arm(sTimer *timer, uint32_t delay);     // (re)starts the timer, callback after delay ms
+void tw_cancel(sTimer *timer);
+bool tw_armed(const sTimer *timer);
+
+// Loop: runs the callbacks of all expired timers. Returns false, for the scheduler.
+bool tw_run();